@@ -50,16 +50,37 @@ public:
   string ir_command;
 };
 
-std::map<string, ir_device> device_store;
-CREATE_LOCK (device_store);
+/// The ir senders and devices read from the device file. A table is never
+/// changed once it is in use, a reload builds a new one.
+///
+class ir_device_table
+{
+public:
+  std::map<string, ir_sender> senders;
+  std::map<string, ir_device> devices;
+};
 
-std::map<string, ir_sender> ir_sender_store;
-CREATE_LOCK (ir_sender_store);
+typedef std::shared_ptr<const ir_device_table> ir_device_table_ptr;
 
 // TODO: We probably need a more advanced data structure here, later... 
-std::map<string, ir_command> ircommand_store;
+typedef std::map<string, ir_command> ir_command_table;
+typedef std::shared_ptr<const ir_command_table> ir_command_table_ptr;
+
+/// The current tables. Readers take a reference with std::atomic_load and
+/// never lock, a reload swaps in a new table with std::atomic_store.
+///
+ir_device_table_ptr device_store (new ir_device_table);
+CREATE_LOCK (device_store);
+
+ir_command_table_ptr ircommand_store (new ir_command_table);
 CREATE_LOCK (ircommand_store);
 
+/// The connected ir senders, with their sockets. Rebuilt from the device table
+/// when the senders are connected.
+///
+std::map<string, ir_sender> ir_sender_store;
+CREATE_LOCK (ir_sender_store);
+
 
 //=============================================================================
 // openDHANA_ir__comms__
@@ -284,6 +305,8 @@ openDHANA_ir__comms__connect_senders ()
   // TODO: some sort of reconnect function
   INFO ("comms/connection", "connecting all ir_senders.");
 
+  ir_sender_store = std::atomic_load (&device_store)->senders;
+
   for (std::map<string, ir_sender>::iterator ir_sender =
           ir_sender_store.begin (); ir_sender != ir_sender_store.end ();
           ir_sender++)
@@ -321,6 +344,8 @@ openDHANA_ir__comms__disconnect_senders ()
         openDHANA_ir__comms__close_connection (socket);
     }
 
+  ir_sender_store.clear ();
+
   INFO ("comms/connection", "all ir_senders disconnected.");
   UNLOCK (ir_sender_store);
 
@@ -375,9 +400,6 @@ openDHANA_ir__comms__query_senders ()
 int
 openDHANA_ir__lua_function__send_ir (lua_State *L)
 {
-  LOCK (ir_sender_store);
-  LOCK (ircommand_store);
-
   int argc = lua_gettop (L);
 
   if (argc != 2)
@@ -389,12 +411,8 @@ openDHANA_ir__lua_function__send_ir (lua_State *L)
         {
           WARNING ("lua/function",
                    "Lua 'openDAHANA_send_ir' expects 2 strings as parameters.");
-          UNLOCK (ircommand_store);
-          UNLOCK (ir_sender_store);
           return 0;
         }
-      UNLOCK (ircommand_store);
-      UNLOCK (ir_sender_store);
       return 0;
     }
 
@@ -404,36 +422,47 @@ openDHANA_ir__lua_function__send_ir (lua_State *L)
   INFO ("lua/function",
         "openDHANA_send_ir(\"" + ir_command + "\", \"" + device + "\").");
 
+  // Use the current tables, a reload does not affect them while we hold them
+
+  ir_device_table_ptr devices = std::atomic_load (&device_store);
+  ir_command_table_ptr ircommands = std::atomic_load (&ircommand_store);
+
   // Get the the ir port of the device. That is where we send it
 
-  string itach = device_store[device].itach;
-  string ir_port = device_store[device].ir_port;
-  string equipment = device_store[device].equipment;
+  std::map<string, ir_device>::const_iterator dev =
+          devices->devices.find (device);
 
-  // Get the socket that is opened to the named IR sender
+  if (dev == devices->devices.end ())
+    {
+      WARNING ("comms/protocol",
+               "device \"" + device + "\" not defined, ignored.");
+      return 0;
+    }
 
-  int socket = ir_sender_store[itach].socket;
+  string itach = dev->second.itach;
+  string ir_port = dev->second.ir_port;
+  string equipment = dev->second.equipment;
 
   // Get the actual IR command that we need to send
   string key = equipment + "::" + ir_command;
 
-  if (ircommand_store.count (key) == 0)
+  ir_command_table::const_iterator ircmd = ircommands->find (key);
+
+  if (ircmd == ircommands->end ())
     {
       WARNING ("comms/protocol",
                "ir command \"" + ir_command + "\" for \"" + device
                + "\" not defined, ignored.");
-      UNLOCK (ircommand_store);
-      UNLOCK (ir_sender_store);
       return 0;
     }
 
   // The command exists, check its format
 
   string ir;
-  if (ircommand_store[key].ir_type == "hex")
-    ir = openDHANA_ir__comms__hex_to_sendir (ircommand_store[key].ir_command);
+  if (ircmd->second.ir_type == "hex")
+    ir = openDHANA_ir__comms__hex_to_sendir (ircmd->second.ir_command);
   else
-    ir = ircommand_store[key].ir_command;
+    ir = ircmd->second.ir_command;
 
   //sendir,<mod-addr>:<conn-addr>,1,38000,<repeatcount>,1,341,170,22,...
 
@@ -441,6 +470,12 @@ openDHANA_ir__lua_function__send_ir (lua_State *L)
 
   string command = "sendir," + ir_port + ",9999,38000,1," + ir + "\r";
 
+  // Get the socket that is opened to the named IR sender
+
+  LOCK (ir_sender_store);
+
+  int socket = ir_sender_store[itach].socket;
+
   string response =
           openDHANA_ir__comms__send_and_get_response (socket, command);
 
@@ -451,7 +486,6 @@ openDHANA_ir__lua_function__send_ir (lua_State *L)
       WARNING ("comms/protocol",
                "itach response \"" + response + "\" not expected.");
     }
-  UNLOCK (ircommand_store);
   UNLOCK (ir_sender_store);
   return 0;
 }
@@ -463,22 +497,31 @@ openDHANA_ir__lua_function__send_ir (lua_State *L)
 
 /// We get a message from the MQTT broker
 ///
+/// @param topic                the id of the internal topic.
 /// @param internal_topic       the internal topic that the MQTT topic
 ///                             translated into.
-/// @param message              the MQTT message
+/// @param message              the MQTT message, a view of the payload that
+///                             is only valid during the call.
+/// @param wildcards            the levels of the MQTT topic matched by the
+///                             wildcards of the subscription.
 ///
 
 void
-moduleMessageCallback (const string& internal_topic,
-                       const string& message)
+moduleMessageCallback (topic_id topic,
+                       const string& internal_topic,
+                       const line_view& message,
+                       const string_vector& wildcards)
 {
-  // Cache the message
-  openDHANA__lua__value_cache[internal_topic] = message;
+  // Cache the message, not from a wildcard subscription that gets many topics
+  if (wildcards.empty ())
+    openDHANA__lua__value_cache[topic].assign (message.data, message.length);
 
   INFO ("mqtt/comms",
-        "internal_topic: \"" + internal_topic + "\" = \"" + message + "\".");
+        "internal_topic: \"" + internal_topic + "\" = \"" + message.str ()
+        + "\".");
 
-  openDHANA__lua__call_function_in_all_scripts (internal_topic, message);
+  openDHANA__lua__call_function_in_all_scripts (topic, internal_topic,
+                                                message, wildcards);
 }
 
 ///
@@ -487,116 +530,309 @@ moduleMessageCallback (const string& internal_topic,
 //=============================================================================
 #ifndef openDHANA_ir__config_files__
 
+/// Load the ir senders and devices from the snapshot of the device file.
+///
+/// @param device_file          the path to the device file.
+/// @param file                 the device file, open.
+/// @param table                the table to load into, it must be empty.
+/// @return                     __true__ if the snapshot was valid and loaded,
+///                             __false__ otherwise.
+///
+
+bool
+openDHANA_ir__config_files__load_devices_snapshot (const string& device_file,
+                                                   const config_file& file,
+                                                   ir_device_table& table)
+{
+  config_snapshot snapshot;
+  std::map<string, ir_sender> senders;
+  std::map<string, ir_device> devices;
+  int count;
+
+  if (!snapshot.load (device_file, file))
+    return false;
+
+  if (!snapshot.getInt (count))
+    return false;
+  for (int i = 0; i != count; i++)
+    {
+      string name;
+      ir_sender sender;
+
+      if (!snapshot.getString (name)
+          || !snapshot.getString (sender.address)
+          || !snapshot.getString (sender.port)
+          || !snapshot.getString (sender.type))
+        return false;
+
+      sender.socket = 0;
+      senders[name] = sender;
+    }
+
+  if (!snapshot.getInt (count))
+    return false;
+  for (int i = 0; i != count; i++)
+    {
+      string name;
+      ir_device dev;
+
+      if (!snapshot.getString (name)
+          || !snapshot.getString (dev.itach)
+          || !snapshot.getString (dev.ir_port)
+          || !snapshot.getString (dev.equipment))
+        return false;
+
+      devices[name] = dev;
+    }
+
+  table.senders.swap (senders);
+  table.devices.swap (devices);
+
+  return true;
+}
+
+/// Save the ir senders and devices to a snapshot of the device file.
+///
+/// @param device_file          the path to the device file.
+/// @param file                 the device file the table was parsed from.
+/// @param table                the table to save.
+///
+
+void
+openDHANA_ir__config_files__save_devices_snapshot (const string& device_file,
+                                                   const config_file& file,
+                                                   const ir_device_table& table)
+{
+  config_snapshot snapshot;
+
+  snapshot.putInt (table.senders.size ());
+  for (std::map<string, ir_sender>::const_iterator sender =
+          table.senders.begin (); sender != table.senders.end (); ++sender)
+    {
+      snapshot.putString (sender->first);
+      snapshot.putString (sender->second.address);
+      snapshot.putString (sender->second.port);
+      snapshot.putString (sender->second.type);
+    }
+
+  snapshot.putInt (table.devices.size ());
+  for (std::map<string, ir_device>::const_iterator dev = table.devices.begin ();
+          dev != table.devices.end (); ++dev)
+    {
+      snapshot.putString (dev->first);
+      snapshot.putString (dev->second.itach);
+      snapshot.putString (dev->second.ir_port);
+      snapshot.putString (dev->second.equipment);
+    }
+
+  snapshot.save (device_file, file);
+}
+
+/// Load the ir commands from the snapshot of the ir commands file.
+///
+/// @param ircommands_file      the path to the ir commands file.
+/// @param file                 the ir commands file, open.
+/// @param table                the table to load into, it must be empty.
+/// @return                     __true__ if the snapshot was valid and loaded,
+///                             __false__ otherwise.
+///
+
+bool
+openDHANA_ir__config_files__load_ircommands_snapshot (const string& ircommands_file,
+                                                      const config_file& file,
+                                                      ir_command_table& table)
+{
+  config_snapshot snapshot;
+  ir_command_table ircommands;
+  int count;
+
+  if (!snapshot.load (ircommands_file, file))
+    return false;
+
+  if (!snapshot.getInt (count))
+    return false;
+  for (int i = 0; i != count; i++)
+    {
+      string key;
+      ir_command ircmd;
+
+      if (!snapshot.getString (key)
+          || !snapshot.getString (ircmd.ir_type)
+          || !snapshot.getString (ircmd.ir_command))
+        return false;
+
+      ircommands[key] = ircmd;
+    }
+
+  table.swap (ircommands);
+  return true;
+}
+
+/// Save the ir commands to a snapshot of the ir commands file.
+///
+/// @param ircommands_file      the path to the ir commands file.
+/// @param file                 the ir commands file the table was parsed from.
+/// @param table                the table to save.
+///
+
+void
+openDHANA_ir__config_files__save_ircommands_snapshot (const string& ircommands_file,
+                                                      const config_file& file,
+                                                      const ir_command_table& table)
+{
+  config_snapshot snapshot;
+
+  snapshot.putInt (table.size ());
+  for (ir_command_table::const_iterator ircmd = table.begin ();
+          ircmd != table.end (); ++ircmd)
+    {
+      snapshot.putString (ircmd->first);
+      snapshot.putString (ircmd->second.ir_type);
+      snapshot.putString (ircmd->second.ir_command);
+    }
+
+  snapshot.save (ircommands_file, file);
+}
+
 /// Read the device file
 ///
+/// The file is read into a new table, which then replaces the current table in
+/// one step.
+///
+/// If "config_snapshot" is enabled, a valid snapshot of the file is used
+/// instead of parsing it, and a new snapshot is saved after parsing.
+///
 /// @param device_file          the path to the device file.
 ///
 
 bool
 openDHANA_ir__config_files__read_devices (const string& device_file)
 {
-  LOCK (ir_sender_store);
+  LOCK (device_store);
 
-  char buffer[255];
-  int line_number = 0;
+  std::shared_ptr<ir_device_table> table (new ir_device_table);
+  config_file file;
+  line_view line;
 
-  ir_sender_store.clear ();
+  if (!file.open (device_file))
+    {
+      UNLOCK (device_store);
+      exit (1);
+    }
 
-  FILE *f = openDHANA__generic__open_file (device_file);
-  if (f == NULL)
-    exit (1);
+  if (OPTION_BOOL (config_snapshot)
+      && openDHANA_ir__config_files__load_devices_snapshot (device_file, file,
+                                                            *table))
+    {
+      std::atomic_store (&device_store, ir_device_table_ptr (table));
+      UNLOCK (device_store);
+      return true;
+    }
 
-  while (!feof (f))
+  OptionSchema itach;
+
+  itach["name"] =
+          Option (OptionRequired, "",
+                  "\"(.*)\"");
+  itach["address"] =
+          Option (OptionRequired, "",
+                  "\"(.*)\"");
+  itach["port"] =
+          Option (OptionRequired, "",
+                  "([0-9]+)");
+
+  OptionSchema device;
+
+  device["name"] =
+          Option (OptionRequired, "",
+                  "\"(.*)\"");
+  device["itach"] =
+          Option (OptionRequired, "",
+                  "\"(.*)\"");
+  device["ir_port"] =
+          Option (OptionRequired, "",
+                  "\"(1:1|1:2|1:3)\"");
+  device["equipment"] =
+          Option (OptionRequired, "",
+                  "\"(.*)\"");
+
+  while (file.nextLine (line))
     {
-      if (fgets (buffer, sizeof (buffer), f))
+      if (openDHANA__config__process_this_line (line))
         {
-          if (openDHANA__config__process_this_line (buffer))
+          // Split into command and parameters
+          line_view command, parameters;
+
+          if (!openDHANA__config__tokenize_line (line, command, parameters))
             {
-              // Split into command and parameters
-              string_vector line = openDHANA__config__split_line (buffer);
+              openDHANA__options__invalid_missing_options (device_file,
+                                                           file.lineNumber ());
+              continue;
+            }
 
-              //itach name="upstairs" address="upstairs-itach-1.manisvart.se" port=4998
+          //itach name="upstairs" address="upstairs-itach-1.manisvart.se" port=4998
 
-              if (line[0] == "itach")
-                {
-                  string_vector options =
-                          openDHANA__config__split_parameters (line[1]);
-
-                  std::map < string, Option > itach;
-
-                  itach["name"] =
-                          Option (OptionRequired, "",
-                                  "^\\s*(name)\\s*=\\s*\"(.*)\"\\s*$");
-                  itach["address"] =
-                          Option (OptionRequired, "",
-                                  "^\\s*(address)\\s*=\\s*\"(.*)\"\\s*$");
-                  itach["port"] =
-                          Option (OptionRequired, "",
-                                  "^\\s*(port)\\s*=\\s*([0-9]+)\\s*$");
-
-                  if (!openDHANA__options__check (options, itach))
-                    openDHANA__options__invalid_missing_options (device_file,
-                                                                 line_number);
-                  else
-                    {
-                      ir_sender sender;
-                      sender.address = itach["address"].getValue ();
-                      sender.port = itach["port"].getValue ();
-                      sender.type = "itach";
-                      ir_sender_store[itach["name"].getValue ()] = sender;
-                    }
-                }
-              else if (line[0] == "device")
+          if (command == "itach")
+            {
+              line_view_vector options;
+              openDHANA__config__tokenize_parameters (parameters, options);
+
+              if (!openDHANA__options__check (options, itach))
+                openDHANA__options__invalid_missing_options (device_file,
+                                                             file.lineNumber ());
+              else
                 {
-                  //device name="Yamaha receiver" itach="upstairs" ir_port="1:1" equipment="Yamaha Receiver/Preamp RXV1065/765/665/565/465 Main Zone"
-
-                  string_vector options =
-                          openDHANA__config__split_parameters (line[1]);
-
-                  std::map < string, Option > device;
-
-                  device["name"] =
-                          Option (OptionRequired, "",
-                                  "^\\s*(name)\\s*=\\s*\"(.*)\"\\s*$");
-                  device["itach"] =
-                          Option (OptionRequired, "",
-                                  "^\\s*(itach)\\s*=\\s*\"(.*)\"\\s*$");
-                  device["ir_port"] =
-                          Option (OptionRequired, "",
-                                  "^\\s*(ir_port)\\s*=\\s*\"(1:1|1:2|1:3)\"\\s*$");
-                  device["equipment"] =
-                          Option (OptionRequired, "",
-                                  "^\\s*(equipment)\\s*=\\s*\"(.*)\"\\s*$");
-
-                  if (!openDHANA__options__check (options, device))
-                    openDHANA__options__invalid_missing_options (device_file,
-                                                                 line_number);
-                  else
-                    {
-                      ir_device dev;
-                      dev.itach = device["itach"].getValue ();
-                      dev.ir_port = device["ir_port"].getValue ();
-                      dev.equipment = device["equipment"].getValue ();
-                      device_store[device["name"].getValue ()] = dev;
-                    }
+                  ir_sender sender;
+                  sender.address = itach["address"].getValue ();
+                  sender.port = itach["port"].getValue ();
+                  sender.type = "itach";
+                  table->senders[itach["name"].getValue ()] = sender;
                 }
+            }
+          else if (command == "device")
+            {
+              //device name="Yamaha receiver" itach="upstairs" ir_port="1:1" equipment="Yamaha Receiver/Preamp RXV1065/765/665/565/465 Main Zone"
+
+              line_view_vector options;
+              openDHANA__config__tokenize_parameters (parameters, options);
+
+              if (!openDHANA__options__check (options, device))
+                openDHANA__options__invalid_missing_options (device_file,
+                                                             file.lineNumber ());
               else
                 {
-                  // Illegal command
-                  openDHANA__options__invalid_missing_options (device_file,
-                                                               line_number);
+                  ir_device dev;
+                  dev.itach = device["itach"].getValue ();
+                  dev.ir_port = device["ir_port"].getValue ();
+                  dev.equipment = device["equipment"].getValue ();
+                  table->devices[device["name"].getValue ()] = dev;
                 }
             }
+          else
+            {
+              // Illegal command
+              openDHANA__options__invalid_missing_options (device_file,
+                                                           file.lineNumber ());
+            }
         }
     }
-  fclose (f);
-  UNLOCK (ir_sender_store);
+
+  if (OPTION_BOOL (config_snapshot))
+    openDHANA_ir__config_files__save_devices_snapshot (device_file, file,
+                                                       *table);
+
+  std::atomic_store (&device_store, ir_device_table_ptr (table));
+
+  UNLOCK (device_store);
 
   return true;
 }
 
 /// Read the ir commands file
 ///
+/// The file is read into a new table, which then replaces the current table in
+/// one step.
+///
 /// @param ircommands_file      the path to the ircommands file.
 ///
 
@@ -604,71 +840,89 @@ bool
 openDHANA_ir__config_files__read_ircommands (const string& ircommands_file)
 {
   LOCK (ircommand_store);
-  char buffer[1024];
-  char line_number_str[80];
-  int line_number = 0;
 
-  ircommand_store.clear ();
+  std::shared_ptr<ir_command_table> table (new ir_command_table);
+  config_file file;
+  line_view line;
 
-  FILE *f = openDHANA__generic__open_file (ircommands_file);
-  if (f == NULL)
-    exit (1);
+  if (!file.open (ircommands_file))
+    {
+      UNLOCK (ircommand_store);
+      exit (1);
+    }
 
-  while (!feof (f))
+  if (OPTION_BOOL (config_snapshot)
+      && openDHANA_ir__config_files__load_ircommands_snapshot (ircommands_file,
+                                                               file, *table))
     {
-      if (fgets (buffer, sizeof (buffer), f))
+      std::atomic_store (&ircommand_store, ir_command_table_ptr (table));
+      UNLOCK (ircommand_store);
+      return true;
+    }
+
+  OptionSchema irc;
+
+  irc["equipment"] =
+          Option (OptionRequired, "",
+                  "\"(.*)\"");
+  irc["command"] =
+          Option (OptionRequired, "",
+                  "\"(.*)\"");
+  irc["type"] =
+          Option (OptionRequired, "",
+                  "(sendir|hex)");
+  irc["ir"] =
+          Option (OptionRequired, "",
+                  "\"(.*)\"");
+
+  while (file.nextLine (line))
+    {
+      if (openDHANA__config__process_this_line (line))
         {
-          snprintf (line_number_str, sizeof(line_number_str), "%d", ++line_number);
+          // Split into command and parameters
+          line_view command, parameters;
 
-          if (openDHANA__config__process_this_line (buffer))
+          if (!openDHANA__config__tokenize_line (line, command, parameters))
             {
-              // Split into command and parameters
-              string_vector line = openDHANA__config__split_line (buffer);
+              openDHANA__options__invalid_missing_options (ircommands_file,
+                                                           file.lineNumber ());
+              continue;
+            }
 
-              //ir_command equipment="Yamaha Receiver/Preamp RXV1065/765/665/565/465 Main Zone" command="power off" type=sendir ir="lksajdlkjsadkljasdlkjasdlkajsdlkj"
+          //ir_command equipment="Yamaha Receiver/Preamp RXV1065/765/665/565/465 Main Zone" command="power off" type=sendir ir="lksajdlkjsadkljasdlkjasdlkajsdlkj"
 
-              if (line[0] == "ir_command")
-                {
-                  string_vector options =
-                          openDHANA__config__split_parameters (line[1]);
-
-                  std::map < string, Option > irc;
-
-                  irc["equipment"] =
-                          Option (OptionRequired, "",
-                                  "^\\s*(equipment)\\s*=\\s*\"(.*)\"\\s*$");
-                  irc["command"] =
-                          Option (OptionRequired, "",
-                                  "^\\s*(command)\\s*=\\s*\"(.*)\"\\s*$");
-                  irc["type"] =
-                          Option (OptionRequired, "",
-                                  "^\\s*(type)\\s*=\\s*(sendir|hex)\\s*$");
-                  irc["ir"] =
-                          Option (OptionRequired, "",
-                                  "^\\s*(ir)\\s*=\\s*\"(.*)\"\\s*$");
-
-                  if (!openDHANA__options__check (options, irc))
-                    openDHANA__options__invalid_missing_options (ircommands_file,
-                                                                 line_number);
-                  else
-                    {
-                      ir_command ircmd;
-                      ircmd.ir_command = irc["ir"].getValue ();
-                      ircmd.ir_type = irc["type"].getValue ();
-                      ircommand_store[irc["equipment"].getValue ()
-                              + "::" + irc["command"].getValue ()] = ircmd;
-                    }
-                }
+          if (command == "ir_command")
+            {
+              line_view_vector options;
+              openDHANA__config__tokenize_parameters (parameters, options);
+
+              if (!openDHANA__options__check (options, irc))
+                openDHANA__options__invalid_missing_options (ircommands_file,
+                                                             file.lineNumber ());
               else
                 {
-                  // Illegal command
-                  openDHANA__options__invalid_missing_options (ircommands_file,
-                                                               line_number);
+                  ir_command ircmd;
+                  ircmd.ir_command = irc["ir"].getValue ();
+                  ircmd.ir_type = irc["type"].getValue ();
+                  (*table)[irc["equipment"].getValue ()
+                          + "::" + irc["command"].getValue ()] = ircmd;
                 }
             }
+          else
+            {
+              // Illegal command
+              openDHANA__options__invalid_missing_options (ircommands_file,
+                                                           file.lineNumber ());
+            }
         }
     }
-  fclose (f);
+
+  if (OPTION_BOOL (config_snapshot))
+    openDHANA_ir__config_files__save_ircommands_snapshot (ircommands_file,
+                                                          file, *table);
+
+  std::atomic_store (&ircommand_store, ir_command_table_ptr (table));
+
   UNLOCK (ircommand_store);
 
   return true;
@@ -685,16 +939,16 @@ openDHANA_ir__options__set_ir ()
 {
   openDHANA_option_store["ir_options_file"] =
           Option (OptionOptional, OPTIONS_FILE_IR,
-                  "^\\s*(scriptor_options_file)\\s*=\\s*\"(.*)\"\\s*$");
+                  "\"(.*)\"");
   openDHANA_option_store["ir_lua_directory"] =
           Option (OptionOptional, "lua",
-                  "^\\s*(ir_lua_directory)\\s*=\\s*\"(.*)\"\\s*$");
+                  "\"(.*)\"");
   openDHANA_option_store["ir_devices_file"] =
           Option (OptionOptional, "",
-                  "^\\s*(ir_devices_file)\\s*=\\s*\"(.*)\"\\s*$");
+                  "\"(.*)\"");
   openDHANA_option_store["ir_ircommands_file"] =
           Option (OptionOptional, "",
-                  "^\\s*(ir_ircommands_file)\\s*=\\s*\"(.*)\"\\s*$");
+                  "\"(.*)\"");
 }
 
 /// The device file has been modified.
@@ -741,9 +995,9 @@ openDHANA_ir__options__process () {
 void
 openDHANA_ir__config_files__monitor ()
 {
-  openDHANA__config__file_monitor (OPTION (ir_devices_file),
+  openDHANA__config__file_monitor (OPTION_STRING (ir_devices_file),
                                    &openDHANA_ir__config_files__devices_changed);
-  openDHANA__config__file_monitor (OPTION (ir_ircommands_file),
+  openDHANA__config__file_monitor (OPTION_STRING (ir_ircommands_file),
                                    &openDHANA_ir__config_files__ircommands_changed);
 }
 
@@ -779,8 +1033,8 @@ main (int argc, char *argv[])
   STARTING ("openDHANA-ir with Lua release \"" + string (LUA_RELEASE) + "\".");
 
   // Read config files
-  openDHANA_ir__config_files__read_devices (OPTION (ir_devices_file));
-  openDHANA_ir__config_files__read_ircommands (OPTION (ir_ircommands_file));
+  openDHANA_ir__config_files__read_devices (OPTION_STRING (ir_devices_file));
+  openDHANA_ir__config_files__read_ircommands (OPTION_STRING (ir_ircommands_file));
 
   // Setup additional file monitors
   openDHANA_ir__config_files__monitor ();
@@ -793,7 +1047,7 @@ main (int argc, char *argv[])
 
   // Get the current scripts, and start them
   openDHANA__lua__add_external_functions ();
-  openDHANA__lua__lua_dir_read (OPTION (ir_lua_directory));
+  openDHANA__lua__lua_dir_read (OPTION_STRING (ir_lua_directory));
 
   // Let the threads do their work and wait for exit signal
   openDHANA__generic__process_loop ();
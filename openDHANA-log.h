@@ -0,0 +1,67 @@
+/**
+ * @file
+ * @author  Carl Nordin <openDHANA@manisvart.se>
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+// The record format of the binary log, written when mqtt_log_format=binary
+// and read by openDHANA-logcat.
+//
+// The log is a sequence of records, each a log_record followed by
+// log_record.length - sizeof (log_record) bytes of payload. Every time a
+// module starts logging it writes a LOG_RECORD_START record, and the ids
+// defined after it are valid until the next LOG_RECORD_START.
+
+#ifndef OPENDHANA_LOG_H
+#define OPENDHANA_LOG_H
+
+#include <stdint.h>
+
+#define LOG_BINARY_MAGIC        "oDHANAlg"
+#define LOG_BINARY_VERSION      1
+
+/// Starts a log, the payload is LOG_BINARY_MAGIC and the facility field is
+/// LOG_BINARY_VERSION.
+#define LOG_RECORD_START        1
+/// Defines a facility id, the payload is the facility name.
+#define LOG_RECORD_FACILITY     2
+/// Defines a format id, the payload is "function:line" of the call site.
+#define LOG_RECORD_FORMAT       3
+/// A log message, the payload is the message.
+#define LOG_RECORD_MESSAGE      4
+/// Log messages were dropped, the payload is the number as an uint64_t.
+#define LOG_RECORD_DROPPED      5
+
+#define LOG_LEVEL_ERROR         0
+#define LOG_LEVEL_WARNING       1
+#define LOG_LEVEL_INFO          2
+
+/// The header of a record, in host byte order.
+///
+struct log_record
+{
+  int64_t sec; /// Time of the record, CLOCK_REALTIME
+  int32_t nsec;
+  uint32_t length; /// Length of the record, including this header
+  uint16_t facility; /// Facility id, or the id a definition defines
+  uint16_t format; /// Format id
+  uint8_t type; /// LOG_RECORD_...
+  uint8_t level; /// LOG_LEVEL_...
+  uint16_t reserved;
+};
+
+#endif // OPENDHANA_LOG_H
@@ -0,0 +1,208 @@
+/**
+ * @file
+ * @author  Carl Nordin <openDHANA@manisvart.se>
+ * @version 0.1
+ *
+ * @section LICENSE
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ *
+ */
+
+// Decodes binary logs, written with mqtt_log_format=binary, to the same text
+// as the text logs.
+//
+// openDHANA-logcat [file...]
+//
+// Reads stdin if no file is given.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <map>
+#include <string>
+
+#include "openDHANA-log.h"
+
+typedef std::map<uint16_t, std::string> id_map;
+
+
+/// Read a log record.
+///
+/// @param f                    the file to read from.
+/// @param record               gets the header.
+/// @param payload              gets the payload.
+/// @return                     1 if a record was read, 0 at the end of the
+///                             file, -1 if the file is corrupt.
+///
+
+int
+openDHANA_logcat__record__read (FILE *f,
+                                struct log_record& record,
+                                std::string& payload)
+{
+  size_t got = fread (&record, 1, sizeof (record), f);
+
+  if (got == 0)
+    return 0;
+  if (got != sizeof (record) || record.length < sizeof (record))
+    return -1;
+
+  payload.resize (record.length - sizeof (record));
+  if (!payload.empty ()
+      && fread (&payload[0], 1, payload.size (), f) != payload.size ())
+    return -1;
+
+  return 1;
+}
+
+/// Look up an id.
+///
+/// @param ids                  the ids.
+/// @param id                   the id.
+/// @return                     what the id stands for, or "?" if it isn't
+///                             defined.
+///
+
+const char *
+openDHANA_logcat__record__lookup (const id_map& ids, uint16_t id)
+{
+  id_map::const_iterator it = ids.find (id);
+
+  if (it == ids.end ())
+    return "?";
+  return it->second.c_str ();
+}
+
+/// Print the records of a binary log as text.
+///
+/// @param f                    the file to read from.
+/// @param name                 the name of the file, for error messages.
+/// @return                     __true__ if the whole file was decoded,
+///                             __false__ otherwise.
+///
+
+bool
+openDHANA_logcat__file__decode (FILE *f, const char *name)
+{
+  static const char *levels[] = {"error", "warning", "info"};
+  struct log_record record;
+  std::string payload;
+  id_map facilities;
+  id_map formats;
+  bool started = false;
+  int result;
+
+  while ((result = openDHANA_logcat__record__read (f, record, payload)) == 1)
+    {
+      char stamp[20];
+      struct tm timeinfo;
+      time_t sec = record.sec;
+
+      switch (record.type)
+        {
+        case LOG_RECORD_START:
+          if (payload != LOG_BINARY_MAGIC)
+            {
+              fprintf (stderr, "%s: not an openDHANA binary log.\n", name);
+              return false;
+            }
+          if (record.facility != LOG_BINARY_VERSION)
+            {
+              fprintf (stderr, "%s: unknown log version %u.\n", name,
+                       record.facility);
+              return false;
+            }
+          facilities.clear ();
+          formats.clear ();
+          started = true;
+          continue;
+
+        case LOG_RECORD_FACILITY:
+          facilities[record.facility] = payload;
+          continue;
+
+        case LOG_RECORD_FORMAT:
+          formats[record.facility] = payload;
+          continue;
+        }
+
+      if (!started)
+        {
+          fprintf (stderr, "%s: not an openDHANA binary log.\n", name);
+          return false;
+        }
+
+      localtime_r (&sec, &timeinfo);
+      strftime (stamp, sizeof (stamp), "%F %T", &timeinfo);
+
+      if (record.type == LOG_RECORD_DROPPED)
+        {
+          uint64_t dropped = 0;
+
+          memcpy (&dropped, payload.data (),
+                  payload.size () < sizeof (dropped) ?
+                  payload.size () : sizeof (dropped));
+          printf ("%s: %8s: %17s: %llu log messages dropped.\n", stamp,
+                  "warning", "log/writer", (unsigned long long) dropped);
+        }
+      else if (record.type == LOG_RECORD_MESSAGE)
+        {
+          const char *level =
+                  record.level <= LOG_LEVEL_INFO ? levels[record.level] : "?";
+
+          printf ("%s: %8s: %17s: %s", stamp, level,
+                  openDHANA_logcat__record__lookup (facilities, record.facility),
+                  payload.c_str ());
+          if (record.level == LOG_LEVEL_ERROR)
+            printf (" (%s)",
+                    openDHANA_logcat__record__lookup (formats, record.format));
+          printf ("\n");
+        }
+      // Unknown record types are skipped, they have their length
+    }
+
+  if (result < 0)
+    {
+      fprintf (stderr, "%s: corrupt record.\n", name);
+      return false;
+    }
+  return true;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int status = EXIT_SUCCESS;
+
+  if (argc < 2)
+    return openDHANA_logcat__file__decode (stdin, "-") ?
+            EXIT_SUCCESS : EXIT_FAILURE;
+
+  for (int i = 1; i < argc; i++)
+    {
+      FILE *f = fopen (argv[i], "r");
+
+      if (f == NULL)
+        {
+          fprintf (stderr, "%s: can't open for read.\n", argv[i]);
+          status = EXIT_FAILURE;
+          continue;
+        }
+      if (!openDHANA_logcat__file__decode (f, argv[i]))
+        status = EXIT_FAILURE;
+      fclose (f);
+    }
+
+  return status;
+}
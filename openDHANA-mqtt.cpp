@@ -24,8 +24,6 @@ bool dhana_mqtt_exiting = false;
 bool dhana_mqtt_debug = false;
 bool dhana_mqtt_logtofile = false;
 FILE *dhana_log_file = NULL;
-std::map<string, mqtt_pub> openDHANA_mqtt_publications;
-std::map<string, mqtt_sub> openDHANA_mqtt_subscriptions;
 
 
 //=============================================================================
@@ -33,55 +31,671 @@ std::map<string, mqtt_sub> openDHANA_mqtt_subscriptions;
 //=============================================================================
 #ifndef openDHANA__generic__
 
+/// Size of the time stamp that starts every log line, "2015-01-01 19:24:17".
+///
+#define LOG_STAMP_LENGTH        19
+
+/// Largest message that is logged, longer messages are truncated.
+///
+#define LOG_MESSAGE_SIZE        512
+
+/// Size of a slot in the ring buffer, room for a text line or a binary record.
+///
+#define LOG_SLOT_SIZE           (sizeof (struct log_record) + LOG_STAMP_LENGTH \
+                                 + 2 + LOG_MESSAGE_SIZE + 1)
+
+/// Number of log lines the ring buffer can hold. Must be a power of two.
+///
+#define LOG_RING_SLOTS          512
+
+/// Largest number of log lines written with one writev.
+///
+#define LOG_BATCH               64
+
+/// A log line or binary log record in the ring buffer. The time stamp of a
+/// line is filled in by the writer, so the line is written as it is.
+///
+class log_slot
+{
+public:
+  std::atomic<size_t> sequence;
+  time_t time;
+  size_t length;
+  bool stamp; /// Put the time stamp first
+  char line[LOG_SLOT_SIZE];
+};
+
+/// Bounded ring buffer of log lines, written by any thread and drained by the
+/// log writer thread.
+///
+log_slot log_ring[LOG_RING_SLOTS];
+std::atomic<size_t> log_ring_enqueue;
+size_t log_ring_dequeue;
+
+/// Number of log lines dropped because the ring buffer was full.
+///
+std::atomic<unsigned long> log_dropped;
+
+/// The log writer thread, and how it is woken up.
+///
+pthread_t log_writer_thread;
+std::atomic<bool> log_writer_running;
+std::atomic<bool> log_writer_sleeping;
+std::atomic<bool> log_writer_stopping;
+CREATE_LOCK (log_writer);
+pthread_cond_t log_writer_cond = PTHREAD_COND_INITIALIZER;
+
+/// Binary log mode, the facilities and call sites that have been given ids.
+///
+bool dhana_log_binary = false;
+std::map<string, uint16_t> log_facility_ids;
+std::map<std::pair<string, int>, uint16_t> log_format_ids;
+CREATE_LOCK (log_ids);
+
+/// Counts the LOG_RECORD_START records. The ids a call site keeps, @see
+/// log_site::emit, are only valid in the log they were defined in.
+///
+std::atomic<uint32_t> log_binary_generation (0);
+
 /// Format a time_t
 ///
 /// @param time                 the time_t.
-/// @return                     A string in the format "2015-01-01 19:24:17".
+/// @param buffer               the buffer, at least LOG_STAMP_LENGTH + 1
+///                             characters, that gets the time in the format
+///                             "2015-01-01 19:24:17".
 ///
 
-string
-openDHANA__generic__log_format_time (time_t time)
+void
+openDHANA__generic__log_format_time (time_t time, char *buffer)
+{
+  struct tm timeinfo;
+
+  localtime_r (&time, &timeinfo);
+  strftime (buffer, LOG_STAMP_LENGTH + 1, "%F %T", &timeinfo);
+}
+
+/// Get the file descriptor that log lines are written to.
+///
+
+int
+openDHANA__generic__log_fd ()
+{
+  if (dhana_mqtt_logtofile)
+    return fileno (dhana_log_file);
+  return STDERR_FILENO;
+}
+
+/// Write log lines, and retry if the write was partial.
+///
+/// @param iov                  the lines.
+/// @param count                the number of lines.
+///
+
+void
+openDHANA__generic__log_write (struct iovec *iov, int count)
+{
+  int fd = openDHANA__generic__log_fd ();
+
+  while (count > 0)
+    {
+      ssize_t written = writev (fd, iov, count);
+
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return;
+        }
+
+      // Skip what was written
+      while (count > 0 && (size_t) written >= iov->iov_len)
+        {
+          written -= iov->iov_len;
+          iov++;
+          count--;
+        }
+      if (count > 0)
+        {
+          iov->iov_base = (char *) iov->iov_base + written;
+          iov->iov_len -= written;
+        }
+    }
+}
+
+/// Log that log lines have been dropped. Written directly, by the log writer
+/// thread.
+///
+/// @param dropped              the number of dropped lines.
+///
+
+void
+openDHANA__generic__log_dropped (unsigned long dropped)
+{
+  struct iovec iov[2];
+
+  if (dhana_log_binary)
+    {
+      struct log_record record;
+      struct timespec now;
+      uint64_t count = dropped;
+
+      clock_gettime (CLOCK_REALTIME, &now);
+      memset (&record, 0, sizeof (record));
+      record.sec = now.tv_sec;
+      record.nsec = now.tv_nsec;
+      record.length = sizeof (record) + sizeof (count);
+      record.type = LOG_RECORD_DROPPED;
+      record.level = LOG_LEVEL_WARNING;
+
+      iov[0].iov_base = &record;
+      iov[0].iov_len = sizeof (record);
+      iov[1].iov_base = &count;
+      iov[1].iov_len = sizeof (count);
+      openDHANA__generic__log_write (iov, 2);
+    }
+  else
+    {
+      char line[LOG_STAMP_LENGTH + 64];
+      int length;
+
+      openDHANA__generic__log_format_time (time (NULL), line);
+      length = snprintf (line + LOG_STAMP_LENGTH,
+                         sizeof (line) - LOG_STAMP_LENGTH,
+                         ": %8s: %17s: %lu log messages dropped.\n",
+                         "warning", "log/writer", dropped);
+
+      iov[0].iov_base = line;
+      iov[0].iov_len = LOG_STAMP_LENGTH + length;
+      openDHANA__generic__log_write (iov, 1);
+    }
+}
+
+/// Log writer thread. Takes the lines from the ring buffer, time stamps them
+/// and writes them in batches.
+///
+/// The thread sleeps when the ring buffer is empty and is woken up by the next
+/// log line, or after a second, to log the counts of call sites that have gone
+/// quiet. When stopping it writes all the remaining lines first.
+///
+
+void *
+openDHANA__generic__log_writer (void *param)
+{
+  struct iovec iov[LOG_BATCH];
+  time_t stamp_time = 0;
+  time_t flushed = 0;
+  char stamp[LOG_STAMP_LENGTH + 1];
+
+  openDHANA__generic__log_format_time (stamp_time, stamp);
+
+  for (;;)
+    {
+      int count = 0;
+
+      // Collect the lines that are ready
+      while (count != LOG_BATCH)
+        {
+          log_slot *slot =
+                  &log_ring[(log_ring_dequeue + count) & (LOG_RING_SLOTS - 1)];
+
+          if (slot->sequence.load (std::memory_order_acquire)
+              != log_ring_dequeue + count + 1)
+            break;
+
+          if (slot->stamp)
+            {
+              // The time stamp only changes once a second
+              if (slot->time != stamp_time)
+                {
+                  stamp_time = slot->time;
+                  openDHANA__generic__log_format_time (stamp_time, stamp);
+                }
+              memcpy (slot->line, stamp, LOG_STAMP_LENGTH);
+            }
+
+          iov[count].iov_base = slot->line;
+          iov[count].iov_len = slot->length;
+          count++;
+        }
+
+      if (count != 0)
+        {
+          openDHANA__generic__log_write (iov, count);
+
+          // Give the slots back to the producers
+          for (int i = 0; i != count; i++)
+            log_ring[(log_ring_dequeue + i) & (LOG_RING_SLOTS - 1)].sequence.store
+                    (log_ring_dequeue + i + LOG_RING_SLOTS,
+                     std::memory_order_release);
+          log_ring_dequeue += count;
+        }
+
+      unsigned long dropped = log_dropped.exchange (0);
+      if (dropped != 0)
+        openDHANA__generic__log_dropped (dropped);
+
+      if (count == LOG_BATCH)
+        continue;
+
+      // Sleep until there is more to write. The ring buffer is checked again
+      // after saying that we sleep, so a line logged in between isn't missed.
+      LOCK (log_writer);
+      log_writer_sleeping.store (true);
+      std::atomic_thread_fence (std::memory_order_seq_cst);
+
+      // Wake up once a second anyway, for the counts of the call sites
+      struct timespec deadline;
+
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec++;
+
+      log_slot *next = &log_ring[log_ring_dequeue & (LOG_RING_SLOTS - 1)];
+      while (next->sequence.load (std::memory_order_acquire)
+             != log_ring_dequeue + 1
+             && log_dropped.load () == 0)
+        {
+          if (log_writer_stopping.load ())
+            {
+              log_writer_sleeping.store (false);
+              UNLOCK (log_writer);
+              return NULL;
+            }
+          if (pthread_cond_timedwait (&log_writer_cond, &log_writer_mutex,
+                                      &deadline) == ETIMEDOUT)
+            break;
+        }
+
+      log_writer_sleeping.store (false);
+      UNLOCK (log_writer);
+
+      if (time (NULL) != flushed)
+        {
+          flushed = time (NULL);
+          openDHANA__generic__log_flush_sites (false);
+        }
+    }
+}
+
+/// Start the log writer thread. Until it is started, and after it is stopped,
+/// log lines are written directly.
+///
+
+void
+openDHANA__generic__log_start ()
+{
+  for (size_t i = 0; i != LOG_RING_SLOTS; i++)
+    log_ring[i].sequence.store (i);
+  log_ring_enqueue.store (0);
+  log_ring_dequeue = 0;
+  log_writer_stopping.store (false);
+
+  if (pthread_create (&log_writer_thread, NULL, openDHANA__generic__log_writer,
+                      NULL) != 0)
+    {
+      ERROR ("log/writer", "error creating thread");
+      return;
+    }
+
+  log_writer_running.store (true);
+
+  // Lines logged just before exit () must still be written
+  static bool registered = false;
+  if (!registered)
+    {
+      atexit (openDHANA__generic__log_stop);
+      registered = true;
+    }
+}
+
+/// Stop the log writer thread, after it has written all the lines.
+///
+
+void
+openDHANA__generic__log_stop ()
 {
-  struct tm * timeinfo;
-  char buffer[255];
+  // The counts no line will be logged after
+  openDHANA__generic__log_flush_sites (true);
 
-  timeinfo = localtime (&time);
-  strftime (buffer, sizeof (buffer), "%F %T", timeinfo);
+  if (!log_writer_running.exchange (false))
+    return;
 
-  return string (buffer);
+  LOCK (log_writer);
+  log_writer_stopping.store (true);
+  pthread_cond_signal (&log_writer_cond);
+  UNLOCK (log_writer);
+
+  pthread_join (log_writer_thread, NULL);
 }
 
+/// Put a log line or record in the ring buffer for the log writer thread. The
+/// calling thread never waits for the write. If the ring buffer is full the
+/// line is dropped and counted.
+///
+/// If the log writer isn't running the line is written directly.
+///
+/// @param parts                the parts of the line.
+/// @param count                the number of parts.
+/// @param stamp                __true__ to put the time stamp first.
+/// @return                     __false__ if the line was dropped, __true__
+///                             otherwise.
+///
+
+bool
+openDHANA__generic__log_enqueue (const struct iovec *parts,
+                                 int count,
+                                 bool stamp)
+{
+  char direct[LOG_SLOT_SIZE];
+  char *line = direct;
+  size_t length = stamp ? LOG_STAMP_LENGTH : 0;
+  log_slot *slot = NULL;
+  size_t position = 0;
+
+  if (log_writer_running.load ())
+    {
+      // Claim a slot
+      position = log_ring_enqueue.load (std::memory_order_relaxed);
+
+      for (;;)
+        {
+          slot = &log_ring[position & (LOG_RING_SLOTS - 1)];
+          size_t sequence = slot->sequence.load (std::memory_order_acquire);
+          intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+
+          if (difference == 0)
+            {
+              if (log_ring_enqueue.compare_exchange_weak (position, position + 1,
+                                                          std::memory_order_relaxed))
+                break;
+            }
+          else if (difference < 0)
+            {
+              // Full
+              log_dropped.fetch_add (1);
+              return false;
+            }
+          else
+            position = log_ring_enqueue.load (std::memory_order_relaxed);
+        }
+      line = slot->line;
+    }
+
+  for (int i = 0; i != count; i++)
+    {
+      size_t part = parts[i].iov_len;
+
+      if (part > LOG_SLOT_SIZE - length)
+        part = LOG_SLOT_SIZE - length;
+      memcpy (line + length, parts[i].iov_base, part);
+      length += part;
+    }
+
+  if (slot == NULL)
+    {
+      // No writer thread, write it directly
+      struct iovec iov;
+
+      if (stamp)
+        {
+          char buffer[LOG_STAMP_LENGTH + 1];
+
+          openDHANA__generic__log_format_time (time (NULL), buffer);
+          memcpy (line, buffer, LOG_STAMP_LENGTH);
+        }
+      iov.iov_base = line;
+      iov.iov_len = length;
+      openDHANA__generic__log_write (&iov, 1);
+      return true;
+    }
+
+  slot->time = time (NULL);
+  slot->length = length;
+  slot->stamp = stamp;
+  slot->sequence.store (position + 1, std::memory_order_release);
+
+  // Wake up the writer if it sleeps
+  std::atomic_thread_fence (std::memory_order_seq_cst);
+  if (log_writer_sleeping.load ())
+    {
+      LOCK (log_writer);
+      pthread_cond_signal (&log_writer_cond);
+      UNLOCK (log_writer);
+    }
+  return true;
+}
 
 /// Print a log message
 ///
 /// If a log file is open, write to it, otherwise write to stderr.
 /// The message will be prepended with the current date and time.
 ///
+/// The message is put in the ring buffer for the log writer thread, the
+/// calling thread never waits for the write. If the ring buffer is full the
+/// message is dropped and counted.
+///
 /// @param log_message          the log message.
 ///
 
 void
 openDHANA__generic__log_message (const string& log_message)
 {
-  time_t now;
+  struct iovec parts[3];
+  size_t length = log_message.length ();
 
-  time (&now);
-  if (dhana_mqtt_logtofile)
+  if (length > LOG_MESSAGE_SIZE)
+    length = LOG_MESSAGE_SIZE;
+
+  parts[0].iov_base = (void *) ": ";
+  parts[0].iov_len = 2;
+  parts[1].iov_base = (void *) log_message.data ();
+  parts[1].iov_len = length;
+  parts[2].iov_base = (void *) "\n";
+  parts[2].iov_len = 1;
+
+  openDHANA__generic__log_enqueue (parts, 3, true);
+}
+
+/// Start a binary log. Forgets all the ids given out so far and writes a
+/// LOG_RECORD_START record, the ids are defined again when they are used.
+///
+
+void
+openDHANA__generic__log_binary_start ()
+{
+  struct log_record record;
+  struct timespec now;
+  struct iovec parts[2];
+
+  LOCK (log_ids);
+  log_facility_ids.clear ();
+  log_format_ids.clear ();
+
+  clock_gettime (CLOCK_REALTIME, &now);
+  memset (&record, 0, sizeof (record));
+  record.sec = now.tv_sec;
+  record.nsec = now.tv_nsec;
+  record.length = sizeof (record) + strlen (LOG_BINARY_MAGIC);
+  record.facility = LOG_BINARY_VERSION;
+  record.type = LOG_RECORD_START;
+
+  parts[0].iov_base = &record;
+  parts[0].iov_len = sizeof (record);
+  parts[1].iov_base = (void *) LOG_BINARY_MAGIC;
+  parts[1].iov_len = strlen (LOG_BINARY_MAGIC);
+  openDHANA__generic__log_enqueue (parts, 2, false);
+  log_binary_generation.fetch_add (1, std::memory_order_release);
+  UNLOCK (log_ids);
+}
+
+/// Write a binary record that defines an id. Must be called with the log_ids
+/// lock, so the definition is in the log before any record that uses the id.
+///
+/// @param type                 LOG_RECORD_FACILITY or LOG_RECORD_FORMAT.
+/// @param id                   the id.
+/// @param name                 what the id stands for.
+/// @return                     __false__ if the record was dropped, __true__
+///                             otherwise.
+///
+
+bool
+openDHANA__generic__log_binary_define (uint8_t type,
+                                       uint16_t id,
+                                       const string& name)
+{
+  struct log_record record;
+  struct timespec now;
+  struct iovec parts[2];
+  size_t length = name.length ();
+
+  if (length > LOG_MESSAGE_SIZE)
+    length = LOG_MESSAGE_SIZE;
+
+  clock_gettime (CLOCK_REALTIME, &now);
+  memset (&record, 0, sizeof (record));
+  record.sec = now.tv_sec;
+  record.nsec = now.tv_nsec;
+  record.length = sizeof (record) + length;
+  record.facility = id;
+  record.type = type;
+
+  parts[0].iov_base = &record;
+  parts[0].iov_len = sizeof (record);
+  parts[1].iov_base = (void *) name.data ();
+  parts[1].iov_len = length;
+  return openDHANA__generic__log_enqueue (parts, 2, false);
+}
+
+/// Get the ids of a facility and a call site in the binary log, and define
+/// the ones that are new in the log.
+///
+/// @param facility             the facility.
+/// @param function             the function of the call site.
+/// @param line_number          the line number of the call site.
+/// @return                     the generation of the log in bits 32-63, the
+///                             facility id in bits 16-31 and the format id in
+///                             bits 0-15. The generation is 0 if an id
+///                             couldn't be defined, so that it is tried again.
+///
+
+uint64_t
+openDHANA__generic__log_binary_ids (const string& facility,
+                                    const string& function,
+                                    const int line_number)
+{
+  uint16_t facility_id = 0;
+  uint16_t format_id = 0;
+
+  // A definition that is dropped is tried again next time
+  LOCK (log_ids);
+  std::map<string, uint16_t>::iterator facility_it =
+          log_facility_ids.find (facility);
+  if (facility_it != log_facility_ids.end ())
+    facility_id = facility_it->second;
+  else if (log_facility_ids.size () < UINT16_MAX)
     {
-      fprintf (dhana_log_file, "%s: %s\n",
-               openDHANA__generic__log_format_time (now).c_str (),
-               log_message.c_str ());
-      fflush (dhana_log_file);
+      uint16_t id = log_facility_ids.size () + 1;
+
+      if (openDHANA__generic__log_binary_define (LOG_RECORD_FACILITY, id,
+                                                 facility))
+        {
+          log_facility_ids[facility] = id;
+          facility_id = id;
+        }
     }
-  else
+
+  std::pair<string, int> site (function, line_number);
+  std::map<std::pair<string, int>, uint16_t>::iterator format_it =
+          log_format_ids.find (site);
+  if (format_it != log_format_ids.end ())
+    format_id = format_it->second;
+  else if (log_format_ids.size () < UINT16_MAX)
     {
-      fprintf (stderr, "%s: %s\n",
-               openDHANA__generic__log_format_time (now).c_str (),
-               log_message.c_str ());
-      fflush (stdout);
+      uint16_t id = log_format_ids.size () + 1;
+
+      if (openDHANA__generic__log_binary_define (LOG_RECORD_FORMAT, id,
+                                                 function + ":"
+                                                 + std::to_string (line_number)))
+        {
+          log_format_ids[site] = id;
+          format_id = id;
+        }
     }
+
+  uint64_t generation = log_binary_generation.load (std::memory_order_acquire);
+  UNLOCK (log_ids);
+
+  if (facility_id == 0 || format_id == 0)
+    generation = 0;
+  return generation << 32 | (uint64_t) facility_id << 16 | format_id;
+}
+
+/// Write a binary log record. Takes no lock, the record is copied into the
+/// ring buffer as it is.
+///
+/// @param level                LOG_LEVEL_...
+/// @param facility_id          the id of the facility.
+/// @param format_id            the id of the call site.
+/// @param log_message          the log message.
+///
+
+void
+openDHANA__generic__log_binary_write (uint8_t level,
+                                      uint16_t facility_id,
+                                      uint16_t format_id,
+                                      const string& log_message)
+{
+  struct log_record record;
+  struct timespec now;
+  struct iovec parts[2];
+  size_t length = log_message.length ();
+
+  if (length > LOG_MESSAGE_SIZE)
+    length = LOG_MESSAGE_SIZE;
+
+  clock_gettime (CLOCK_REALTIME, &now);
+  memset (&record, 0, sizeof (record));
+  record.sec = now.tv_sec;
+  record.nsec = now.tv_nsec;
+  record.length = sizeof (record) + length;
+  record.facility = facility_id;
+  record.format = format_id;
+  record.type = LOG_RECORD_MESSAGE;
+  record.level = level;
+
+  parts[0].iov_base = &record;
+  parts[0].iov_len = sizeof (record);
+  parts[1].iov_base = (void *) log_message.data ();
+  parts[1].iov_len = length;
+  openDHANA__generic__log_enqueue (parts, 2, false);
 }
 
+/// Write a binary log record from a caller without a log_site, looking up
+/// the ids every time. The LOG_AT call sites keep their ids, @see
+/// log_site::emit.
+///
+/// The message is written as the call site built it, only the time stamp,
+/// the level and the facility padding of the text log are left to
+/// openDHANA-logcat. The format id names the call site, "function:line".
+///
+/// @param level                LOG_LEVEL_...
+/// @param facility             the "facility" that the log occurred in.
+/// @param log_message          the log message.
+/// @param function     	the function that the log occurred in.
+/// @param line_number  	the line number in the function.
+///
+
+void
+openDHANA__generic__log_binary (uint8_t level,
+                                const string& facility,
+                                const string& log_message,
+                                const string& function,
+                                const int line_number)
+{
+  uint64_t ids = openDHANA__generic__log_binary_ids (facility, function,
+                                                     line_number);
+
+  openDHANA__generic__log_binary_write (level, ids >> 16, ids, log_message);
+}
 
 /// Print an error message
 ///
@@ -100,6 +714,13 @@ openDHANA__generic__log_error (const string& facility,
                                const string& function,
                                const int line_number)
 {
+  if (dhana_log_binary)
+    {
+      openDHANA__generic__log_binary (LOG_LEVEL_ERROR, facility, error_message,
+                                      function, line_number);
+      return;
+    }
+
   char message[512];
 
   snprintf (message, sizeof(message), "%8s: %17s: %s (%s:%d)",
@@ -129,6 +750,13 @@ openDHANA__generic__log_warning (const string& facility,
                                  const string& function,
                                  const int line_number)
 {
+  if (dhana_log_binary)
+    {
+      openDHANA__generic__log_binary (LOG_LEVEL_WARNING, facility,
+                                      warning_message, function, line_number);
+      return;
+    }
+
   char message[512];
 
   snprintf (message, sizeof(message), "%8s: %17s: %s",
@@ -156,6 +784,13 @@ openDHANA__generic__log_info (const string& facility,
                               const string& function,
                               const int line_number)
 {
+  if (dhana_log_binary)
+    {
+      openDHANA__generic__log_binary (LOG_LEVEL_INFO, facility, info_message,
+                                      function, line_number);
+      return;
+    }
+
   char message[512];
 
   snprintf (message, sizeof(message), "%8s: %17s: %s",
@@ -166,46 +801,561 @@ openDHANA__generic__log_info (const string& facility,
   openDHANA__generic__log_message (message);
 }
 
-/// Check if the data matches the regular expression (regex).
+/// The log facilities, by name.
 ///
-/// @param regex            the regular expression to match.
-/// @param data             the data that is matched against the regular
-///                         expression.
-/// @returns                __true__ if the data matches, else __false__.
+std::map<string, log_facility *> log_facilities;
+CREATE_LOCK (log_facilities);
+
+/// The level of the facilities that follow the default, set with "*". If it
+/// is LOG_LEVEL_DEFAULT as well, mqtt_debug decides.
 ///
+std::atomic<int> log_default_level (LOG_LEVEL_DEFAULT);
 
-bool
-openDHANA__generic__reg_ex_match (const string& regex,
-                                  const string& data)
+log_facility::log_facility (const string& name)
 {
-  regex_t rc;
-  regmatch_t m[1 + 1];
+  this->name = name;
+  level.store (LOG_LEVEL_DEFAULT);
+}
 
-  int status = regcomp (&rc, regex.c_str (), REG_EXTENDED);
+/// Get a log facility, it is created the first time it is asked for.
+///
+/// @param name                 the name of the facility.
+/// @return                     the facility.
+///
 
-  if (status != 0)
+log_facility *
+openDHANA__generic__log_facility (const string& name)
+{
+  log_facility *facility;
+
+  LOCK (log_facilities);
+  std::map<string, log_facility *>::const_iterator it =
+          log_facilities.find (name);
+  if (it != log_facilities.end ())
+    facility = it->second;
+  else
     {
-      WARNING ("regex/comp", "compiling regex \"" + regex
-               + "\" with data \"" + data + "\".");
-      return false;
+      facility = new log_facility (name);
+      log_facilities[name] = facility;
     }
+  UNLOCK (log_facilities);
 
-  const char *p = data.c_str ();
-  int match = regexec (&rc, p, 1, m, 0);
-  regfree (&rc);
+  return facility;
+}
 
-  if (match == 0)
-    return true;
+/// Get the level that a facility was given.
+///
+/// @param facility             the facility, or "*" for the default level.
+/// @return                     LOG_LEVEL_..., LOG_LEVEL_DEFAULT if the
+///                             facility wasn't given a level.
+///
 
-  return false;
+int
+openDHANA__generic__log_level (const string& facility)
+{
+  if (facility == "*")
+    return log_default_level.load ();
+  return openDHANA__generic__log_facility (facility)->level.load ();
 }
 
-/// Match data to a regular expression (regex), that must contain groups,
-/// and return the groups.
+/// Set the level of a facility. Takes effect at once, in all threads.
 ///
-/// The regular expression will only be matched one time against the data.
-/// The normal group 0, which matches the whole data, will be excluded and the
-/// first item in the returned vector will be the first _group_ matched.
+/// @param facility             the facility, or "*" for the default level.
+/// @param level                LOG_LEVEL_...
+/// @return                     __false__ if the level is invalid, __true__
+///                             otherwise.
+///
+
+bool
+openDHANA__generic__log_set_level (const string& facility, int level)
+{
+  if (level < LOG_LEVEL_DEFAULT || level > LOG_LEVEL_INFO)
+    return false;
+
+  if (facility == "*")
+    log_default_level.store (level);
+  else
+    openDHANA__generic__log_facility (facility)->level.store (level);
+  return true;
+}
+
+/// Set the level of a facility by name.
+///
+/// @param facility             the facility, or "*" for the default level.
+/// @param level                "default", "off", "error", "warning" or
+///                             "info".
+/// @return                     __false__ if the level is invalid, __true__
+///                             otherwise.
+///
+
+bool
+openDHANA__generic__log_set_level (const string& facility,
+                                   const string& level)
+{
+  // Same order as the LOG_LEVEL_... values, from LOG_LEVEL_DEFAULT
+  static const char *names[] = {"default", "off", "error", "warning", "info"};
+
+  for (int i = 0; i != sizeof (names) / sizeof (names[0]); i++)
+    if (level == names[i])
+      return openDHANA__generic__log_set_level (facility,
+                                                LOG_LEVEL_DEFAULT + i);
+
+  WARNING ("log/control",
+           "unknown log level \"" + level + "\" for \"" + facility + "\".");
+  return false;
+}
+
+/// Set the levels of facilities, from mqtt_log_levels or a message on
+/// mqtt_log_control_topic.
+///
+/// @param control              "facility=level" pairs separated by whitespace
+///                             or commas, "mqtt/comms=info lua/exec=off
+///                             *=warning".
+///
+
+void
+openDHANA__generic__log_control (const string& control)
+{
+  static const char *separators = " \t\r\n,";
+  size_t position = 0;
+
+  while ((position = control.find_first_not_of (separators, position))
+         != string::npos)
+    {
+      size_t end = control.find_first_of (separators, position);
+      if (end == string::npos)
+        end = control.length ();
+
+      string pair = control.substr (position, end - position);
+      position = end;
+
+      size_t equal = pair.find ('=');
+      if (equal == string::npos || equal == 0)
+        {
+          WARNING ("log/control",
+                   "expected \"facility=level\", got \"" + pair + "\".");
+          continue;
+        }
+
+      string facility = pair.substr (0, equal);
+      string level = pair.substr (equal + 1);
+
+      if (openDHANA__generic__log_set_level (facility, level))
+        INFO ("log/control",
+              "level of \"" + facility + "\" set to \"" + level + "\".");
+    }
+}
+
+/// Log a message at a level.
+///
+/// @param level                LOG_LEVEL_...
+/// @param facility             the "facility" that the log occurred in.
+/// @param message              the message.
+/// @param function     	the function that the log occurred in.
+/// @param line_number  	the line number in the function.
+///
+
+void
+openDHANA__generic__log_at (int level,
+                            const string& facility,
+                            const string& message,
+                            const string& function,
+                            const int line_number)
+{
+  switch (level)
+    {
+    case LOG_LEVEL_ERROR:
+      openDHANA__generic__log_error (facility, message, function,
+                                     line_number);
+      break;
+    case LOG_LEVEL_WARNING:
+      openDHANA__generic__log_warning (facility, message, function,
+                                       line_number);
+      break;
+    default:
+      openDHANA__generic__log_info (facility, message, function, line_number);
+      break;
+    }
+}
+
+/// All the call sites, linked through log_site::_next. Call sites are never
+/// deleted.
+///
+std::atomic<log_site *> log_sites (NULL);
+
+log_site::log_site (const char *facility)
+{
+  _facility = openDHANA__generic__log_facility (facility);
+  _function.store (NULL);
+  _level.store (0);
+  _line_number.store (0);
+  _window.store (0);
+  _window_count.store (0);
+  _suppressed.store (0);
+  _last_hash.store (0);
+  _last_time.store (0);
+  _repeated.store (0);
+  _binary_ids.store (0);
+
+  _next = log_sites.load ();
+  while (!log_sites.compare_exchange_weak (_next, this))
+    ;
+}
+
+/// Check if a message from this line is logged. Called before the message is
+/// built, so a message that isn't logged costs nothing to build.
+///
+/// @param level                LOG_LEVEL_...
+/// @return                     __true__ if the facility logs the level and
+///                             the line is within its rate, __false__
+///                             otherwise.
+///
+
+bool
+log_site::enabled (int level)
+{
+  int facility_level = _facility->level.load (std::memory_order_relaxed);
+
+  if (facility_level == LOG_LEVEL_DEFAULT)
+    facility_level = log_default_level.load (std::memory_order_relaxed);
+  if (facility_level == LOG_LEVEL_DEFAULT)
+    facility_level = dhana_mqtt_debug ? LOG_LEVEL_INFO : LOG_LEVEL_WARNING;
+  if (level > facility_level)
+    return false;
+
+  // Errors are never rate limited
+  if (level <= LOG_LEVEL_ERROR)
+    return true;
+
+  // At most LOG_RATE_BURST messages each second. Racing threads may let a
+  // few more through, that's fine.
+  time_t now = time (NULL);
+  time_t window = _window.load (std::memory_order_relaxed);
+
+  if (now != window && _window.compare_exchange_strong (window, now))
+    _window_count.store (0);
+
+  if (_window_count.fetch_add (1) >= LOG_RATE_BURST)
+    {
+      _suppressed.fetch_add (1);
+      return false;
+    }
+  return true;
+}
+
+/// Log a message from this line. A message identical to the one before it is
+/// counted instead of logged for LOG_REPEAT_SECONDS, unless it is an error.
+/// The counts of repeated and suppressed messages are logged before the next
+/// message that is logged, or by the log writer thread when the line has gone
+/// quiet, @see log_site::flush.
+///
+/// @param level                LOG_LEVEL_...
+/// @param message              the message.
+/// @param function     	the function that the log occurred in.
+/// @param line_number  	the line number in the function.
+///
+
+void
+log_site::log (int level,
+               const string& message,
+               const char *function,
+               int line_number)
+{
+  // Remembered for the counts logged by the log writer thread
+  if (_function.load (std::memory_order_relaxed) == NULL)
+    {
+      _level.store (level);
+      _line_number.store (line_number);
+      _function.store (function, std::memory_order_release);
+    }
+
+  if (level > LOG_LEVEL_ERROR)
+    {
+      uint64_t hash = 14695981039346656037ull;
+
+      for (size_t i = 0; i != message.length (); i++)
+        {
+          hash ^= (unsigned char) message[i];
+          hash *= 1099511628211ull;
+        }
+
+      time_t now = time (NULL);
+
+      if (hash == _last_hash.load ()
+          && now - _last_time.load () < LOG_REPEAT_SECONDS)
+        {
+          _repeated.fetch_add (1);
+          return;
+        }
+      _last_hash.store (hash);
+      _last_time.store (now);
+    }
+
+  summarize (level, _repeated.exchange (0), _suppressed.exchange (0),
+             function, line_number);
+
+  emit (level, message, function, line_number);
+}
+
+/// Log the counts of repeated and suppressed messages of this line.
+///
+/// @param level                LOG_LEVEL_...
+/// @param repeated             the number of repeated messages.
+/// @param suppressed           the number of suppressed messages.
+/// @param function     	the function that the log occurred in.
+/// @param line_number  	the line number in the function.
+///
+
+void
+log_site::summarize (int level,
+                     unsigned long repeated,
+                     unsigned long suppressed,
+                     const char *function,
+                     int line_number)
+{
+  char note[80];
+
+  if (repeated != 0)
+    {
+      snprintf (note, sizeof (note), "last message repeated %lu times.",
+                repeated);
+      emit (level, note, function, line_number);
+    }
+  if (suppressed != 0)
+    {
+      snprintf (note, sizeof (note), "%lu messages suppressed, over %d a second.",
+                suppressed, LOG_RATE_BURST);
+      emit (level, note, function, line_number);
+    }
+}
+
+/// Log the counts of this line whose window has ended, so they aren't lost
+/// when the line goes quiet.
+///
+/// @param now                  the time.
+/// @param all                  __true__ to log all the counts, when the log
+///                             is stopped.
+///
+
+void
+log_site::flush (time_t now, bool all)
+{
+  const char *function = _function.load (std::memory_order_acquire);
+
+  if (function == NULL)
+    return;
+
+  unsigned long repeated = 0;
+  unsigned long suppressed = 0;
+
+  if (_repeated.load () != 0
+      && (all || now - _last_time.load () >= LOG_REPEAT_SECONDS))
+    repeated = _repeated.exchange (0);
+  if (_suppressed.load () != 0 && (all || now != _window.load ()))
+    suppressed = _suppressed.exchange (0);
+
+  summarize (_level.load (), repeated, suppressed, function,
+             _line_number.load ());
+}
+
+/// The next call site, in the list of all the call sites.
+///
+
+log_site *
+log_site::next (void) const
+{
+  return _next;
+}
+
+/// Log the counts of all the call sites whose window has ended, @see
+/// log_site::flush. Called by the log writer thread.
+///
+/// @param all                  __true__ to log all the counts.
+///
+
+void
+openDHANA__generic__log_flush_sites (bool all)
+{
+  time_t now = time (NULL);
+
+  for (log_site *site = log_sites.load (); site != NULL; site = site->next ())
+    site->flush (now, all);
+}
+
+/// Write a message from this line. In the binary log the facility and format
+/// ids are looked up once for each log, and kept here, so a record costs no
+/// lock and no lookup.
+///
+/// @param level                LOG_LEVEL_...
+/// @param message              the message.
+/// @param function     	the function that the log occurred in.
+/// @param line_number  	the line number in the function.
+///
+
+void
+log_site::emit (int level,
+                const string& message,
+                const char *function,
+                int line_number)
+{
+  if (!dhana_log_binary)
+    {
+      openDHANA__generic__log_at (level, _facility->name, message, function,
+                                  line_number);
+      return;
+    }
+
+  uint64_t ids = _binary_ids.load (std::memory_order_acquire);
+
+  if ((ids >> 32) != log_binary_generation.load (std::memory_order_acquire))
+    {
+      ids = openDHANA__generic__log_binary_ids (_facility->name, function,
+                                                line_number);
+      _binary_ids.store (ids, std::memory_order_release);
+    }
+
+  openDHANA__generic__log_binary_write (level, ids >> 16, ids, message);
+}
+
+/// Cache of compiled regular expressions, keyed by the pattern.
+///
+/// The patterns used by openDHANA are a small, fixed set (comment filters,
+/// option definitions, file name filters), so they are compiled once and kept
+/// for the lifetime of the process. regexec() may be called concurrently on the
+/// same compiled pattern, so the lock only protects the map itself. A pattern
+/// that doesn't compile is kept as NULL, so it is only compiled and reported
+/// once.
+///
+std::map<string, regex_t*> openDHANA__generic__reg_ex_cache;
+CREATE_LOCK (openDHANA__generic__reg_ex_cache);
+
+/// Number of lookups served from the cache, and number of patterns compiled.
+///
+unsigned long openDHANA__generic__reg_ex_cache_hits = 0;
+unsigned long openDHANA__generic__reg_ex_cache_compiles = 0;
+
+/// Get a compiled regular expression from the cache, compile it if it isn't
+/// there already.
+///
+/// @param regex            the regular expression.
+/// @param data             the data the expression is to be matched against,
+///                         only used in the warning message.
+/// @returns                The compiled regular expression, or NULL if it
+///                         couldn't be compiled.
+///
+
+const regex_t *
+openDHANA__generic__reg_ex_compiled (const string& regex,
+                                     const string& data)
+{
+  LOCK (openDHANA__generic__reg_ex_cache);
+
+  std::map<string, regex_t*>::const_iterator cached =
+          openDHANA__generic__reg_ex_cache.find (regex);
+  if (cached != openDHANA__generic__reg_ex_cache.end ())
+    {
+      openDHANA__generic__reg_ex_cache_hits++;
+      UNLOCK (openDHANA__generic__reg_ex_cache);
+      return cached->second;
+    }
+
+  regex_t *rc = new regex_t;
+  int status = regcomp (rc, regex.c_str (), REG_EXTENDED);
+  openDHANA__generic__reg_ex_cache_compiles++;
+
+  if (status != 0)
+    {
+      delete rc;
+      openDHANA__generic__reg_ex_cache[regex] = NULL;
+      UNLOCK (openDHANA__generic__reg_ex_cache);
+      WARNING ("regex/comp", "compiling regex \"" + regex
+               + "\" with data \"" + data + "\".");
+      return NULL;
+    }
+
+  openDHANA__generic__reg_ex_cache[regex] = rc;
+
+  UNLOCK (openDHANA__generic__reg_ex_cache);
+  return rc;
+}
+
+/// Get the regular expression cache counters.
+///
+/// @param hits             set to the number of lookups served from the cache.
+/// @param compiles         set to the number of patterns compiled.
+///
+
+void
+openDHANA__generic__reg_ex_cache_statistics (unsigned long& hits,
+                                             unsigned long& compiles)
+{
+  LOCK (openDHANA__generic__reg_ex_cache);
+
+  hits = openDHANA__generic__reg_ex_cache_hits;
+  compiles = openDHANA__generic__reg_ex_cache_compiles;
+
+  UNLOCK (openDHANA__generic__reg_ex_cache);
+}
+
+/// Free all the compiled regular expressions in the cache.
+///
+/// The compiled expressions are handed out without a reference count, options
+/// keep them and other threads match with them without the lock. This may only
+/// be called once every other thread has stopped and nothing matches any more,
+/// it isn't called on exit since the file monitor threads are never stopped.
+///
+
+void
+openDHANA__generic__reg_ex_cache_clear ()
+{
+  LOCK (openDHANA__generic__reg_ex_cache);
+
+  for (std::map<string, regex_t*>::iterator cached =
+          openDHANA__generic__reg_ex_cache.begin ();
+          cached != openDHANA__generic__reg_ex_cache.end ();
+          ++cached)
+    if (cached->second != NULL)
+      {
+        regfree (cached->second);
+        delete cached->second;
+      }
+  openDHANA__generic__reg_ex_cache.clear ();
+
+  UNLOCK (openDHANA__generic__reg_ex_cache);
+}
+
+/// Check if the data matches the regular expression (regex).
+///
+/// @param regex            the regular expression to match.
+/// @param data             the data that is matched against the regular
+///                         expression.
+/// @returns                __true__ if the data matches, else __false__.
+///
+
+bool
+openDHANA__generic__reg_ex_match (const string& regex,
+                                  const string& data)
+{
+  const regex_t *rc = openDHANA__generic__reg_ex_compiled (regex, data);
+
+  if (rc == NULL)
+    return false;
+
+  const char *p = data.c_str ();
+  int match = regexec (rc, p, 0, NULL, 0);
+
+  if (match == 0)
+    return true;
+
+  return false;
+}
+
+/// Match data to a regular expression (regex), that must contain groups,
+/// and return the groups.
+///
+/// The regular expression will only be matched one time against the data.
+/// The normal group 0, which matches the whole data, will be excluded and the
+/// first item in the returned vector will be the first _group_ matched.
 ///
 /// @param max_groups           the maximum number of groups we expect to get,
 ///                             based on the regular expression we provide.
@@ -223,26 +1373,18 @@ openDHANA__generic__reg_ex_match_groups (const int max_groups,
                                          const string& regex,
                                          const string& data)
 {
-  regex_t rc;
   string_vector res;
   regmatch_t m[max_groups + 1];
 
-  int status = regcomp (&rc, regex.c_str (), REG_EXTENDED);
+  const regex_t *rc = openDHANA__generic__reg_ex_compiled (regex, data);
 
-  if (status != 0)
-    {
-      WARNING ("regex/comp", "compiling regex \"" + regex
-               + "\" with data \"" + data + "\".");
-      return res;
-    }
+  if (rc == NULL)
+    return res;
 
   const char *p = data.c_str ();
-  int nomatch = regexec (&rc, p, max_groups + 1, m, 0);
+  int nomatch = regexec (rc, p, max_groups + 1, m, 0);
   if (nomatch)
-    {
-      regfree (&rc);
-      return res;
-    }
+    return res;
 
   for (int i = 0; i != max_groups; i++)
     {
@@ -250,7 +1392,6 @@ openDHANA__generic__reg_ex_match_groups (const int max_groups,
                                   m[i + 1].rm_eo - m[i + 1].rm_so));
     }
 
-  regfree (&rc);
   return res;
 }
 
@@ -277,34 +1418,27 @@ string_vector
 openDHANA__generic__reg_ex_match_groups_loop (const string& regex,
                                               const string& data)
 {
-  regex_t rc;
   string_vector res;
   regmatch_t m;
-  const char *exp = regex.c_str ();
   const char *dat = data.c_str ();
 
-  int status = regcomp (&rc, exp, REG_EXTENDED);
+  const regex_t *rc = openDHANA__generic__reg_ex_compiled (regex, data);
 
-  if (status != 0)
-    {
-      WARNING ("regex/comp", "compiling regex \"" + regex
-               + "\" with data \"" + data + "\".");
-      return res;
-    }
+  if (rc == NULL)
+    return res;
 
   // First match
   int offset = 0;
-  int nomatch = regexec (&rc, dat, 1, &m, 0);
+  int nomatch = regexec (rc, dat, 1, &m, 0);
   while (nomatch == 0)
     {
       res.push_back (data.substr (offset + m.rm_so, m.rm_eo - m.rm_so));
       offset += m.rm_eo;
 
       // Next possible hit
-      nomatch = regexec (&rc, dat + offset, 1, &m, 0);
+      nomatch = regexec (rc, dat + offset, 1, &m, 0);
     }
 
-  regfree (&rc);
   return res;
 }
 
@@ -349,17 +1483,101 @@ openDHANA___generic__md5_hash_unique ()
   return openDHANA__generic__md5_hash (string (tbuf));
 }
 
+/// The pipe openDHANA__generic__signal_catch writes the exit signals to, and
+/// openDHANA__generic__process_loop reads them from. The signals are caught
+/// rather than blocked, a blocked mask would be inherited by the children
+/// the scripts start, while caught signals are reset to the default on exec.
+///
+int signal_pipe[2] = { -1, -1 };
+
+/// Catch an exit signal and pass it on through the signal pipe.
+///
+/// @param signal               the signal.
+///
+
+static void
+openDHANA__generic__signal_catch (int signal)
+{
+  int saved_errno = errno;
+  unsigned char number = signal;
+
+  while (write (signal_pipe[1], &number, 1) == -1 && errno == EINTR)
+    ;
+
+  errno = saved_errno;
+}
+
+/// Catch the exit signals, they are handled by
+/// openDHANA__generic__process_loop.
+///
+/// @return                     nothing.
+///
+
+void
+openDHANA__generic__signal_start ()
+{
+  if (pipe2 (signal_pipe, O_CLOEXEC | O_NONBLOCK) == -1)
+    {
+      ERROR ("main/exec", "signal pipe failed, "
+             + string (strerror (errno)) + ".");
+      return;
+    }
+
+  struct sigaction action;
+
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = openDHANA__generic__signal_catch;
+  sigemptyset (&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction (SIGINT, &action, NULL);
+  sigaction (SIGTERM, &action, NULL);
+}
+
+/// Read the exit signals from the signal pipe.
+///
+/// @param fd                   the read end of the signal pipe.
+/// @param events               the epoll events.
+///
+
+void
+openDHANA__generic__signal_ready (int fd, uint32_t events)
+{
+  unsigned char number;
+
+  while (read (fd, &number, 1) == 1)
+    openDHANA__generic__signal_handler (number);
+}
+
 /// Loop and sleep until it is time to exit.
 ///
+/// The exit signals are caught by openDHANA__generic__signal_start and read
+/// from the signal pipe here. With mqtt_event_loop=epoll the pipe is added
+/// to the reactor, and the reactor runs here.
+///
 /// @return                     nothing.
 ///
 
 void
 openDHANA__generic__process_loop ()
 {
+  if (openDHANA__reactor__enabled () && signal_pipe[0] != -1)
+    {
+      openDHANA__reactor__add (signal_pipe[0], EPOLLIN,
+                               openDHANA__generic__signal_ready);
+      openDHANA__reactor__run ();
+      openDHANA__reactor__remove (signal_pipe[0]);
+      return;
+    }
+
   while (!dhana_mqtt_exiting)
     {
-      sleep (2);
+      // Sleep until a signal arrives
+      struct pollfd wait = { signal_pipe[0], POLLIN, 0 };
+
+      if (signal_pipe[0] == -1)
+        pause ();
+      else if (poll (&wait, 1, -1) == 1)
+        openDHANA__generic__signal_ready (signal_pipe[0], EPOLLIN);
     }
 }
 
@@ -413,7 +1631,14 @@ openDHANA__generic__open_log_file (const string& path)
       exit (1);
     }
   dhana_mqtt_logtofile = true;
-}
+
+  // Binary records only go to a file, stderr is read by people
+  if (OPTION_ENUM (mqtt_log_format) == LogFormatBinary)
+    {
+      dhana_log_binary = true;
+      openDHANA__generic__log_binary_start ();
+    }
+}
 
 /// Setup process and prepare for running as a daemon.
 ///
@@ -423,13 +1648,11 @@ openDHANA__generic__open_log_file (const string& path)
 void
 openDHANA__generic__init_process ()
 {
-  // Register signal and signal handler
-  signal (SIGINT, openDHANA__generic__signal_handler);
-  signal (SIGTERM, openDHANA__generic__signal_handler);
+  openDHANA__generic__signal_start ();
 
   pid_t pid, sid;
 
-  if (OPTION (daemon) == "true")
+  if (OPTION_BOOL (daemon))
     {
       // Run as a daemon
       /* Fork off the parent process */
@@ -449,8 +1672,8 @@ openDHANA__generic__init_process ()
       umask (0);
 
       /* Open any logs here */
-      if (OPTION (mqtt_log_file) != "")
-        openDHANA__generic__open_log_file (OPTION (mqtt_log_file));
+      if (!OPTION_STRING (mqtt_log_file).empty ())
+        openDHANA__generic__open_log_file (OPTION_STRING (mqtt_log_file));
 
       /* Create a new SID for the child process */
       sid = setsid ();
@@ -481,12 +1704,18 @@ openDHANA__generic__init_process ()
     {
       // Run in foreground
 
-      if (OPTION (mqtt_log_file) != "")
-        openDHANA__generic__open_log_file (OPTION (mqtt_log_file));
+      if (!OPTION_STRING (mqtt_log_file).empty ())
+        openDHANA__generic__open_log_file (OPTION_STRING (mqtt_log_file));
 
       INFO ("main/exec", "running in foreground.");
     }
 
+  // Log from here on without waiting for the writes
+  openDHANA__generic__log_start ();
+
+  // With mqtt_event_loop=epoll the parts below are driven by the reactor
+  openDHANA__reactor__start ();
+
   // Start file monitor thread and monitor MQTT file
   openDHANA__config__file_monitor_start ();
   openDHANA_mqtt__config_files__monitor ();
@@ -501,6 +1730,17 @@ openDHANA__generic__init_process ()
 void
 openDHANA__generic__kill_process ()
 {
+  unsigned long hits, compiles;
+  char statistics[80];
+
+  openDHANA__generic__reg_ex_cache_statistics (hits, compiles);
+  snprintf (statistics, sizeof (statistics), "%lu hits, %lu compiles",
+            hits, compiles);
+  INFO ("regex/comp", "regex cache " + string (statistics) + ".");
+
+  // Write what is left in the log
+  openDHANA__generic__log_stop ();
+
   if (dhana_log_file != NULL)
     fclose (dhana_log_file);
 
@@ -509,17 +1749,298 @@ openDHANA__generic__kill_process ()
 
 #endif // openDHANA__generic__
 
+//=============================================================================
+// openDHANA__reactor__
+//=============================================================================
+#ifndef openDHANA__reactor__
+
+/// Most events handled per epoll_wait.
+///
+#define REACTOR_EVENTS                  32
+
+class reactor_handler /// Helper to keep a file descriptor of the reactor
+{
+public:
+  reactor_callback callback;
+  bool timer; /// A timerfd, its expirations are read before the callback
+};
+
+/// The epoll instance, -1 when the reactor isn't started.
+///
+int reactor_epoll = -1;
+
+/// The file descriptors and their callbacks
+///
+std::map<int, reactor_handler> reactor_handlers;
+CREATE_LOCK (reactor_handlers);
+
+/// Called after each round of events, may be NULL.
+///
+void (*reactor_idle) (void) = NULL;
+
+/// Is the single reactor mode, mqtt_event_loop=epoll, used?
+///
+/// @return                     __true__ if it is, __false__ if every part
+///                             runs in a thread of its own.
+///
+
+bool
+openDHANA__reactor__enabled ()
+{
+  return reactor_epoll != -1;
+}
+
+/// Create the epoll instance if mqtt_event_loop=epoll. Must be called before
+/// any part is started, if it fails the threads are used.
+///
+/// @return                     __true__ if the reactor is used, __false__
+///                             otherwise.
+///
+
+bool
+openDHANA__reactor__start ()
+{
+  if (reactor_epoll != -1)
+    return true;
+  if (OPTION_ENUM (mqtt_event_loop) != EventLoopEpoll)
+    return false;
+
+  reactor_epoll = epoll_create1 (EPOLL_CLOEXEC);
+  if (reactor_epoll == -1)
+    {
+      ERROR ("main/reactor", "epoll_create1 failed, "
+             + string (strerror (errno)) + ", using threads.");
+      return false;
+    }
+
+  return true;
+}
+
+/// Add a file descriptor to the reactor.
+///
+/// @param fd                   the file descriptor.
+/// @param events               the epoll events to wait for.
+/// @param callback             called with the file descriptor and the events
+///                             when it is ready.
+///
+
+void
+openDHANA__reactor__add (int fd, uint32_t events, reactor_callback callback)
+{
+  struct epoll_event event;
+
+  memset (&event, 0, sizeof (event));
+  event.events = events;
+  event.data.fd = fd;
+
+  LOCK (reactor_handlers);
+  reactor_handlers[fd].callback = callback;
+  reactor_handlers[fd].timer = false;
+  UNLOCK (reactor_handlers);
+
+  if (epoll_ctl (reactor_epoll, EPOLL_CTL_ADD, fd, &event) == -1)
+    ERROR ("main/reactor", "epoll_ctl add failed, "
+           + string (strerror (errno)) + ".");
+}
+
+/// Change the events waited for on a file descriptor.
+///
+/// @param fd                   the file descriptor.
+/// @param events               the epoll events to wait for.
+///
+
+void
+openDHANA__reactor__modify (int fd, uint32_t events)
+{
+  struct epoll_event event;
+
+  memset (&event, 0, sizeof (event));
+  event.events = events;
+  event.data.fd = fd;
+
+  epoll_ctl (reactor_epoll, EPOLL_CTL_MOD, fd, &event);
+}
+
+/// Remove a file descriptor from the reactor, before it is closed.
+///
+/// @param fd                   the file descriptor.
+///
+
+void
+openDHANA__reactor__remove (int fd)
+{
+  epoll_ctl (reactor_epoll, EPOLL_CTL_DEL, fd, NULL);
+
+  LOCK (reactor_handlers);
+  reactor_handlers.erase (fd);
+  UNLOCK (reactor_handlers);
+}
+
+/// Create a timer in the reactor. It is armed by openDHANA__reactor__arm.
+///
+/// @param callback             called with the timerfd when the timer expires.
+/// @return                     the timerfd, or -1 if it couldn't be created.
+///
+
+int
+openDHANA__reactor__timer (reactor_callback callback)
+{
+  int timer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+  if (timer == -1)
+    {
+      ERROR ("main/reactor", "timerfd_create failed, "
+             + string (strerror (errno)) + ".");
+      return -1;
+    }
+
+  openDHANA__reactor__add (timer, EPOLLIN, callback);
+
+  LOCK (reactor_handlers);
+  reactor_handlers[timer].timer = true;
+  UNLOCK (reactor_handlers);
+
+  return timer;
+}
+
+/// Arm, or disarm, a timer of the reactor.
+///
+/// @param timer                the timerfd.
+/// @param ms                   milliseconds until it expires, 0 disarms it.
+/// @param interval_ms          milliseconds between the following
+///                             expirations, 0 for a single one.
+///
+
+void
+openDHANA__reactor__arm (int timer, long ms, long interval_ms)
+{
+  struct itimerspec spec;
+
+  spec.it_value.tv_sec = ms / 1000;
+  spec.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  spec.it_interval.tv_sec = interval_ms / 1000;
+  spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+
+  timerfd_settime (timer, 0, &spec, NULL);
+}
+
+/// Is a timer of the reactor armed?
+///
+/// @param timer                the timerfd.
+/// @return                     __true__ if it will expire, __false__
+///                             otherwise.
+///
+
+bool
+openDHANA__reactor__armed (int timer)
+{
+  struct itimerspec spec;
+
+  if (timerfd_gettime (timer, &spec) == -1)
+    return false;
+  return spec.it_value.tv_sec != 0 || spec.it_value.tv_nsec != 0;
+}
+
+/// Set the function called after each round of events.
+///
+/// @param idle                 the function.
+///
+
+void
+openDHANA__reactor__set_idle (void (*idle) (void))
+{
+  reactor_idle = idle;
+}
+
+/// Run the reactor, calling the callbacks of the ready file descriptors, until
+/// it is time to exit.
+///
+
+void
+openDHANA__reactor__run ()
+{
+  struct epoll_event events[REACTOR_EVENTS];
+
+  INFO ("main/reactor", "running the epoll event loop.");
+
+  while (!dhana_mqtt_exiting)
+    {
+      int ready = epoll_wait (reactor_epoll, events, REACTOR_EVENTS, -1);
+
+      if (ready == -1)
+        {
+          if (errno != EINTR)
+            {
+              ERROR ("main/reactor", "epoll_wait failed, "
+                     + string (strerror (errno)) + ".");
+              sleep (1);
+            }
+          continue;
+        }
+
+      for (int i = 0; i < ready && !dhana_mqtt_exiting; i++)
+        {
+          int fd = events[i].data.fd;
+          reactor_handler handler;
+
+          // A callback before this one may have removed it
+          LOCK (reactor_handlers);
+          std::map<int, reactor_handler>::const_iterator found =
+                  reactor_handlers.find (fd);
+          bool known = found != reactor_handlers.end ();
+          if (known)
+            handler = found->second;
+          UNLOCK (reactor_handlers);
+
+          if (!known)
+            continue;
+
+          if (handler.timer)
+            {
+              uint64_t expirations;
+
+              if (read (fd, &expirations, sizeof (expirations)) == -1)
+                continue;
+            }
+
+          (*handler.callback) (fd, events[i].events);
+        }
+
+      if (reactor_idle != NULL)
+        (*reactor_idle) ();
+    }
+}
+
+#endif // openDHANA__reactor__
+
 //=============================================================================
 // openDHANA__config__
 //=============================================================================
 #ifndef openDHANA__config__
 
+/// Time a file or directory must have been left alone before its callback is
+/// called, so that a burst of writes results in one reload.
+///
+#define FILE_MONITOR_DEBOUNCE_MS        250
+
+/// Time between checks of the files and directories that can't be watched
+/// with inotify.
+///
+#define FILE_MONITOR_POLL_INTERVAL_MS   2000
+
+/// The events that count as a change of a watched file or directory.
+///
+#define FILE_MONITOR_EVENTS     (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM \
+                                 | IN_DELETE | IN_DELETE_SELF)
+
 class file_monitor_entry /// Helper to keep information about a file or directory
 {
 public:
   struct stat node_stat;
   void
   (*callback) (string); /// Callback if the node has changed
+  int watch; /// inotify watch descriptor, -1 if the node is polled
+  string name; /// Name in the watched directory, empty for a directory
 };
 
 /// List of monitored files or directories and their modification times
@@ -527,10 +2048,38 @@ public:
 std::map<string, file_monitor_entry> file_monitor_path_and_info;
 CREATE_LOCK (file_monitor_path_and_info);
 
+/// inotify instance for the monitor, -1 if only polling is used
+///
+int file_monitor_inotify = -1;
+
 /// Thread for the background monitoring of changes
 ///
 pthread_t file_monitor_path_and_info_thread;
 
+class file_monitor_pending_call /// Helper to keep a debounced callback
+{
+public:
+  struct timespec due; /// CLOCK_MONOTONIC time when the callback is called
+  void
+  (*callback) (string);
+};
+
+/// Callbacks waiting for their debounce window to pass
+///
+std::map<string, file_monitor_pending_call> file_monitor_pending_calls;
+CREATE_LOCK (file_monitor_pending_calls);
+pthread_cond_t file_monitor_pending_calls_cond;
+
+/// Thread that calls the callbacks
+///
+pthread_t file_monitor_pending_calls_thread;
+
+/// With mqtt_event_loop=epoll, the timers that replace the threads: one for
+/// the next due callback and one for the polling.
+///
+int file_monitor_dispatch_timer = -1;
+int file_monitor_poll_timer = -1;
+
 /// Scan through the files in a directory and return the latest modification
 /// time of all the files.
 ///
@@ -579,142 +2128,612 @@ openDHANA__config__file_monitor_scan_directory (const string& path)
   return saved_stat;
 }
 
-/// Thread to check if any changes are made to configurations files or directories.
+/// Add an inotify watch for a file or directory.
 ///
-/// If a file or directory has been modified then its callback function will be called
-/// with the path as a parameter.
-/// If a file or directory has been deleted from the filesystem, then it will be removed
-/// from the list.
+/// A file is watched through the directory it is in, since editors often save
+/// a file by writing a new file and renaming it over the old one.
+///
+/// @param file_or_dir          the file or directory path.
+/// @param is_dir               __true__ if the path is a directory.
+/// @param entry                the entry to set the watch and name of.
+/// @return                     __true__ if the watch was added, __false__ if
+///                             the node must be polled.
 ///
 
-void *
-openDHANA__config__file_monitor_thread (void *param)
+bool
+openDHANA__config__file_monitor_add_watch (const string& file_or_dir,
+                                           bool is_dir,
+                                           file_monitor_entry& entry)
 {
-  struct stat node_stat;
+  string watched = file_or_dir;
 
-  while (!dhana_mqtt_exiting)
+  entry.watch = -1;
+  entry.name = "";
+
+  if (file_monitor_inotify == -1)
+    return false;
+
+  if (!is_dir)
     {
-      LOCK (file_monitor_path_and_info);
+      size_t slash = file_or_dir.find_last_of ('/');
 
-      for (std::map<string, file_monitor_entry>::iterator it =
-              file_monitor_path_and_info.begin ();
-              it != file_monitor_path_and_info.end ();)
+      if (slash == string::npos)
         {
-          if (stat (it->first.c_str (), &node_stat) == -1)
-            {
-              // TODO: errno = ENOENT
-              // Node doesn't exist any longer
-              WARNING ("file/monitor",
-                       "missing \"" + it->first + "\", removing from list.");
-              file_monitor_path_and_info.erase (it++);
-              //      exit (EXIT_FAILURE);
-            }
-          else
-            {
-              if (S_ISDIR (node_stat.st_mode))
-                {
-                  // A directorys timestamp is only updated when a file is
-                  // added or deleted, not when a file in the directory is
-                  // changed.
-                  //
-                  // Our method is instead to scan the files in the directory
-                  // and store the modification date of the last modified file
-                  // as the directorys modification time.
-
-                  node_stat =
-                          openDHANA__config__file_monitor_scan_directory (it->first);
-                }
-
-              if (it->second.node_stat.st_mtime != node_stat.st_mtime
-                  || it->second.node_stat.st_ctime != node_stat.st_ctime)
-                {
-                  // Has changed. Save new time and call callback
-                  INFO ("file/monitor", "changed \"" + it->first + "\".");
-                  it->second.node_stat = node_stat;
-                  (*(it->second).callback) (it->first);
-                }
-              it++;
-            }
+          watched = ".";
+          entry.name = file_or_dir;
+        }
+      else
+        {
+          watched = slash == 0 ? "/" : file_or_dir.substr (0, slash);
+          entry.name = file_or_dir.substr (slash + 1);
         }
+    }
 
-      UNLOCK (file_monitor_path_and_info);
-      // TODO: add configuration option for time
-      sleep (2);
+  entry.watch = inotify_add_watch (file_monitor_inotify, watched.c_str (),
+                                   FILE_MONITOR_EVENTS);
+  if (entry.watch == -1)
+    {
+      WARNING ("file/monitor",
+               "can't watch \"" + watched + "\", " + strerror (errno)
+               + ", polling instead.");
+      return false;
     }
-  return NULL;
+
+  return true;
 }
 
-/// Start the file or directory monitoring thread.
+/// Schedule the callback of a changed file or directory. A callback that is
+/// already scheduled for the path is moved forward, so a burst of changes
+/// results in one call.
+///
+/// @param path                 the file or directory path.
+/// @param callback             the callback function.
 ///
 
 void
-openDHANA__config__file_monitor_start ()
+openDHANA__config__file_monitor_schedule (const string& path,
+                                          void (*callback) (string))
 {
-  if (pthread_create (&file_monitor_path_and_info_thread,
-                      NULL,
-                      openDHANA__config__file_monitor_thread,
-                      NULL) != 0)
-    ERROR ("file/monitor", "error creating thread");
+  file_monitor_pending_call call;
 
-  // TODO: put this line below in the right place:
-  //pthread_join (file_monitor_path_and_info_thread, NULL);
+  clock_gettime (CLOCK_MONOTONIC, &call.due);
+  call.due.tv_sec += FILE_MONITOR_DEBOUNCE_MS / 1000;
+  call.due.tv_nsec += (FILE_MONITOR_DEBOUNCE_MS % 1000) * 1000000L;
+  if (call.due.tv_nsec >= 1000000000L)
+    {
+      call.due.tv_sec++;
+      call.due.tv_nsec -= 1000000000L;
+    }
+  call.callback = callback;
+
+  LOCK (file_monitor_pending_calls);
+  file_monitor_pending_calls[path] = call;
+  pthread_cond_signal (&file_monitor_pending_calls_cond);
+  UNLOCK (file_monitor_pending_calls);
+
+  // Every call is due a debounce window after it was scheduled, an armed
+  // timer is for an earlier one
+  if (file_monitor_dispatch_timer != -1
+      && !openDHANA__reactor__armed (file_monitor_dispatch_timer))
+    openDHANA__reactor__arm (file_monitor_dispatch_timer,
+                             FILE_MONITOR_DEBOUNCE_MS, 0);
 }
 
-/// Add a file or directory to the monitor list
-///
-/// The path provided is checked to see if it is valid to monitor.
+/// Call the callback of a changed file or directory, if it still exists.
 ///
-/// @param file_or_dir          the file or directory path.
+/// @param path                 the file or directory path.
 /// @param callback             the callback function.
-/// @return                     __true__ if the file could be added to the list,
-///                             __false__ otherwise.
 ///
 
-bool
-openDHANA__config__file_monitor (const string& file_or_dir,
-                                 void (*callback) (string))
+void
+openDHANA__config__file_monitor_call (const string& path,
+                                      void (*callback) (string))
 {
-  LOCK (file_monitor_path_and_info);
-
   struct stat node_stat;
 
-  if (stat (file_or_dir.c_str (), &node_stat) == -1)
+  if (stat (path.c_str (), &node_stat) == -1)
+    WARNING ("file/monitor", "missing \"" + path + "\".");
+  else
     {
-      // Node doesn't exist
-      ERROR ("file/monitor", "\"" + file_or_dir + "\" " + strerror (errno));
+      INFO ("file/monitor", "changed \"" + path + "\".");
+      (*callback) (path);
     }
-  else
+}
+
+/// Thread that calls the callbacks of the changed files and directories when
+/// their debounce window has passed.
+///
+/// The callbacks are called one at a time, without any monitor lock held, so
+/// a slow reload doesn't hold up the monitor.
+///
+
+void *
+openDHANA__config__file_monitor_dispatch_thread (void *param)
+{
+  LOCK (file_monitor_pending_calls);
+
+  while (!dhana_mqtt_exiting)
     {
-      // Check what kind of node the path is
-      switch (node_stat.st_mode & S_IFMT)
+      if (file_monitor_pending_calls.empty ())
         {
-        case S_IFBLK:
-          WARNING ("file/monitor",
-                   "\"" + file_or_dir
-                   + "\", sorry, we don't monitor block devices.");
+          pthread_cond_wait (&file_monitor_pending_calls_cond,
+                             &file_monitor_pending_calls_mutex);
+          continue;
+        }
 
-          UNLOCK (file_monitor_path_and_info);
-          return false;
-          break;
-        case S_IFCHR:
-          WARNING ("file/monitor",
-                   "\"" + file_or_dir
-                   + "\", sorry, we don't monitor character devices.");
+      // Find the first callback that is due
+      struct timespec now;
+      std::map<string, file_monitor_pending_call>::iterator first =
+              file_monitor_pending_calls.begin ();
+
+      for (std::map<string, file_monitor_pending_call>::iterator it =
+              file_monitor_pending_calls.begin ();
+              it != file_monitor_pending_calls.end (); ++it)
+        if (it->second.due.tv_sec < first->second.due.tv_sec
+            || (it->second.due.tv_sec == first->second.due.tv_sec
+                && it->second.due.tv_nsec < first->second.due.tv_nsec))
+          first = it;
+
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      if (now.tv_sec < first->second.due.tv_sec
+          || (now.tv_sec == first->second.due.tv_sec
+              && now.tv_nsec < first->second.due.tv_nsec))
+        {
+          pthread_cond_timedwait (&file_monitor_pending_calls_cond,
+                                  &file_monitor_pending_calls_mutex,
+                                  &first->second.due);
+          continue;
+        }
 
-          UNLOCK (file_monitor_path_and_info);
-          return false;
-          break;
-        case S_IFDIR:
-          //	  printf ("directory\n");
-          node_stat =
-                  openDHANA__config__file_monitor_scan_directory (file_or_dir);
-          break;
-        case S_IFIFO:
-          WARNING ("file/monitor",
-                   "\"" + file_or_dir
-                   + "\", sorry, we don't monitor FIFI/pipe devices.");
+      string path = first->first;
+      void (*callback) (string) = first->second.callback;
+      file_monitor_pending_calls.erase (first);
 
-          UNLOCK (file_monitor_path_and_info);
+      UNLOCK (file_monitor_pending_calls);
+
+      openDHANA__config__file_monitor_call (path, callback);
+
+      LOCK (file_monitor_pending_calls);
+    }
+
+  UNLOCK (file_monitor_pending_calls);
+  return NULL;
+}
+
+/// The dispatch timer of the reactor has expired, call the callbacks that are
+/// due and arm the timer for the next one.
+///
+/// @param fd                   the timerfd.
+/// @param events               the epoll events.
+///
+
+void
+openDHANA__config__file_monitor_dispatch_ready (int fd, uint32_t events)
+{
+  LOCK (file_monitor_pending_calls);
+
+  while (!file_monitor_pending_calls.empty ())
+    {
+      struct timespec now;
+      std::map<string, file_monitor_pending_call>::iterator first =
+              file_monitor_pending_calls.begin ();
+
+      for (std::map<string, file_monitor_pending_call>::iterator it =
+              file_monitor_pending_calls.begin ();
+              it != file_monitor_pending_calls.end (); ++it)
+        if (it->second.due.tv_sec < first->second.due.tv_sec
+            || (it->second.due.tv_sec == first->second.due.tv_sec
+                && it->second.due.tv_nsec < first->second.due.tv_nsec))
+          first = it;
+
+      clock_gettime (CLOCK_MONOTONIC, &now);
+      long wait_ms = (first->second.due.tv_sec - now.tv_sec) * 1000
+              + (first->second.due.tv_nsec - now.tv_nsec) / 1000000L;
+
+      if (wait_ms > 0)
+        {
+          openDHANA__reactor__arm (fd, wait_ms, 0);
+          break;
+        }
+
+      string path = first->first;
+      void (*callback) (string) = first->second.callback;
+      file_monitor_pending_calls.erase (first);
+
+      UNLOCK (file_monitor_pending_calls);
+
+      openDHANA__config__file_monitor_call (path, callback);
+
+      LOCK (file_monitor_pending_calls);
+    }
+
+  UNLOCK (file_monitor_pending_calls);
+}
+
+/// A monitored file or directory has changed, schedule its callback. Must be
+/// called with the monitor list locked.
+///
+/// @param it                   the monitored file or directory.
+/// @param only_if_modified     only call the callback if the modification
+///                             time has changed.
+/// @return                     __false__ if the node doesn't exist any
+///                             longer, __true__ otherwise.
+///
+
+bool
+openDHANA__config__file_monitor_changed (std::map<string, file_monitor_entry>::iterator it,
+                                         bool only_if_modified)
+{
+  struct stat node_stat;
+
+  if (stat (it->first.c_str (), &node_stat) == -1)
+    return false;
+
+  if (S_ISDIR (node_stat.st_mode))
+    {
+      // A directorys timestamp is only updated when a file is
+      // added or deleted, not when a file in the directory is
+      // changed.
+      //
+      // Our method is instead to scan the files in the directory
+      // and store the modification date of the last modified file
+      // as the directorys modification time.
+
+      node_stat = openDHANA__config__file_monitor_scan_directory (it->first);
+    }
+
+  if (!only_if_modified
+      || it->second.node_stat.st_mtime != node_stat.st_mtime
+      || it->second.node_stat.st_ctime != node_stat.st_ctime)
+    {
+      // Has changed. Save new time and schedule callback
+      it->second.node_stat = node_stat;
+      openDHANA__config__file_monitor_schedule (it->first,
+                                                it->second.callback);
+    }
+
+  return true;
+}
+
+/// Check the files and directories by their modification times. Must be
+/// called with the monitor list locked.
+///
+/// If a file or directory has been deleted from the filesystem, then it will
+/// be removed from the list.
+///
+/// @param all                  __true__ to check all nodes, __false__ to only
+///                             check the nodes without an inotify watch.
+///
+
+void
+openDHANA__config__file_monitor_poll (bool all)
+{
+  for (std::map<string, file_monitor_entry>::iterator it =
+          file_monitor_path_and_info.begin ();
+          it != file_monitor_path_and_info.end ();)
+    {
+      if (!all && it->second.watch != -1)
+        {
+          it++;
+          continue;
+        }
+
+      if (!openDHANA__config__file_monitor_changed (it, true))
+        {
+          // TODO: errno = ENOENT
+          // Node doesn't exist any longer
+          WARNING ("file/monitor",
+                   "missing \"" + it->first + "\", removing from list.");
+          file_monitor_path_and_info.erase (it++);
+        }
+      else
+        it++;
+    }
+}
+
+/// Read the pending inotify events and collect the monitored paths they
+/// concern. Must be called with the monitor list locked.
+///
+/// @param changed              the paths that have changed.
+/// @return                     __true__ if the event queue overflowed and
+///                             all nodes must be checked.
+///
+
+bool
+openDHANA__config__file_monitor_read_events (std::set<string>& changed)
+{
+  char buffer[4096]
+          __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  bool overflow = false;
+  ssize_t length;
+
+  while ((length = read (file_monitor_inotify, buffer, sizeof (buffer))) > 0)
+    {
+      for (char *p = buffer; p < buffer + length;
+              p += sizeof (struct inotify_event) + ((struct inotify_event *) p)->len)
+        {
+          const struct inotify_event *event = (const struct inotify_event *) p;
+
+          if (event->mask & IN_Q_OVERFLOW)
+            {
+              overflow = true;
+              continue;
+            }
+
+          for (std::map<string, file_monitor_entry>::iterator it =
+                  file_monitor_path_and_info.begin ();
+                  it != file_monitor_path_and_info.end ();)
+            {
+              if (it->second.watch != event->wd)
+                {
+                  it++;
+                  continue;
+                }
+
+              if (event->mask & (IN_DELETE_SELF | IN_IGNORED))
+                {
+                  // The watched directory is gone
+                  WARNING ("file/monitor",
+                           "missing \"" + it->first + "\", removing from list.");
+                  changed.erase (it->first);
+                  file_monitor_path_and_info.erase (it++);
+                  continue;
+                }
+
+              if (it->second.name.empty ()
+                  || (event->len != 0 && it->second.name == event->name))
+                changed.insert (it->first);
+
+              it++;
+            }
+        }
+    }
+
+  return overflow;
+}
+
+/// Read the pending inotify events and schedule the callbacks of the changed
+/// files and directories. Must be called with the monitor list locked.
+///
+
+void
+openDHANA__config__file_monitor_events ()
+{
+  std::set<string> changed;
+
+  if (openDHANA__config__file_monitor_read_events (changed))
+    {
+      WARNING ("file/monitor", "inotify queue overflow, checking all.");
+      openDHANA__config__file_monitor_poll (true);
+      return;
+    }
+
+  for (std::set<string>::const_iterator path = changed.begin ();
+          path != changed.end (); ++path)
+    {
+      std::map<string, file_monitor_entry>::iterator it =
+              file_monitor_path_and_info.find (*path);
+
+      // A deleted file is kept, it will be reported again when it is
+      // recreated
+      if (it != file_monitor_path_and_info.end ()
+          && !openDHANA__config__file_monitor_changed (it, false))
+        WARNING ("file/monitor", "missing \"" + *path + "\".");
+    }
+}
+
+/// Thread to check if any changes are made to configurations files or directories.
+///
+/// Changes are reported by inotify, and the callback function of each changed
+/// file or directory is scheduled with the path as a parameter. Nodes that
+/// can't be watched are polled.
+///
+
+void *
+openDHANA__config__file_monitor_thread (void *param)
+{
+  while (!dhana_mqtt_exiting)
+    {
+      if (file_monitor_inotify == -1)
+        {
+          // No inotify, poll everything
+          LOCK (file_monitor_path_and_info);
+          openDHANA__config__file_monitor_poll (true);
+          UNLOCK (file_monitor_path_and_info);
+
+          usleep (FILE_MONITOR_POLL_INTERVAL_MS * 1000);
+          continue;
+        }
+
+      // Only wake up for polling if there is something to poll
+      int timeout = -1;
+
+      LOCK (file_monitor_path_and_info);
+      for (std::map<string, file_monitor_entry>::const_iterator it =
+              file_monitor_path_and_info.begin ();
+              it != file_monitor_path_and_info.end (); ++it)
+        if (it->second.watch == -1)
+          timeout = FILE_MONITOR_POLL_INTERVAL_MS;
+      UNLOCK (file_monitor_path_and_info);
+
+      struct pollfd fds;
+      fds.fd = file_monitor_inotify;
+      fds.events = POLLIN;
+
+      int ready = poll (&fds, 1, timeout);
+
+      if (ready == -1)
+        {
+          if (errno != EINTR)
+            {
+              ERROR ("file/monitor", "poll failed, " + string (strerror (errno)));
+              sleep (1);
+            }
+          continue;
+        }
+
+      LOCK (file_monitor_path_and_info);
+
+      if (ready == 0)
+        openDHANA__config__file_monitor_poll (false);
+      else
+        openDHANA__config__file_monitor_events ();
+
+      UNLOCK (file_monitor_path_and_info);
+    }
+  return NULL;
+}
+
+/// The inotify instance is readable in the reactor, handle the events.
+///
+/// @param fd                   the inotify instance.
+/// @param events               the epoll events.
+///
+
+void
+openDHANA__config__file_monitor_inotify_ready (int fd, uint32_t events)
+{
+  LOCK (file_monitor_path_and_info);
+  openDHANA__config__file_monitor_events ();
+  UNLOCK (file_monitor_path_and_info);
+}
+
+/// The poll timer of the reactor has expired, check the files and
+/// directories without an inotify watch.
+///
+/// @param fd                   the timerfd.
+/// @param events               the epoll events.
+///
+
+void
+openDHANA__config__file_monitor_poll_ready (int fd, uint32_t events)
+{
+  LOCK (file_monitor_path_and_info);
+  openDHANA__config__file_monitor_poll (file_monitor_inotify == -1);
+  UNLOCK (file_monitor_path_and_info);
+}
+
+/// Start the file or directory monitoring thread.
+///
+/// Falls back to polling if inotify is not available. With
+/// mqtt_event_loop=epoll the inotify instance and two timers are added to the
+/// reactor instead of the threads.
+///
+
+void
+openDHANA__config__file_monitor_start ()
+{
+  pthread_condattr_t attr;
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&file_monitor_pending_calls_cond, &attr);
+  pthread_condattr_destroy (&attr);
+
+  if (openDHANA__reactor__enabled ())
+    {
+      file_monitor_inotify = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+      if (file_monitor_inotify == -1)
+        WARNING ("file/monitor",
+                 "inotify not available, " + string (strerror (errno))
+                 + ", polling instead.");
+      else
+        openDHANA__reactor__add (file_monitor_inotify, EPOLLIN,
+                                 openDHANA__config__file_monitor_inotify_ready);
+
+      file_monitor_dispatch_timer =
+              openDHANA__reactor__timer (openDHANA__config__file_monitor_dispatch_ready);
+      file_monitor_poll_timer =
+              openDHANA__reactor__timer (openDHANA__config__file_monitor_poll_ready);
+      if (file_monitor_poll_timer != -1)
+        openDHANA__reactor__arm (file_monitor_poll_timer,
+                                 FILE_MONITOR_POLL_INTERVAL_MS,
+                                 FILE_MONITOR_POLL_INTERVAL_MS);
+      return;
+    }
+
+  if (pthread_create (&file_monitor_pending_calls_thread,
+                      NULL,
+                      openDHANA__config__file_monitor_dispatch_thread,
+                      NULL) != 0)
+    ERROR ("file/monitor", "error creating thread");
+
+  file_monitor_inotify = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (file_monitor_inotify == -1)
+    WARNING ("file/monitor",
+             "inotify not available, " + string (strerror (errno))
+             + ", polling instead.");
+
+  if (pthread_create (&file_monitor_path_and_info_thread,
+                      NULL,
+                      openDHANA__config__file_monitor_thread,
+                      NULL) != 0)
+    ERROR ("file/monitor", "error creating thread");
+
+  // TODO: put this line below in the right place:
+  //pthread_join (file_monitor_path_and_info_thread, NULL);
+}
+
+/// Add a file or directory to the monitor list
+///
+/// The path provided is checked to see if it is valid to monitor.
+///
+/// @param file_or_dir          the file or directory path.
+/// @param callback             the callback function.
+/// @return                     __true__ if the file could be added to the list,
+///                             __false__ otherwise.
+///
+
+bool
+openDHANA__config__file_monitor (const string& file_or_dir,
+                                 void (*callback) (string))
+{
+  LOCK (file_monitor_path_and_info);
+
+  struct stat node_stat;
+  bool is_dir = false;
+
+  if (stat (file_or_dir.c_str (), &node_stat) == -1)
+    {
+      // Node doesn't exist
+      ERROR ("file/monitor", "\"" + file_or_dir + "\" " + strerror (errno));
+
+      UNLOCK (file_monitor_path_and_info);
+      return false;
+    }
+  else
+    {
+      // Check what kind of node the path is
+      switch (node_stat.st_mode & S_IFMT)
+        {
+        case S_IFBLK:
+          WARNING ("file/monitor",
+                   "\"" + file_or_dir
+                   + "\", sorry, we don't monitor block devices.");
+
+          UNLOCK (file_monitor_path_and_info);
+          return false;
+          break;
+        case S_IFCHR:
+          WARNING ("file/monitor",
+                   "\"" + file_or_dir
+                   + "\", sorry, we don't monitor character devices.");
+
+          UNLOCK (file_monitor_path_and_info);
+          return false;
+          break;
+        case S_IFDIR:
+          //	  printf ("directory\n");
+          is_dir = true;
+          node_stat =
+                  openDHANA__config__file_monitor_scan_directory (file_or_dir);
+          break;
+        case S_IFIFO:
+          WARNING ("file/monitor",
+                   "\"" + file_or_dir
+                   + "\", sorry, we don't monitor FIFI/pipe devices.");
+
+          UNLOCK (file_monitor_path_and_info);
           return false;
           break;
         case S_IFLNK:
@@ -745,6 +2764,7 @@ openDHANA__config__file_monitor (const string& file_or_dir,
   file_monitor_entry entry;
   entry.node_stat = node_stat;
   entry.callback = callback;
+  openDHANA__config__file_monitor_add_watch (file_or_dir, is_dir, entry);
 
   // Save initial modtime
   file_monitor_path_and_info[file_or_dir] = entry;
@@ -755,874 +2775,4609 @@ openDHANA__config__file_monitor (const string& file_or_dir,
   return true;
 }
 
-/// Check if a line is to be processed or not.
-///
-/// Comment lines and empty lines are not processed.
-///
-/// @param line                 a line from a configuration file.
-/// @return                     __true__ if the line should be processed,
-///                             __false__ otherwise.
+line_view::line_view (void)
+{
+  data = "";
+  length = 0;
+}
+
+line_view::line_view (const char *data, size_t length)
+{
+  this->data = data;
+  this->length = length;
+}
+
+line_view::line_view (const string& s)
+{
+  data = s.data ();
+  length = s.length ();
+}
+
+string
+line_view::str (void) const
+{
+  return string (data, length);
+}
+
+bool
+line_view::operator== (const char *s) const
+{
+  return strncmp (data, s, length) == 0 && s[length] == '\0';
+}
+
+bool
+line_view::operator== (const line_view& other) const
+{
+  return length == other.length && memcmp (data, other.data, length) == 0;
+}
+
+/// FNV-1a hash of the characters in a view.
+///
+
+size_t
+line_view_hash::operator() (const line_view& view) const
+{
+  size_t hash = 2166136261u;
+
+  for (size_t i = 0; i != view.length; i++)
+    {
+      hash ^= (unsigned char) view.data[i];
+      hash *= 16777619u;
+    }
+  return hash;
+}
+
+config_file::config_file (void)
+{
+  _offset = 0;
+  _line_number = 0;
+  memset (&_status, 0, sizeof (_status));
+}
+
+config_file::~config_file (void)
+{
+  close ();
+}
+
+/// Read a configuration file into memory.
+///
+/// The file is read, not mapped. A monitored file may be rewritten in place
+/// while it is parsed, a read then gets a short file where a mapping would
+/// fault.
+///
+/// @param path                 the path of the file.
+/// @return                     __true__ if the file could be read,
+///                             __false__ otherwise. An error is logged.
+///
+
+bool
+config_file::open (const string& path)
+{
+  close ();
+
+  int fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      ERROR ("file/open", "opening \"" + path + "\" for read.");
+      return false;
+    }
+
+  if (fstat (fd, &_status) == -1)
+    {
+      ERROR ("file/open", "\"" + path + "\", " + strerror (errno));
+      ::close (fd);
+      close ();
+      return false;
+    }
+
+  // The size is a hint, the file may change while it is read
+  size_t length = 0;
+
+  _buffer.resize (_status.st_size > 0 ? _status.st_size + 1 : 4096);
+  for (;;)
+    {
+      ssize_t got = read (fd, &_buffer[length], _buffer.size () - length);
+
+      if (got == -1 && errno == EINTR)
+        continue;
+      if (got == -1)
+        {
+          ERROR ("file/open", "\"" + path + "\", " + strerror (errno));
+          ::close (fd);
+          close ();
+          return false;
+        }
+      if (got == 0)
+        break;
+
+      length += got;
+      if (length == _buffer.size ())
+        _buffer.resize (_buffer.size () * 2);
+    }
+  _buffer.resize (length);
+
+  ::close (fd);
+  return true;
+}
+
+/// Forget the file.
+///
+
+void
+config_file::close (void)
+{
+  _buffer.clear ();
+  _offset = 0;
+  _line_number = 0;
+  memset (&_status, 0, sizeof (_status));
+}
+
+/// Get the next line in the file. Lines may be of any length.
+///
+/// @param line                 set to the line, without the line feed.
+/// @return                     __true__ if there was a line, __false__ at the
+///                             end of the file.
+///
+
+bool
+config_file::nextLine (line_view& line)
+{
+  size_t size = _buffer.size ();
+
+  if (_offset >= size)
+    return false;
+
+  const char *start = _buffer.data () + _offset;
+  const char *end = (const char *) memchr (start, '\n', size - _offset);
+
+  if (end == NULL)
+    {
+      line = line_view (start, size - _offset);
+      _offset = size;
+    }
+  else
+    {
+      line = line_view (start, end - start);
+      _offset += end - start + 1;
+    }
+
+  _line_number++;
+  return true;
+}
+
+/// The whole file.
+///
+
+line_view
+config_file::contents (void) const
+{
+  return line_view (_buffer);
+}
+
+/// FNV-1a hash of the whole file.
+///
+/// @return                     The hash of the file contents.
+///
+
+uint64_t
+config_file::hash (void) const
+{
+  uint64_t hash = 14695981039346656037ull;
+
+  for (size_t i = 0; i != _buffer.size (); i++)
+    {
+      hash ^= (unsigned char) _buffer[i];
+      hash *= 1099511628211ull;
+    }
+  return hash;
+}
+
+/// The status of the file when it was opened.
+///
+
+const struct stat&
+config_file::status (void) const
+{
+  return _status;
+}
+
+/// The line number of the last line returned by nextLine, starting at 1.
+///
+
+int
+config_file::lineNumber (void) const
+{
+  return _line_number;
+}
+
+/// Identifies a snapshot file. Increase the version when the layout of a
+/// snapshotted table changes.
+///
+#define CONFIG_SNAPSHOT_MAGIC   "oDHANAsn"
+#define CONFIG_SNAPSHOT_VERSION 3
+
+class config_snapshot_header
+{
+public:
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+  uint64_t source_hash;
+};
+
+/// Get the header of the snapshot of a configuration file, from the status and
+/// the contents that were read, not from the file as it is now.
+///
+/// @param source               the configuration file, open.
+/// @param header               set to the header.
+///
+
+static void
+openDHANA__config__snapshot_header (const config_file& source,
+                                    config_snapshot_header& header)
+{
+  const struct stat& node_stat = source.status ();
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, CONFIG_SNAPSHOT_MAGIC, sizeof (header.magic));
+  header.version = CONFIG_SNAPSHOT_VERSION;
+  header.source_size = node_stat.st_size;
+  header.source_mtime_sec = node_stat.st_mtim.tv_sec;
+  header.source_mtime_nsec = node_stat.st_mtim.tv_nsec;
+  header.source_hash = source.hash ();
+}
+
+/// Write all of a buffer to a file.
+///
+/// @param fd                   the file.
+/// @param data                 the data.
+/// @param length               the length of the data.
+/// @return                     __true__ if it was all written, __false__
+///                             otherwise, errno is set.
+///
+
+static bool
+openDHANA__config__write (int fd, const void *data, size_t length)
+{
+  const char *next = (const char *) data;
+
+  while (length > 0)
+    {
+      ssize_t written = write (fd, next, length);
+
+      if (written == -1 && errno == EINTR)
+        continue;
+      if (written == -1)
+        return false;
+
+      next += written;
+      length -= written;
+    }
+  return true;
+}
+
+config_snapshot::config_snapshot (void)
+{
+  _data = NULL;
+  _size = 0;
+  _offset = 0;
+}
+
+config_snapshot::~config_snapshot (void)
+{
+  if (_data != NULL)
+    munmap ((void *) _data, _size);
+}
+
+/// Map the snapshot of a configuration file, if there is a valid one.
+///
+/// @param source_path          the path of the configuration file.
+/// @param source               the configuration file, open.
+/// @return                     __true__ if a valid snapshot was found,
+///                             __false__ otherwise.
+///
+
+bool
+config_snapshot::load (const string& source_path, const config_file& source)
+{
+  string path = source_path + ".snapshot";
+  config_snapshot_header expected;
+  config_snapshot_header header;
+  struct stat node_stat;
+
+  int fd = open (path.c_str (), O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  if (fstat (fd, &node_stat) == -1
+      || node_stat.st_size < (off_t) sizeof (header))
+    {
+      close (fd);
+      return false;
+    }
+
+  void *data = mmap (NULL, node_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  _data = (const char *) data;
+  _size = node_stat.st_size;
+  _offset = sizeof (header);
+  memcpy (&header, _data, sizeof (header));
+
+  openDHANA__config__snapshot_header (source, expected);
+  if (memcmp (&header, &expected, sizeof (header)) != 0)
+    {
+      INFO ("config/snapshot", "\"" + path + "\" is out of date.");
+      return false;
+    }
+
+  INFO ("config/snapshot", "using \"" + path + "\".");
+  return true;
+}
+
+/// Write the values put into the snapshot to the snapshot file. The file is
+/// synced and then replaced atomically.
+///
+/// @param source_path          the path of the configuration file.
+/// @param source               the configuration file the values were parsed
+///                             from.
+/// @return                     __true__ if the snapshot was written,
+///                             __false__ otherwise.
+///
+
+bool
+config_snapshot::save (const string& source_path, const config_file& source)
+{
+  string path = source_path + ".snapshot";
+  string temporary_path = path + ".tmp";
+  config_snapshot_header header;
+
+  openDHANA__config__snapshot_header (source, header);
+
+  int fd = open (temporary_path.c_str (), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    {
+      WARNING ("config/snapshot",
+               "\"" + temporary_path + "\", " + strerror (errno));
+      return false;
+    }
+
+  bool ok = openDHANA__config__write (fd, &header, sizeof (header))
+          && openDHANA__config__write (fd, _buffer.data (), _buffer.length ())
+          && fsync (fd) == 0;
+
+  if (close (fd) == -1 || !ok
+      || rename (temporary_path.c_str (), path.c_str ()) == -1)
+    {
+      WARNING ("config/snapshot", "\"" + path + "\", " + strerror (errno));
+      unlink (temporary_path.c_str ());
+      return false;
+    }
+
+  INFO ("config/snapshot", "saved \"" + path + "\".");
+  return true;
+}
+
+void
+config_snapshot::putString (const string& value)
+{
+  uint32_t length = value.length ();
+
+  _buffer.append ((const char *) &length, sizeof (length));
+  _buffer.append (value);
+}
+
+void
+config_snapshot::putInt (const int value)
+{
+  int32_t v = value;
+
+  _buffer.append ((const char *) &v, sizeof (v));
+}
+
+void
+config_snapshot::putDouble (const double value)
+{
+  _buffer.append ((const char *) &value, sizeof (value));
+}
+
+bool
+config_snapshot::getBytes (void *value, size_t length)
+{
+  if (_size - _offset < length)
+    return false;
+
+  memcpy (value, _data + _offset, length);
+  _offset += length;
+  return true;
+}
+
+bool
+config_snapshot::getString (string& value)
+{
+  uint32_t length;
+
+  if (!getBytes (&length, sizeof (length)) || _size - _offset < length)
+    return false;
+
+  value.assign (_data + _offset, length);
+  _offset += length;
+  return true;
+}
+
+bool
+config_snapshot::getInt (int& value)
+{
+  int32_t v;
+
+  if (!getBytes (&v, sizeof (v)))
+    return false;
+
+  value = v;
+  return true;
+}
+
+bool
+config_snapshot::getDouble (double& value)
+{
+  return getBytes (&value, sizeof (value));
+}
+
+/// Character classes used by the tokenizer, the same as "\s" and "\w" in the
+/// regular expressions.
+///
+
+static inline bool
+openDHANA__config__is_space (const char c)
+{
+  return isspace ((unsigned char) c);
+}
+
+static inline bool
+openDHANA__config__is_word (const char c)
+{
+  return isalnum ((unsigned char) c) || c == '_';
+}
+
+static inline bool
+openDHANA__config__is_digit (const char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+/// Check if a line is to be processed or not.
+///
+/// Comment lines and empty lines are not processed.
+///
+/// @param line                 a line from a configuration file.
+/// @return                     __true__ if the line should be processed,
+///                             __false__ otherwise.
+///
+
+bool
+openDHANA__config__process_this_line (const line_view& line)
+{
+  const char *p = line.data;
+  const char *end = line.data + line.length;
+
+  if (p != end && (*p == '#' || *p == ';'))
+    return false; // a comment line, do not process
+  if (end - p >= 2 && p[0] == '/' && p[1] == '/')
+    return false; // a comment line, do not process
+
+  while (p != end && openDHANA__config__is_space (*p))
+    p++;
+  if (p == end)
+    return false; // an empty line, do not process
+
+  return true;
+}
+
+bool
+openDHANA__config__process_this_line (const string& line)
+{
+  return openDHANA__config__process_this_line (line_view (line));
+}
+
+/// Split a configuration file line into the command and the options part
+///
+/// Example line:
+/// multilevel_lamp screen="housemap" display_value="sub_lamp4_get" ...
+///
+/// The command is a word, optionally preceded by whitespace, that must be
+/// followed by at least one whitespace. The parameters are the rest of the
+/// line after that whitespace.
+///
+/// @param line                 one line from a configuration file. Empty lines
+///                             and lines with comments must not be passed to
+///                             this function.
+/// @param command              set to the command.
+/// @param parameters           set to all the parameters.
+/// @returns                    __true__ if the line could be split,
+///                             __false__ otherwise.
+///
+
+bool
+openDHANA__config__tokenize_line (const line_view& line,
+                                  line_view& command,
+                                  line_view& parameters)
+{
+  const char *p = line.data;
+  const char *end = line.data + line.length;
+
+  while (p != end && openDHANA__config__is_space (*p))
+    p++;
+
+  const char *command_start = p;
+  while (p != end && openDHANA__config__is_word (*p))
+    p++;
+
+  if (p == command_start || p == end || !openDHANA__config__is_space (*p))
+    return false;
+
+  command = line_view (command_start, p - command_start);
+
+  while (p != end && openDHANA__config__is_space (*p))
+    p++;
+
+  parameters = line_view (p, end - p);
+  return true;
+}
+
+/// Get the length of an option value, if there is one at the start of the data.
+///
+/// The longest of the allowed value forms is used, just as a POSIX regular
+/// expression would do.
+///
+/// @param p                    the start of the value.
+/// @param end                  the end of the data.
+/// @returns                    The length of the value, or 0 if there isn't a
+///                             valid value.
+///
+
+static size_t
+openDHANA__config__value_length (const char *p,
+                                 const char *end)
+{
+  if (p == end)
+    return 0;
+
+  // key="string" or key='string'
+  if (*p == '"' || *p == '\'')
+    {
+      const char *close = (const char *) memchr (p + 1, *p, end - p - 1);
+      return close == NULL ? 0 : close - p + 1;
+    }
+
+  size_t longest = 0;
+
+  // key=letters_or_underscores
+  const char *q = p;
+  while (q != end && openDHANA__config__is_word (*q))
+    q++;
+  longest = q - p;
+
+  // key=12345, key=-12345, key=0.12345 or key=-0.12345
+  q = p;
+  if (*q == '-')
+    q++;
+  const char *digits = q;
+  while (q != end && openDHANA__config__is_digit (*q))
+    q++;
+  bool integer = q != digits;
+  if (q != end && *q == '.' && q + 1 != end
+      && openDHANA__config__is_digit (q[1]))
+    {
+      q++;
+      while (q != end && openDHANA__config__is_digit (*q))
+        q++;
+      integer = true;
+    }
+  if (integer && (size_t) (q - p) > longest)
+    longest = q - p;
+
+  return longest;
+}
+
+/// Split a string with options into a vector of options
+///
+/// Example string:
+/// screen="housemap" display_value="sub_lamp4_get" ...
+///
+/// These versions of options are allowed:
+/// - key="string"
+/// - key='string'
+/// - key=letters_or_underscores
+/// - key=12345 (positive integers)
+/// - key=-12345 (negative integers)
+/// - key=0.12345 (postove decimal numbers)
+/// - key=-0.12345 (negative decimal numbers)
+///
+/// The string is scanned once. Text that doesn't form an option is skipped.
+///
+/// @param all_options          the string with options.
+///                             @see openDHANA__config__tokenize_line
+/// @param options              the options found are appended to this vector,
+///                             each one as "key=value" without surrounding
+///                             whitespace.
+/// @returns			__true__ if at least one option was found,
+///                             __false__ otherwise.
+///
+
+bool
+openDHANA__config__tokenize_parameters (const line_view& all_options,
+                                        line_view_vector& options)
+{
+  const char *p = all_options.data;
+  const char *end = all_options.data + all_options.length;
+  bool found = false;
+
+  while (p != end)
+    {
+      if (!openDHANA__config__is_word (*p))
+        {
+          p++;
+          continue;
+        }
+
+      // The key
+      const char *key = p;
+      while (p != end && openDHANA__config__is_word (*p))
+        p++;
+
+      const char *q = p;
+      while (q != end && openDHANA__config__is_space (*q))
+        q++;
+      if (q == end || *q != '=')
+        continue;
+      q++;
+      while (q != end && openDHANA__config__is_space (*q))
+        q++;
+
+      // The value
+      size_t value_length = openDHANA__config__value_length (q, end);
+      if (value_length == 0)
+        {
+          // Not an option here, the key might still be the value of the next
+          p = key + 1;
+          continue;
+        }
+
+      p = q + value_length;
+      options.push_back (line_view (key, p - key));
+      found = true;
+    }
+
+  return found;
+}
+
+/// Split a configuration file line into the command and the options part
+///
+/// @see openDHANA__config__tokenize_line
+///
+/// @param line                 one line from a configuration file.
+/// @returns                    A string vector with the first element
+///                             containing the command and the second element
+///                             all the parameters, or an empty vector if the
+///                             line couldn't be split.
+///
+
+string_vector
+openDHANA__config__split_line (const string& line)
+{
+  string_vector res;
+  line_view command, parameters;
+
+  if (openDHANA__config__tokenize_line (line_view (line), command, parameters))
+    {
+      res.push_back (command.str ());
+      res.push_back (parameters.str ());
+    }
+  return res;
+}
+
+/// Split a string with options into a vector of options
+///
+/// @see openDHANA__config__tokenize_parameters
+///
+/// @param all_options          the string with options.
+/// @returns			A string vector with the options.
+///
+
+string_vector
+openDHANA__config__split_parameters (const string& all_options)
+{
+  string_vector res;
+  line_view_vector options;
+
+  openDHANA__config__tokenize_parameters (line_view (all_options), options);
+  for (line_view_vector::const_iterator option = options.begin ();
+          option != options.end (); ++option)
+    res.push_back (option->str ());
+
+  return res;
+}
+
+
+#endif // openDHANA__config__
+
+//=============================================================================
+// openDHANA__option__
+//=============================================================================
+#ifndef openDHANA__option__
+
+OptionSchema openDHANA_option_store;
+
+Option::Option (void)
+{
+  _required = false;
+  _given = false;
+  _compiled_reg_ex = NULL;
+  _type = OptionString;
+  _bool_value = false;
+  _int_value = 0;
+  _enum_value = -1;
+}
+
+/// Define an option.
+///
+/// @param required             OptionRequired or OptionOptional.
+/// @param default_value        the value if the option isn't given.
+/// @param reg_ex               the regular expression for valid values, with
+///                             one group for the value. For an OptionEnum it
+///                             lists the values, e.g. "(none|some|all)".
+/// @param type                 the type the value is parsed into.
+///
+
+Option::Option (const bool required, const string& default_value,
+                const string& reg_ex, OptionType type)
+{
+  _reg_ex = reg_ex;
+  _default_value = default_value;
+  _value = default_value;
+  _required = required;
+  _given = false;
+  _compiled_reg_ex = openDHANA__generic__reg_ex_compiled ("^" + reg_ex + "$",
+                                                          default_value);
+  _type = type;
+
+  if (type == OptionEnum)
+    {
+      // The values are the alternatives in the group
+      size_t start = reg_ex.find ('(') + 1;
+      size_t end = reg_ex.rfind (')');
+
+      while (start < end)
+        {
+          size_t bar = reg_ex.find ('|', start);
+
+          if (bar == string::npos || bar > end)
+            bar = end;
+          _enum_values.push_back (reg_ex.substr (start, bar - start));
+          start = bar + 1;
+        }
+    }
+
+  parseType ();
+}
+
+/// Parse the value into the type of the option.
+///
+
+void
+Option::parseType (void)
+{
+  switch (_type)
+    {
+    case OptionBool:
+      _bool_value = _value == "true";
+      break;
+    case OptionInt:
+      _int_value = strtol (_value.c_str (), NULL, 10);
+      break;
+    case OptionEnum:
+      _enum_value = -1;
+      for (size_t i = 0; i != _enum_values.size (); i++)
+        if (_enum_values[i] == _value)
+          _enum_value = i;
+      break;
+    case OptionString:
+      break;
+    }
+}
+
+void
+Option::setValue (const string& value)
+{
+  _value = value;
+  parseType ();
+}
+
+/// Validate a value against the options regular expression and keep the
+/// value group if it matched.
+///
+/// @param value                the value, without the key and the "=".
+/// @returns                    __true__ if the value is valid, __false__
+///                             otherwise.
+///
+
+bool
+Option::parseValue (const line_view& value)
+{
+  regmatch_t m[1 + 1];
+
+  if (_compiled_reg_ex == NULL)
+    return false;
+
+#  ifdef REG_STARTEND
+  m[0].rm_so = 0;
+  m[0].rm_eo = value.length;
+  if (regexec (_compiled_reg_ex, value.data, 1 + 1, m, REG_STARTEND) != 0)
+    return false;
+#  else
+  string terminated = value.str ();
+  if (regexec (_compiled_reg_ex, terminated.c_str (), 1 + 1, m, 0) != 0)
+    return false;
+#  endif
+
+  if (m[1].rm_so == -1)
+    _value.clear ();
+  else
+    _value.assign (value.data + m[1].rm_so, m[1].rm_eo - m[1].rm_so);
+  parseType ();
+  return true;
+}
+
+void
+Option::reset (void)
+{
+  _value = _default_value;
+  _given = false;
+  parseType ();
+}
+
+void
+Option::setGiven (void)
+{
+  _given = true;
+}
+
+bool
+Option::isGiven (void) const
+{
+  return _given;
+}
+
+string
+Option::getRegEx () const
+{
+  return _reg_ex;
+}
+
+bool
+Option::isRequired (void) const
+{
+  return _required;
+}
+
+string
+Option::getDefaultValue (void) const
+{
+  return _default_value;
+}
+
+string
+Option::getValue (void) const
+{
+  return _value;
+}
+
+OptionType
+Option::getType (void) const
+{
+  return _type;
+}
+
+const string&
+Option::getString (void) const
+{
+  return _value;
+}
+
+bool
+Option::getBool (void) const
+{
+  return _bool_value;
+}
+
+long
+Option::getInt (void) const
+{
+  return _int_value;
+}
+
+/// Get the value of an OptionEnum.
+///
+/// @returns                    The index of the value in the values of the
+///                             regular expression, or -1 if not found.
+///
+
+int
+Option::getEnum (void) const
+{
+  return _enum_value;
+}
+
+/// Get an option definition, create it if it doesn't exist.
+///
+
+Option&
+OptionSchema::operator[] (const string& key)
+{
+  std::map<string, Option>::iterator option = _options.find (key);
+
+  if (option == _options.end ())
+    {
+      option = _options.insert (std::make_pair (key, Option ())).first;
+
+      // The key in the map is stable, so the index can point into it
+      _index[line_view (option->first)] = &option->second;
+    }
+  return option->second;
+}
+
+/// Look up an option definition by its key.
+///
+/// @param key                  the key.
+/// @returns                    The option, or NULL if there is no option with
+///                             that key.
+///
+
+Option *
+OptionSchema::find (const line_view& key)
+{
+  std::unordered_map<line_view, Option *, line_view_hash>::const_iterator option =
+          _index.find (key);
+
+  if (option == _index.end ())
+    return NULL;
+  return option->second;
+}
+
+size_t
+OptionSchema::count (const string& key) const
+{
+  return _options.count (key);
+}
+
+/// Set all options to their default values and mark them as not given.
+///
+/// @returns                    The number of required options.
+///
+
+size_t
+OptionSchema::reset (void)
+{
+  size_t required = 0;
+
+  for (std::map<string, Option>::iterator option = _options.begin ();
+          option != _options.end (); ++option)
+    {
+      option->second.reset ();
+      if (option->second.isRequired ())
+        required++;
+    }
+  return required;
+}
+
+/// Get the required options that have not been given.
+///
+
+string_vector
+OptionSchema::missingRequired (void) const
+{
+  string_vector missing;
+
+  for (std::map<string, Option>::const_iterator option = _options.begin ();
+          option != _options.end (); ++option)
+    {
+      if (option->second.isRequired () && !option->second.isGiven ())
+        missing.push_back (option->first);
+    }
+  return missing;
+}
+
+/// Look up an option for a handle. The option definitions in
+/// openDHANA_option_store never move, so the handle can keep a pointer.
+///
+/// @param name                 the name of the option.
+///
+
+option_handle::option_handle (const char *name)
+  : _name (name), _option (NULL)
+{
+  if (option () == NULL)
+    ERROR ("config/option", "option \"" + string (name) + "\" is not defined.");
+}
+
+/// Look the option up if it wasn't found before.
+///
+/// @return                     the option, NULL if it isn't defined.
+///
+
+const Option *
+option_handle::option (void) const
+{
+  const Option *found = _option.load (std::memory_order_acquire);
+
+  if (found == NULL)
+    {
+      found = openDHANA_option_store.find (line_view (_name, strlen (_name)));
+      if (found != NULL)
+        _option.store (found, std::memory_order_release);
+    }
+
+  return found;
+}
+
+const string&
+option_handle::value (void) const
+{
+  static const string undefined;
+  const Option *found = option ();
+
+  return found == NULL ? undefined : found->getString ();
+}
+
+bool
+option_handle::enabled (void) const
+{
+  const Option *found = option ();
+
+  return found == NULL ? false : found->getBool ();
+}
+
+long
+option_handle::number (void) const
+{
+  const Option *found = option ();
+
+  return found == NULL ? 0 : found->getInt ();
+}
+
+int
+option_handle::choice (void) const
+{
+  const Option *found = option ();
+
+  return found == NULL ? -1 : found->getEnum ();
+}
+
+/// Get the value of an option
+///
+/// If the option doesn't exist, then print an error message
+///
+/// @param option               the option we want.
+/// @return                     the options value or "**error**" if no option
+///                             was found
+
+string
+openDHANA__option__get_value (const string option)
+{
+
+  if (openDHANA_option_store.count (option))
+    return openDHANA_option_store[option].getValue ();
+
+  ERROR ("config/option", "option \"" + option + "\" is not defined.");
+  return "**error**";
+}
+
+/// Get the value of an option
+///
+/// If the option doesn't exist, then print an error message
+///
+/// @param option               the option we want.
+/// @return                     the options value or "**error**" if no option
+///                             was found
+
+string
+openDHANA__option__get_default_value (const string option)
+{
+
+  if (openDHANA_option_store.count (option))
+    return openDHANA_option_store[option].getDefaultValue ();
+
+  ERROR ("config/option", "option \"" + option + "\" is not defined.");
+  return "**error**";
+}
+
+
+
+/// Display a warning message about missing or invalid options.
+///
+/// @param all_options          the string with options.
+///                             @see openDHANA__config__split_line
+/// @returns			Nothing.
+///
+
+void
+openDHANA__options__invalid_missing_options (const string file,
+                                             int line_number)
+{
+
+  char line_number_str[10];
+  snprintf (line_number_str, sizeof(line_number_str), "%d", line_number);
+
+  WARNING ("config/syntax",
+           "line \"" + file + ":" + line_number_str
+           + "\" invalid or missing options, ignored.");
+}
+
+/// Display a warning message about unknown commands in a config file.
+///
+/// @param all_options          the string with options.
+///                             @see openDHANA__config__split_line
+/// @returns			Nothing.
+///
+
+void
+openDHANA__options__uknown_definition (const string definition)
+{
+
+  WARNING ("config/syntax",
+           "unknown definition \"" + definition + "\", ignored.");
+}
+
+/// Read options from an .option file
+///
+/// Comments and empty lines are ignored
+///
+/// @param path                 the path of the file to read.
+/// @return                     A string vector with the options. Each option
+///                             is still one string.
+//
+
+string_vector
+openDHANA__options__read_file (const string& path)
+{
+  config_file file;
+  line_view line;
+  string_vector options;
+
+  if (!file.open (path))
+    exit (1);
+
+  while (file.nextLine (line))
+    {
+      if (openDHANA__config__process_this_line (line))
+        {
+          // Save the option
+
+          options.push_back (line.str ());
+        }
+    }
+  return options;
+}
+
+/// Split a given option into its key and value.
+///
+/// @param option               the option, "key=value" with optional
+///                             whitespace around the key, "=" and value.
+/// @param key                  set to the key.
+/// @param value                set to the value.
+/// @returns                    __true__ if the option could be split,
+///                             __false__ otherwise.
+///
+
+static bool
+openDHANA__options__split_option (const line_view& option,
+                                  line_view& key,
+                                  line_view& value)
+{
+  const char *p = option.data;
+  const char *end = option.data + option.length;
+
+  while (p != end && isspace ((unsigned char) *p))
+    p++;
+
+  const char *key_start = p;
+  while (p != end && (isalnum ((unsigned char) *p) || *p == '_'))
+    p++;
+  if (p == key_start)
+    return false;
+  key = line_view (key_start, p - key_start);
+
+  while (p != end && isspace ((unsigned char) *p))
+    p++;
+  if (p == end || *p != '=')
+    return false;
+  p++;
+  while (p != end && isspace ((unsigned char) *p))
+    p++;
+
+  while (end != p && isspace ((unsigned char) end[-1]))
+    end--;
+  value = line_view (p, end - p);
+
+  return true;
+}
+
+/// Check that the "batch" of options we have are valid.
+///
+/// Each given option is looked up by its key, and only its value is matched
+/// against the defined options regular expression.
+///
+/// @param given_options        the list with options from files and command
+///                             line.
+/// @param defined_options      the list withe the definitions of required and
+///                             optional options.
+/// @returns			___true___ if all options are ok, __false__
+///                             otherwise.
+///
+
+bool
+openDHANA__options__check (const line_view_vector& given_options,
+                           OptionSchema& defined_options)
+{
+  bool all_ok = true;
+
+  // Set the default values
+  size_t required = defined_options.reset ();
+  size_t required_given = 0;
+
+  // Go through the given options and verify that they are valid, and get their
+  // values.
+  // An option can be present more than one one, if for example a parameter that
+  // is present in the .options file is overridden on the command line. The
+  // last one wins.
+
+  for (line_view_vector::const_iterator given_option = given_options.begin ();
+          given_option != given_options.end ();
+          ++given_option)
+    {
+      line_view key, value;
+      Option *option = NULL;
+
+      if (openDHANA__options__split_option (*given_option, key, value))
+        option = defined_options.find (key);
+
+      if (option == NULL || !option->parseValue (value))
+        {
+          WARNING ("config/syntax",
+                   "invalid option \"" + given_option->str () + "\"");
+          all_ok = false;
+          continue;
+        }
+
+      if (option->isRequired () && !option->isGiven ())
+        required_given++;
+      option->setGiven ();
+    }
+
+  // Finally, check that all the required defined options are given
+
+  if (required_given != required)
+    {
+      string_vector missing = defined_options.missingRequired ();
+      for (string_vector::const_iterator option = missing.begin ();
+              option != missing.end (); ++option)
+        {
+          WARNING ("config/syntax",
+                   "required option \"" + *option + "\" is missing.");
+        }
+      all_ok = false;
+    }
+
+  return all_ok;
+}
+
+bool
+openDHANA__options__check (const string_vector& given_options,
+                           OptionSchema& defined_options)
+{
+  line_view_vector options;
+
+  for (string_vector::const_iterator given_option = given_options.begin ();
+          given_option != given_options.end ();
+          ++given_option)
+    options.push_back (line_view (*given_option));
+
+  return openDHANA__options__check (options, defined_options);
+}
+
+/// Set the generic options that are needed by all modules
+///
+
+void
+openDHANA__options__set_generic ()
+{
+
+  openDHANA_option_store["mqtt_bind_address"] =
+          Option (OptionOptional, "",
+                  "([0-9]+)");
+
+  openDHANA_option_store["mqtt_broker_check_interval"] =
+          Option (OptionOptional, "60",
+                  "([0-9]+)", OptionInt);
+
+  openDHANA_option_store["mqtt_disable_clean_session"] =
+          Option (OptionOptional, "false",
+                  "(true|false)", OptionBool);
+
+  openDHANA_option_store["mqtt_cafile"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_cert"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_ciphers"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["config_snapshot"] =
+          Option (OptionOptional, "false",
+                  "(true|false)", OptionBool);
+
+  openDHANA_option_store["daemon"] =
+          Option (OptionOptional, "false",
+                  "(true|false)", OptionBool);
+
+  openDHANA_option_store["mqtt_debug"] =
+          Option (OptionOptional, "false",
+                  "(true|false)", OptionBool);
+
+  openDHANA_option_store["mqtt_event_loop"] =
+          Option (OptionOptional, "threads",
+                  "(threads|epoll)", OptionEnum);
+
+  openDHANA_option_store["mqtt_host"] =
+          Option (OptionOptional, "localhost",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_id"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_id_prefix"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_insecure"] =
+          Option (OptionOptional, "false",
+                  "(true|false)", OptionBool);
+
+  openDHANA_option_store["mqtt_keepalive"] =
+          Option (OptionOptional, "60",
+                  "([0-9]+)", OptionInt);
+
+  openDHANA_option_store["mqtt_key"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_log_file"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_log_control_topic"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_log_format"] =
+          Option (OptionOptional, "text",
+                  "(text|binary)", OptionEnum);
+
+  openDHANA_option_store["mqtt_log_levels"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_map_file"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_port"] =
+          Option (OptionOptional, "1883",
+                  "([0-9]+)", OptionInt);
+
+  openDHANA_option_store["mqtt_publish_overflow"] =
+          Option (OptionOptional, "drop_oldest",
+                  "(block|drop_oldest|drop_newest|coalesce)", OptionEnum);
+
+  openDHANA_option_store["mqtt_publish_queue_size"] =
+          Option (OptionOptional, "1024",
+                  "([0-9]+)", OptionInt);
+
+  openDHANA_option_store["mqtt_pw"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_psk"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_psk_identity"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_session_file"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_spool_file"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_spool_size"] =
+          Option (OptionOptional, "10000",
+                  "([0-9]+)", OptionInt);
+
+  openDHANA_option_store["mqtt_srv_lookups"] =
+          Option (OptionOptional, "false",
+                  "(true|false)", OptionBool);
+
+  openDHANA_option_store["mqtt_tls_version"] =
+          Option (OptionOptional, "tlsv1.2",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_username"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_wait_for_broker"] =
+          Option (OptionOptional, "false",
+                  "(true|false)", OptionBool);
+
+  openDHANA_option_store["mqtt_will_payload"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+
+  openDHANA_option_store["mqtt_will_qos"] =
+          Option (OptionOptional, "0",
+                  "(0|1|2)", OptionInt);
+
+  openDHANA_option_store["mqtt_will_retain"] =
+          Option (OptionOptional, "false",
+                  "(true|false)", OptionBool);
+
+  openDHANA_option_store["mqtt_will_topic"] =
+          Option (OptionOptional, "",
+                  "\"(.*)\"");
+}
+
+/// Set internal values based on options values
+///
+
+void
+openDHANA__options__process ()
+{
+
+  if (OPTION_BOOL (mqtt_debug))
+    dhana_mqtt_debug = true;
+
+  openDHANA__generic__log_control (OPTION_STRING (mqtt_log_levels));
+}
+
+/// Get the options from files and the command line. Also read the mqttmap.
+///
+/// @param option_file          the file containing the options.
+/// @param argc                 from command line.
+/// @param argv                 from command line
+///
+
+void
+openDHANA__options__get (const string& option_file,
+                         int argc,
+                         char* argv[])
+{
+  openDHANA__options__set_generic (); // Add MQTT options
+
+  string_vector options = openDHANA__options__read_file (option_file);
+
+  // Read the command line and get its parameters, they will override the same
+  // parameter from the file
+
+  for (int i = 1; i != argc; i++)
+    options.push_back (argv[i]);
+
+
+  if (!openDHANA__options__check (options, openDHANA_option_store))
+    {
+
+      ERROR ("config/syntax",
+             "invalid or missing options was encountered, exiting.");
+      exit (1);
+    }
+
+  //  for (std::map<string, Option>::const_iterator it =
+  //      openDHANA_option_store.begin (); it != openDHANA_option_store.end ();
+  //      ++it)
+  //    {
+  //      Option o = it->second;
+  //      printf ("%s---%s\n", it->first.c_str (), o.getValue ().c_str ());
+  //    }
+
+  // Set internal options based on options
+  openDHANA__options__process ();
+
+  openDHANA_mqtt__config_files__read_mqttmap (OPTION_STRING (mqtt_map_file));
+}
+
+#endif // openDHANA__option__
+
+static std::map<int, string> valueGenre;
+
+struct mosquitto *mosq = NULL;
+
+/// __true__ when the broker has accepted the connection.
+///
+std::atomic<bool> broker_connected (false);
+
+// TODO: Remove these
+
+void
+setDoubleList (std::map<int, string> &forward,
+               std::map<string, int> &reverse, int key, string value)
+{
+
+  forward[key] = value;
+  reverse[value] = key;
+}
+
+void
+setDoubleList (string_map &forward,
+               string_map &reverse, string key,
+               string value)
+{
+
+  forward[key] = value;
+  reverse[value] = key;
+}
+
+
+//=============================================================================
+// openDHANA_mqtt__
+//=============================================================================
+#ifndef openDHANA_mqtt__
+
+/// The current publications and subscriptions. Readers take a reference with
+/// openDHANA_mqtt__config_files__get_map and never lock, a reload builds a new
+/// map and swaps it in.
+///
+mqtt_map_ptr openDHANA_mqtt_map (new mqtt_map);
+
+/// Counts the maps swapped in, so a thread can tell that its cached map is
+/// old with one load.
+///
+std::atomic<unsigned long> openDHANA_mqtt_map_generation;
+
+/// Serializes the reloads of the map.
+///
+CREATE_LOCK (openDHANA_mqtt_map);
+
+/// The internal topics that have been given ids, and their names by id. Ids
+/// are never taken back, so an id stays valid across reloads of the map.
+///
+std::unordered_map<string, topic_id> openDHANA_mqtt_topic_ids;
+string_vector openDHANA_mqtt_topic_names;
+CREATE_LOCK (openDHANA_mqtt_topics);
+
+/// Give an internal topic an id, the first time it is seen. The ids are dense,
+/// from 0, so they can index arrays.
+///
+/// @param internal_topic       the internal topic.
+/// @return                     the id.
+///
+
+topic_id
+openDHANA_mqtt__topics__intern (const string& internal_topic)
+{
+  topic_id topic;
+
+  LOCK (openDHANA_mqtt_topics);
+  std::unordered_map<string, topic_id>::const_iterator it =
+          openDHANA_mqtt_topic_ids.find (internal_topic);
+  if (it != openDHANA_mqtt_topic_ids.end ())
+    topic = it->second;
+  else
+    {
+      topic = openDHANA_mqtt_topic_names.size ();
+      openDHANA_mqtt_topic_ids[internal_topic] = topic;
+      openDHANA_mqtt_topic_names.push_back (internal_topic);
+    }
+  UNLOCK (openDHANA_mqtt_topics);
+
+  return topic;
+}
+
+/// Get the id of an internal topic, without giving it one.
+///
+/// @param internal_topic       the internal topic.
+/// @return                     the id, TOPIC_NONE if it has none.
+///
+
+topic_id
+openDHANA_mqtt__topics__find (const string& internal_topic)
+{
+  topic_id topic = TOPIC_NONE;
+
+  LOCK (openDHANA_mqtt_topics);
+  std::unordered_map<string, topic_id>::const_iterator it =
+          openDHANA_mqtt_topic_ids.find (internal_topic);
+  if (it != openDHANA_mqtt_topic_ids.end ())
+    topic = it->second;
+  UNLOCK (openDHANA_mqtt_topics);
+
+  return topic;
+}
+
+/// Get the internal topic of an id.
+///
+/// @param topic                the id.
+/// @return                     the internal topic, empty for an unknown id.
+///
+
+string
+openDHANA_mqtt__topics__name (topic_id topic)
+{
+  string name;
+
+  LOCK (openDHANA_mqtt_topics);
+  if (topic < openDHANA_mqtt_topic_names.size ())
+    name = openDHANA_mqtt_topic_names[topic];
+  UNLOCK (openDHANA_mqtt_topics);
+
+  return name;
+}
+
+/// Build the hash indexes and give the internal topics their ids. The indexes
+/// point into the maps, which must not change afterwards.
+///
+
+void
+mqtt_map::index (void)
+{
+  _publication_index.clear ();
+  _publication_index.reserve (publications.size ());
+  _publication_by_id.clear ();
+  for (std::map<string, mqtt_pub>::iterator pub = publications.begin ();
+          pub != publications.end (); ++pub)
+    {
+      topic_id topic = openDHANA_mqtt__topics__intern (pub->first);
+
+      pub->second.topic = topic;
+
+      if (topic >= _publication_by_id.size ())
+        _publication_by_id.resize (topic + 1, NULL);
+      _publication_by_id[topic] = &pub->second;
+      _publication_index[line_view (pub->first)] = &pub->second;
+    }
+
+  _subscription_index.clear ();
+  _subscription_index.reserve (subscriptions.size ());
+  _topic_nodes.clear ();
+  _topic_nodes.push_back (topic_node ());
+  for (std::map<string, mqtt_sub>::iterator sub = subscriptions.begin ();
+          sub != subscriptions.end (); ++sub)
+    {
+      sub->second.topic =
+              openDHANA_mqtt__topics__intern (sub->second.internal_topic);
+
+      if (sub->first.find_first_of ("+#") == string::npos)
+        _subscription_index[line_view (sub->first)] = &sub->second;
+      else if (!add_wildcard (sub->first, &sub->second))
+        WARNING ("config/syntax",
+                 "invalid wildcard subscription \"" + sub->first + "\".");
+    }
+}
+
+topic_node::topic_node (void)
+{
+  single = NULL;
+  subscription = NULL;
+  multi = NULL;
+}
+
+/// Add a subscription with wildcards to the trie.
+///
+/// @param mqtt_topic           the topic, "+" and "#" must be whole levels and
+///                             "#" must be the last level.
+/// @param sub                  the subscription.
+/// @return                     __false__ if the topic is invalid, __true__
+///                             otherwise.
+///
+
+bool
+mqtt_map::add_wildcard (const string& mqtt_topic, const mqtt_sub *sub)
+{
+  topic_node *node = &_topic_nodes.front ();
+  size_t start = 0;
+
+  for (;;)
+    {
+      size_t end = mqtt_topic.find ('/', start);
+      if (end == string::npos)
+        end = mqtt_topic.length ();
+
+      line_view level (mqtt_topic.data () + start, end - start);
+
+      if (level == "#")
+        {
+          if (end != mqtt_topic.length ())
+            return false;
+          node->multi = sub;
+          return true;
+        }
+
+      if (level == "+")
+        {
+          if (node->single == NULL)
+            {
+              _topic_nodes.push_back (topic_node ());
+              node->single = &_topic_nodes.back ();
+            }
+          node = node->single;
+        }
+      else if (memchr (level.data, '+', level.length) != NULL
+               || memchr (level.data, '#', level.length) != NULL)
+        return false;
+      else
+        {
+          std::unordered_map<line_view, topic_node *, line_view_hash>::iterator
+          child = node->children.find (level);
+
+          if (child == node->children.end ())
+            {
+              _topic_nodes.push_back (topic_node ());
+              child = node->children.insert
+                      (std::make_pair (level, &_topic_nodes.back ())).first;
+            }
+          node = child->second;
+        }
+
+      if (end == mqtt_topic.length ())
+        {
+          node->subscription = sub;
+          return true;
+        }
+      start = end + 1;
+    }
+}
+
+/// Match the levels of a topic against the trie, from a level on. A level
+/// matches a literal level before "+", and "+" before "#".
+///
+/// @param node                 the node of the level.
+/// @param levels               the levels of the topic.
+/// @param level                the level to match.
+/// @param matched              the levels matched by wildcards so far, the
+///                             levels matched by "#" are added as one.
+/// @return                     the subscription, NULL if none matched.
+///
+
+const mqtt_sub *
+mqtt_map::match_levels (const topic_node *node,
+                        const std::vector<line_view>& levels,
+                        size_t level,
+                        std::vector<line_view>& matched) const
+{
+  // A topic starting with "$" is only matched by a literal first level
+  bool system = level == 0 && levels[0].length != 0 && levels[0].data[0] == '$';
+
+  if (level == levels.size ())
+    {
+      if (node->subscription != NULL)
+        return node->subscription;
+
+      // "a/#" matches "a" too
+      if (node->multi != NULL)
+        matched.push_back (line_view (levels.back ().data
+                                      + levels.back ().length, 0));
+      return node->multi;
+    }
+
+  std::unordered_map<line_view, topic_node *, line_view_hash>::const_iterator
+  child = node->children.find (levels[level]);
+  if (child != node->children.end ())
+    {
+      const mqtt_sub *sub = match_levels (child->second, levels, level + 1,
+                                          matched);
+      if (sub != NULL)
+        return sub;
+    }
+
+  if (node->single != NULL && !system)
+    {
+      matched.push_back (levels[level]);
+      const mqtt_sub *sub = match_levels (node->single, levels, level + 1,
+                                          matched);
+      if (sub != NULL)
+        return sub;
+      matched.pop_back ();
+    }
+
+  if (node->multi != NULL && !system)
+    {
+      const line_view& last = levels.back ();
+
+      matched.push_back (line_view (levels[level].data,
+                                    last.data + last.length
+                                    - levels[level].data));
+      return node->multi;
+    }
+
+  return NULL;
+}
+
+/// Find the subscription of an MQTT topic, exact or with wildcards.
+///
+/// @param mqtt_topic           the MQTT topic.
+/// @param wildcards            gets the levels matched by "+", in order, and
+///                             then the levels matched by "#" as one string.
+///                             Empty for an exact match.
+/// @return                     the subscription, NULL if there is none.
+///
+
+const mqtt_sub *
+mqtt_map::match (const line_view& mqtt_topic, string_vector& wildcards) const
+{
+  const mqtt_sub *sub = subscription (mqtt_topic);
+
+  // Only the root, no wildcard subscriptions
+  if (sub != NULL || _topic_nodes.size () <= 1)
+    return sub;
+
+  std::vector<line_view> levels;
+  std::vector<line_view> matched;
+  const char *start = mqtt_topic.data;
+  const char *end = mqtt_topic.data + mqtt_topic.length;
+
+  for (;;)
+    {
+      const char *slash = (const char *) memchr (start, '/', end - start);
+      if (slash == NULL)
+        slash = end;
+      levels.push_back (line_view (start, slash - start));
+      if (slash == end)
+        break;
+      start = slash + 1;
+    }
+
+  sub = match_levels (&_topic_nodes.front (), levels, 0, matched);
+
+  if (sub != NULL)
+    for (std::vector<line_view>::const_iterator level = matched.begin ();
+            level != matched.end (); ++level)
+      wildcards.push_back (level->str ());
+
+  return sub;
+}
+
+/// Find the publication of an internal topic.
+///
+/// @param internal_topic       the internal topic.
+/// @return                     the publication, NULL if there is none.
+///
+
+const mqtt_pub *
+mqtt_map::publication (const line_view& internal_topic) const
+{
+  std::unordered_map<line_view, const mqtt_pub *, line_view_hash>::const_iterator
+  it = _publication_index.find (internal_topic);
+
+  return it == _publication_index.end () ? NULL : it->second;
+}
+
+/// Find the publication of an internal topic by its id.
+///
+/// @param topic                the id of the internal topic.
+/// @return                     the publication, NULL if there is none.
+///
+
+const mqtt_pub *
+mqtt_map::publication (topic_id topic) const
+{
+  return topic < _publication_by_id.size () ? _publication_by_id[topic] : NULL;
+}
+
+/// Find the subscription of an MQTT topic.
+///
+/// @param mqtt_topic           the MQTT topic.
+/// @return                     the subscription, NULL if there is none.
+///
+
+const mqtt_sub *
+mqtt_map::subscription (const line_view& mqtt_topic) const
+{
+  std::unordered_map<line_view, const mqtt_sub *, line_view_hash>::const_iterator
+  it = _subscription_index.find (mqtt_topic);
+
+  return it == _subscription_index.end () ? NULL : it->second;
+}
+
+/// Get the current publications and subscriptions.
+///
+/// @return                     The current map. It stays valid for as long as
+///                             the caller keeps the reference, even if the
+///                             map is reloaded.
+///
+
+mqtt_map_ptr
+openDHANA_mqtt__config_files__get_map ()
+{
+  return std::atomic_load (&openDHANA_mqtt_map);
+}
+
+/// Each thread's reference to the map, and the generation it was taken at.
+///
+static thread_local mqtt_map_ptr current_map_cache;
+static thread_local unsigned long current_map_generation;
+
+/// Get the current publications and subscriptions for the publish and message
+/// dispatch paths.
+///
+/// Each thread keeps its own reference to the map and only takes a new one
+/// when the generation has changed. Threads share nothing but a read of the
+/// generation, so they don't slow each other down. An old map is freed when
+/// the last thread that uses it moves on, threads that go idle let go of it
+/// with openDHANA_mqtt__config_files__refresh_map.
+///
+/// @return                     The current map. The reference stays valid
+///                             until the same thread calls this or
+///                             openDHANA_mqtt__config_files__refresh_map
+///                             again, a caller that may do so, through a
+///                             module or a Lua script, must keep a copy.
+///
+
+const mqtt_map_ptr&
+openDHANA_mqtt__config_files__current_map ()
+{
+  unsigned long current =
+          openDHANA_mqtt_map_generation.load (std::memory_order_acquire);
+
+  if (!current_map_cache || current_map_generation != current)
+    {
+      current_map_cache = std::atomic_load (&openDHANA_mqtt_map);
+      current_map_generation = current;
+    }
+  return current_map_cache;
+}
+
+/// Check if the map the calling thread keeps has been replaced by a reload.
+///
+/// @return                     __true__ if the thread keeps an old map.
+///
+
+bool
+openDHANA_mqtt__config_files__map_stale ()
+{
+  return current_map_cache
+          && current_map_generation
+          != openDHANA_mqtt_map_generation.load (std::memory_order_acquire);
+}
+
+/// Let go of the map the calling thread keeps if it has been replaced by a
+/// reload. Called by the threads that use the map when they go idle, so an
+/// old map isn't kept alive until their next message.
+///
+
+void
+openDHANA_mqtt__config_files__refresh_map ()
+{
+  if (openDHANA_mqtt__config_files__map_stale ())
+    current_map_cache.reset ();
+}
+
+/// Index a new map and put it in use. Must be called with the
+/// openDHANA_mqtt_map lock.
+///
+/// @param map                  the new map.
+///
+
+void
+openDHANA_mqtt__config_files__set_map (const std::shared_ptr<mqtt_map>& map)
+{
+  map->index ();
+  std::atomic_store (&openDHANA_mqtt_map, mqtt_map_ptr (map));
+  openDHANA_mqtt_map_generation.fetch_add (1, std::memory_order_release);
+  openDHANA_mqtt__publish_queue__map_changed ();
+}
+
+/// Load the publications and subscriptions from the snapshot of a .mqttmap
+/// file.
+///
+/// @param path                 the path to the .mqttmap file.
+/// @param file                 the .mqttmap file, open.
+/// @param map                  the map to load into, it must be empty.
+/// @return                     __true__ if the snapshot was valid and loaded,
+///                             __false__ otherwise.
+///
+
+bool
+openDHANA_mqtt__config_files__load_snapshot (const string& path,
+                                             const config_file& file,
+                                             mqtt_map& map)
+{
+  config_snapshot snapshot;
+  std::map<string, mqtt_pub> publications;
+  std::map<string, mqtt_sub> subscriptions;
+  int count;
+
+  if (!snapshot.load (path, file))
+    return false;
+
+  if (!snapshot.getInt (count))
+    return false;
+  for (int i = 0; i != count; i++)
+    {
+      string internal_topic;
+      mqtt_pub pub;
+      int retain;
+      int only_on_change;
+
+      if (!snapshot.getString (internal_topic)
+          || !snapshot.getString (pub.mqtt_topic)
+          || !snapshot.getInt (retain)
+          || !snapshot.getInt (pub.qos)
+          || !snapshot.getInt (pub.coalesce_ms)
+          || !snapshot.getDouble (pub.deadband)
+          || !snapshot.getInt (pub.min_interval_ms)
+          || !snapshot.getInt (only_on_change))
+        return false;
+
+      pub.retain = retain;
+      pub.only_on_change = only_on_change;
+      publications[internal_topic] = pub;
+    }
+
+  if (!snapshot.getInt (count))
+    return false;
+  for (int i = 0; i != count; i++)
+    {
+      string mqtt_topic;
+      mqtt_sub sub;
+
+      if (!snapshot.getString (mqtt_topic)
+          || !snapshot.getString (sub.internal_topic)
+          || !snapshot.getInt (sub.qos))
+        return false;
+
+      subscriptions[mqtt_topic] = sub;
+    }
+
+  map.publications.swap (publications);
+  map.subscriptions.swap (subscriptions);
+
+  return true;
+}
+
+/// Save the publications and subscriptions to a snapshot of a .mqttmap file.
+///
+/// @param path                 the path to the .mqttmap file.
+/// @param file                 the .mqttmap file the map was parsed from.
+/// @param map                  the map to save.
+///
+
+void
+openDHANA_mqtt__config_files__save_snapshot (const string& path,
+                                             const config_file& file,
+                                             const mqtt_map& map)
+{
+  config_snapshot snapshot;
+
+  snapshot.putInt (map.publications.size ());
+  for (std::map<string, mqtt_pub>::const_iterator pub =
+          map.publications.begin ();
+          pub != map.publications.end (); ++pub)
+    {
+      snapshot.putString (pub->first);
+      snapshot.putString (pub->second.mqtt_topic);
+      snapshot.putInt (pub->second.retain);
+      snapshot.putInt (pub->second.qos);
+      snapshot.putInt (pub->second.coalesce_ms);
+      snapshot.putDouble (pub->second.deadband);
+      snapshot.putInt (pub->second.min_interval_ms);
+      snapshot.putInt (pub->second.only_on_change);
+    }
+
+  snapshot.putInt (map.subscriptions.size ());
+  for (std::map<string, mqtt_sub>::const_iterator sub =
+          map.subscriptions.begin ();
+          sub != map.subscriptions.end (); ++sub)
+    {
+      snapshot.putString (sub->first);
+      snapshot.putString (sub->second.internal_topic);
+      snapshot.putInt (sub->second.qos);
+    }
+
+  snapshot.save (path, file);
+}
+
+/// Read a .mqttmap file
+///
+/// The file is read into a new map, which then replaces the current map in one
+/// step. Publishing is never blocked by a reload, and never sees a partly read
+/// map.
+///
+/// If "config_snapshot" is enabled, a valid snapshot of the file is used
+/// instead of parsing it, and a new snapshot is saved after parsing.
+///
+/// @param path                 the path to the file.
+///
+
+void
+openDHANA_mqtt__config_files__read_mqttmap (const string& path)
+{
+  LOCK (openDHANA_mqtt_map);
+
+  std::shared_ptr<mqtt_map> map (new mqtt_map);
+  config_file file;
+  line_view line;
+
+  if (!file.open (path))
+    {
+      UNLOCK (openDHANA_mqtt_map);
+      exit (1);
+    }
+
+  if (OPTION_BOOL (config_snapshot)
+      && openDHANA_mqtt__config_files__load_snapshot (path, file, *map))
+    {
+      openDHANA_mqtt__config_files__set_map (map);
+      UNLOCK (openDHANA_mqtt_map);
+      return;
+    }
+
+  OptionSchema publish;
+
+  publish["mqtt_topic"] =
+          Option (OptionRequired, "",
+                  "\"(.*)\"");
+
+  publish["internal_topic"] =
+          Option (OptionRequired, "",
+                  "\"(.*)\"");
+
+  publish["retain"] =
+          Option (OptionRequired, "",
+                  "(true|false)", OptionBool);
+
+  publish["qos"] =
+          Option (OptionRequired, "",
+                  "(0|1|2)", OptionInt);
+
+  publish["coalesce_ms"] =
+          Option (OptionOptional, "0",
+                  "([0-9]+)", OptionInt);
+
+  publish["deadband"] =
+          Option (OptionOptional, "0",
+                  "([0-9]*\\.?[0-9]+)");
+
+  publish["min_interval_ms"] =
+          Option (OptionOptional, "0",
+                  "([0-9]+)", OptionInt);
+
+  publish["only_on_change"] =
+          Option (OptionOptional, "false",
+                  "(true|false)", OptionBool);
+
+  OptionSchema subscribe;
+
+  subscribe["mqtt_topic"] =
+          Option (OptionRequired, "",
+                  "\"(.*)\"");
+
+  subscribe["internal_topic"] =
+          Option (OptionRequired, "",
+                  "\"(.*)\"");
+
+  subscribe["qos"] =
+          Option (OptionRequired, "",
+                  "(0|1|2)", OptionInt);
+
+  while (file.nextLine (line))
+    {
+      if (openDHANA__config__process_this_line (line))
+        {
+          line_view command, parameters;
+
+          if (!openDHANA__config__tokenize_line (line, command, parameters))
+            {
+              openDHANA__options__invalid_missing_options (path,
+                                                           file.lineNumber ());
+              continue;
+            }
+
+          // TODO: add support for "macros" so that you can define a config tree for a specifik type of device and use that with many
+          // macro "aeon_labs_multi_sensor_configs" "power_management/on_time" "${1}:config:COMMAND_CLASS_CONFIGURATION:1:3:short"
+          // macro "aeon_labs_multi_sensor_configs" "reports/group_1_reports" "${1}:config:COMMAND_CLASS_CONFIGURATION:1:101:int"
+          // sweden/strangnas/garage/sensor/config/${aeon_labs_multi_sensor_configs, 2}
+
+          if (command == "publish")
+            {
+              line_view_vector options;
+              openDHANA__config__tokenize_parameters (parameters, options);
+
+              // Are all options provided ok?
+              if (!openDHANA__options__check (options, publish))
+                openDHANA__options__invalid_missing_options (path,
+                                                             file.lineNumber ());
+              else
+                {
+                  mqtt_pub pub;
+
+                  pub.mqtt_topic = publish["mqtt_topic"].getValue ();
+                  pub.retain = publish["retain"].getBool ();
+                  pub.qos = publish["qos"].getInt ();
+                  pub.coalesce_ms = publish["coalesce_ms"].getInt ();
+                  pub.deadband = strtod (publish["deadband"].getValue ().c_str (),
+                                         NULL);
+                  pub.min_interval_ms = publish["min_interval_ms"].getInt ();
+                  pub.only_on_change = publish["only_on_change"].getBool ();
+
+                  map->publications[publish["internal_topic"].getValue ()] =
+                          pub;
+                }
+            }
+          if (command == "subscribe")
+            {
+              line_view_vector options;
+              openDHANA__config__tokenize_parameters (parameters, options);
+
+              // Are all options provided ok?
+              if (!openDHANA__options__check (options, subscribe))
+                openDHANA__options__invalid_missing_options (path,
+                                                             file.lineNumber ());
+              else
+                {
+
+                  mqtt_sub sub;
+
+                  sub.internal_topic =
+                          subscribe["internal_topic"].getValue ();
+                  sub.qos = subscribe["qos"].getInt ();
+
+                  map->subscriptions[subscribe["mqtt_topic"].getValue ()] =
+                          sub;
+                }
+            }
+        }
+    }
+
+  if (OPTION_BOOL (config_snapshot))
+    openDHANA_mqtt__config_files__save_snapshot (path, file, *map);
+
+  openDHANA_mqtt__config_files__set_map (map);
+
+  UNLOCK (openDHANA_mqtt_map);
+}
+
+/// Compare two subscription lists.
+///
+/// A subscription whose QoS has changed is only added, subscribing again to
+/// the same topic replaces the QoS at the broker.
+///
+/// @param old_subscriptions    the current subscriptions.
+/// @param new_subscriptions    the wanted subscriptions.
+/// @param added                set to the subscriptions to subscribe to.
+/// @param removed              set to the subscriptions to unsubscribe from.
+///
+
+void
+openDHANA_mqtt__config_files__diff_subscriptions (const std::map<string, mqtt_sub>& old_subscriptions,
+                                                  const std::map<string, mqtt_sub>& new_subscriptions,
+                                                  std::map<string, mqtt_sub>& added,
+                                                  std::map<string, mqtt_sub>& removed)
+{
+  std::map<string, mqtt_sub>::const_iterator old_sub = old_subscriptions.begin ();
+  std::map<string, mqtt_sub>::const_iterator new_sub = new_subscriptions.begin ();
+
+  // Both lists are sorted on the MQTT topic, walk them side by side
+  while (old_sub != old_subscriptions.end ()
+         || new_sub != new_subscriptions.end ())
+    {
+      if (new_sub == new_subscriptions.end ()
+          || (old_sub != old_subscriptions.end ()
+              && old_sub->first < new_sub->first))
+        {
+          removed.insert (*old_sub);
+          ++old_sub;
+        }
+      else if (old_sub == old_subscriptions.end ()
+               || new_sub->first < old_sub->first)
+        {
+          added.insert (*new_sub);
+          ++new_sub;
+        }
+      else
+        {
+          if (old_sub->second.qos != new_sub->second.qos)
+            added.insert (*new_sub);
+          ++old_sub;
+          ++new_sub;
+        }
+    }
+}
+
+/// Count the differences between two publication lists.
+///
+/// @param old_publications     the publications before a reload.
+/// @param new_publications     the publications after a reload.
+/// @return                     The number of added, removed or changed
+///                             publications.
+///
+
+int
+openDHANA_mqtt__config_files__diff_publications (const std::map<string, mqtt_pub>& old_publications,
+                                                 const std::map<string, mqtt_pub>& new_publications)
+{
+  std::map<string, mqtt_pub>::const_iterator old_pub = old_publications.begin ();
+  std::map<string, mqtt_pub>::const_iterator new_pub = new_publications.begin ();
+  int changes = 0;
+
+  while (old_pub != old_publications.end ()
+         || new_pub != new_publications.end ())
+    {
+      if (new_pub == new_publications.end ()
+          || (old_pub != old_publications.end ()
+              && old_pub->first < new_pub->first))
+        {
+          changes++;
+          ++old_pub;
+        }
+      else if (old_pub == old_publications.end ()
+               || new_pub->first < old_pub->first)
+        {
+          changes++;
+          ++new_pub;
+        }
+      else
+        {
+          if (old_pub->second.mqtt_topic != new_pub->second.mqtt_topic
+              || old_pub->second.qos != new_pub->second.qos
+              || old_pub->second.retain != new_pub->second.retain)
+            changes++;
+          ++old_pub;
+          ++new_pub;
+        }
+    }
+  return changes;
+}
+
+/// MQTT configuration has changed. Reread, then unsubscribe from the removed
+/// topics and subscribe to the added or changed topics only.
+/// Called by @openDHANA__config__file_monitor.
+///
+/// @param path                 path to file.
+///
+
+void
+openDHANA_mqtt__config_files__config_changed (const string path)
+{
+  std::map<string, mqtt_sub> added;
+  std::map<string, mqtt_sub> removed;
+
+  // The old map stays valid while we hold a reference to it
+  mqtt_map_ptr old_map = openDHANA_mqtt__config_files__get_map ();
+
+  openDHANA_mqtt__config_files__read_mqttmap (path);
+
+  mqtt_map_ptr new_map = openDHANA_mqtt__config_files__get_map ();
+
+  openDHANA_mqtt__config_files__diff_subscriptions (old_map->subscriptions,
+                                                    new_map->subscriptions,
+                                                    added,
+                                                    removed);
+  int publication_changes =
+          openDHANA_mqtt__config_files__diff_publications (old_map->publications,
+                                                           new_map->publications);
+
+  char changes[80];
+  snprintf (changes, sizeof (changes),
+            "%zu subscriptions added, %zu removed, %d publications changed",
+            added.size (), removed.size (), publication_changes);
+  INFO ("mqtt/comms", "\"" + path + "\" reloaded, " + changes + ".");
+
+  if (!removed.empty ())
+    openDHANA_mqtt__communication__unsubscribe (removed);
+  if (!added.empty ())
+    openDHANA_mqtt__communication__subscribe (added);
+}
+
+/// Set up file monitoring for all the files required.
+///
+
+void
+openDHANA_mqtt__config_files__monitor ()
+{
+
+  openDHANA__config__file_monitor (OPTION_STRING (mqtt_map_file),
+                                   &openDHANA_mqtt__config_files__config_changed);
+}
+
+/// The subscriptions the broker has for this client. With a persistent
+/// session, mqtt_disable_clean_session, they are kept by the broker while
+/// disconnected, and saved to mqtt_session_file to be known after a restart.
+/// session_known is __false__ until they are known.
+///
+std::map<string, mqtt_sub> session_subscriptions;
+bool session_known = false;
+CREATE_LOCK (session);
+
+/// Read the subscriptions of the persistent session from mqtt_session_file.
+/// Each line is the QoS and the MQTT topic.
+///
+
+void
+openDHANA_mqtt__session__load ()
+{
+  const string& path = OPTION_STRING (mqtt_session_file);
+  config_file file;
+  line_view line;
+
+  if (path.empty () || access (path.c_str (), F_OK) != 0 || !file.open (path))
+    return;
+
+  LOCK (session);
+  session_subscriptions.clear ();
+  while (file.nextLine (line))
+    {
+      string text = line.str ();
+      size_t space = text.find (' ');
+      mqtt_sub sub;
+
+      if (space == string::npos || space + 1 == text.length ())
+        continue;
+      sub.qos = atoi (text.c_str ());
+      session_subscriptions[text.substr (space + 1)] = sub;
+    }
+  session_known = true;
+  UNLOCK (session);
+}
+
+/// Save the subscriptions of the persistent session to mqtt_session_file.
+/// Must be called with the session lock.
+///
+
+void
+openDHANA_mqtt__session__save ()
+{
+  const string& path = OPTION_STRING (mqtt_session_file);
+
+  if (path.empty () || !OPTION_BOOL (mqtt_disable_clean_session))
+    return;
+
+  string temporary = path + ".tmp";
+  FILE *f = fopen (temporary.c_str (), "w");
+
+  if (f == NULL)
+    {
+      WARNING ("mqtt/session", "\"" + temporary + "\", " + strerror (errno));
+      return;
+    }
+
+  for (std::map<string, mqtt_sub>::const_iterator sub =
+          session_subscriptions.begin ();
+          sub != session_subscriptions.end (); ++sub)
+    fprintf (f, "%d %s\n", sub->second.qos, sub->first.c_str ());
+
+  if (fclose (f) != 0 || rename (temporary.c_str (), path.c_str ()) != 0)
+    WARNING ("mqtt/session", "\"" + path + "\", " + strerror (errno));
+}
+
+/// Topics per SUBSCRIBE or UNSUBSCRIBE packet.
+///
+#define SUBSCRIBE_BATCH                 100
+
+/// The SUBSCRIBE packets not yet acknowledged, by message id, and when the
+/// first of them was sent.
+///
+std::map<int, subscribe_batch> subscribe_pending;
+uint64_t subscribe_started = 0;
+size_t subscribe_topics = 0;
+CREATE_LOCK (subscribe_pending);
+
+/// Send one SUBSCRIBE packet, and remember it until it is acknowledged.
+///
+/// mosquitto refuses the whole packet if one topic is invalid, so invalid
+/// topics are logged and left out. The subscriptions of the session are
+/// updated when the SUBACK says which topics were granted.
+///
+/// @param candidates           the topics.
+/// @param qos                  the QoS of all the topics.
+///
+
+void
+openDHANA_mqtt__communication__subscribe_batch (const string_vector& candidates,
+                                                int qos)
+{
+  string_vector topics;
+  std::vector<char *> names;
+  int mid;
+
+  for (string_vector::const_iterator topic = candidates.begin ();
+          topic != candidates.end (); ++topic)
+    if (mosquitto_sub_topic_check (topic->c_str ()) != MOSQ_ERR_SUCCESS)
+      WARNING ("mqtt/comms",
+               "invalid subscription \"" + *topic + "\", not subscribed.");
+    else
+      topics.push_back (*topic);
+
+  if (topics.empty ())
+    return;
+
+  for (string_vector::const_iterator topic = topics.begin ();
+          topic != topics.end (); ++topic)
+    names.push_back ((char *) topic->c_str ());
+
+  // Hold the lock, the SUBACK may come before the message id is remembered
+  LOCK (subscribe_pending);
+
+  int result = mosquitto_subscribe_multiple (mosq, &mid, names.size (),
+                                             &names[0], qos, 0, NULL);
+
+  if (result == MOSQ_ERR_SUCCESS)
+    {
+      if (subscribe_pending.empty ())
+        {
+          subscribe_started = openDHANA_mqtt__publish_queue__now ();
+          subscribe_topics = 0;
+        }
+      subscribe_pending[mid].topics = topics;
+      subscribe_pending[mid].qos = qos;
+      subscribe_topics += topics.size ();
+    }
+
+  UNLOCK (subscribe_pending);
+
+  if (result != MOSQ_ERR_SUCCESS)
+    WARNING ("mqtt/comms", "subscribe of " + std::to_string (topics.size ())
+             + " topics failed, " + mosquitto_strerror (result) + ".");
+}
+
+/// Subscribe to the topics in a list
+///
+/// The topics are grouped by QoS and sent SUBSCRIBE_BATCH to a packet. The
+/// SUBACKs are handled by openDHANA_mqtt__communication__subscribe_callback.
+///
+/// @param mqtt_subscriptions   the list with subscriptions.
+///
+
+void
+openDHANA_mqtt__communication__subscribe (const std::map<string, mqtt_sub>& mqtt_subscriptions)
+{
+  string_vector batches[3];
+
+  INFO ("mqtt/comms", "subscribing to topics.");
+
+  for (std::map<string, mqtt_sub>::const_iterator mqtt_subscription =
+          mqtt_subscriptions.begin ();
+          mqtt_subscription != mqtt_subscriptions.end ();
+          ++mqtt_subscription)
+    {
+      //TODO:addsupport for secondary
+
+      int qos = mqtt_subscription->second.qos;
+      string_vector& batch = batches[qos];
+
+      batch.push_back (mqtt_subscription->first);
+      INFO ("mqtt/comms", "subscribe \"" + mqtt_subscription->first + "\".");
+
+      if (batch.size () == SUBSCRIBE_BATCH)
+        {
+          openDHANA_mqtt__communication__subscribe_batch (batch, qos);
+          batch.clear ();
+        }
+    }
+
+  for (int qos = 0; qos != 3; qos++)
+    if (!batches[qos].empty ())
+      openDHANA_mqtt__communication__subscribe_batch (batches[qos], qos);
+
+  INFO ("mqtt/comms", "all topics subscribed.");
+}
+
+/// Send one UNSUBSCRIBE packet.
+///
+/// @param topics               the topics.
+///
+
+void
+openDHANA_mqtt__communication__unsubscribe_batch (const string_vector& topics)
+{
+  std::vector<char *> names;
+
+  for (string_vector::const_iterator topic = topics.begin ();
+          topic != topics.end (); ++topic)
+    names.push_back ((char *) topic->c_str ());
+
+  int result = mosquitto_unsubscribe_multiple (mosq, NULL, names.size (),
+                                               &names[0], NULL);
+
+  if (result != MOSQ_ERR_SUCCESS)
+    {
+      WARNING ("mqtt/comms", "unsubscribe of "
+               + std::to_string (topics.size ()) + " topics failed, "
+               + mosquitto_strerror (result) + ".");
+      return;
+    }
+
+  LOCK (session);
+  for (string_vector::const_iterator topic = topics.begin ();
+          topic != topics.end (); ++topic)
+    session_subscriptions.erase (*topic);
+  UNLOCK (session);
+}
+
+/// Unsubscribe to the topics in a list
+///
+/// The topics are sent SUBSCRIBE_BATCH to a packet.
+///
+/// @param mqtt_subscriptions   the list with subscriptions.
+///
+
+void
+openDHANA_mqtt__communication__unsubscribe (const std::map<string, mqtt_sub>& mqtt_subscriptions)
+{
+  string_vector batch;
+
+  INFO ("mqtt/comms", "unsubscribing to topics.");
+
+  for (std::map<string, mqtt_sub>::const_iterator mqtt_subscription =
+          mqtt_subscriptions.begin ();
+          mqtt_subscription != mqtt_subscriptions.end ();
+          ++mqtt_subscription)
+    {
+      //TODO:addsupport for secondary
+
+      batch.push_back (mqtt_subscription->first);
+      INFO ("mqtt/comms", "unsubscribe \"" + mqtt_subscription->first + "\".");
+
+      if (batch.size () == SUBSCRIBE_BATCH)
+        {
+          openDHANA_mqtt__communication__unsubscribe_batch (batch);
+          batch.clear ();
+        }
+    }
+
+  if (!batch.empty ())
+    openDHANA_mqtt__communication__unsubscribe_batch (batch);
+
+  LOCK (session);
+  openDHANA_mqtt__session__save ();
+  UNLOCK (session);
+
+  INFO ("mqtt/comms", "all topics unsubscribed.");
+}
+
+
+/// How long a producer waits for room in a full queue with
+/// mqtt_publish_overflow=block, before the message is dropped. The producer
+/// may be the mosquitto thread, which must get back to its loop.
+///
+#define PUBLISH_QUEUE_BLOCK_MS          1000
+
+/// How long the publisher thread waits for a connection to the broker before
+/// it tries again.
+///
+#define PUBLISH_QUEUE_RETRY_MS          1000
+
+/// The outbound messages, sent to the broker by the publisher thread so that
+/// producers never wait for the network. The messages are numbered from the
+/// start, publish_queue_first is the number of the first one, so that the
+/// queued message of a topic can be found for mqtt_publish_overflow=coalesce.
+///
+std::deque<publish_message> publish_queue;
+std::unordered_map<topic_id, unsigned long> publish_queue_topics;
+unsigned long publish_queue_first = 0;
+publish_queue_stats publish_queue_counters;
+CREATE_LOCK (publish_queue);
+
+/// Values of publications with coalesce_ms, waiting for the end of their
+/// window, and values waiting for the end of min_interval_ms. publish_held_due
+/// orders the topics on the end of the wait, in ms of CLOCK_MONOTONIC.
+///
+std::unordered_map<topic_id, string> publish_held;
+std::multimap<uint64_t, topic_id> publish_held_due;
+
+/// The last values sent, per topic, for the filters of the publications.
+///
+std::unordered_map<topic_id, publish_filter_state> publish_filter_states;
+unsigned long publish_filter_count = 0;
+CREATE_LOCK (publish_filter);
+
+/// Signalled when there is a message, on connect and on stop.
+///
+pthread_cond_t publish_queue_cond;
+
+/// Signalled when a message has been taken from the queue.
+///
+pthread_cond_t publish_queue_space_cond;
+
+pthread_once_t publish_queue_once = PTHREAD_ONCE_INIT;
+pthread_t publish_queue_thread;
+bool publish_queue_running = false;
+bool publish_queue_stopping = false;
+bool publish_queue_connected = true;
+
+/// Get a CLOCK_MONOTONIC time a number of milliseconds from now.
+///
+/// @param ms                   the milliseconds.
+/// @param deadline             gets the time.
+///
+
+void
+openDHANA_mqtt__publish_queue__deadline (long ms, struct timespec& deadline)
+{
+  clock_gettime (CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += ms / 1000;
+  deadline.tv_nsec += (ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+}
+
+/// Get the CLOCK_MONOTONIC time in milliseconds.
+///
+/// @return                     the time.
+///
+
+uint64_t
+openDHANA_mqtt__publish_queue__now ()
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/// Set up the condition variables, once.
+///
+
+void
+openDHANA_mqtt__publish_queue__init ()
+{
+  pthread_condattr_t attr;
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&publish_queue_cond, &attr);
+  pthread_cond_init (&publish_queue_space_cond, &attr);
+  pthread_condattr_destroy (&attr);
+
+  memset (&publish_queue_counters, 0, sizeof (publish_queue_counters));
+}
+
+/// Take the first message from the queue. Must be called with the
+/// publish_queue lock.
+///
+/// @param message              gets the message.
+///
+
+void
+openDHANA_mqtt__publish_queue__pop (publish_message& message)
+{
+  publish_message& first = publish_queue.front ();
+
+  std::unordered_map<topic_id, unsigned long>::iterator queued =
+          publish_queue_topics.find (first.topic);
+  if (queued != publish_queue_topics.end ()
+      && queued->second == publish_queue_first)
+    publish_queue_topics.erase (queued);
+
+  message.topic = first.topic;
+  message.value.swap (first.value);
+  message.superseded = first.superseded;
+  publish_queue.pop_front ();
+  publish_queue_first++;
+  publish_queue_counters.depth = publish_queue.size ();
+}
+
+/// Put a message in the publish queue. When the queue is full,
+/// mqtt_publish_overflow decides what happens:
+///
+/// - block waits for room, at most PUBLISH_QUEUE_BLOCK_MS, and then drops the
+///   message.
+/// - drop_oldest drops the first message in the queue.
+/// - drop_newest drops the message.
+/// - coalesce replaces the value of a message for the same topic that is
+///   still in the queue, and otherwise drops the message.
+///
+/// With coalesce, a message for a topic that is still in a queue that isn't
+/// full is put last, and the one in the queue is skipped, so the messages are
+/// sent in the order they came.
+///
+/// @param topic                the id of the internal topic.
+/// @param value                the value.
+///
+
+void
+openDHANA_mqtt__publish_queue__push (topic_id topic, const string& value)
+{
+  size_t capacity = OPTION_INT (mqtt_publish_queue_size);
+  PublishOverflow overflow = (PublishOverflow) OPTION_ENUM (mqtt_publish_overflow);
+  const char *dropped = NULL;
+
+  if (capacity == 0)
+    capacity = 1;
+
+  pthread_once (&publish_queue_once, openDHANA_mqtt__publish_queue__init);
+
+  LOCK (publish_queue);
+
+  if (overflow == PublishCoalesce)
+    {
+      std::unordered_map<topic_id, unsigned long>::const_iterator queued =
+              publish_queue_topics.find (topic);
+      if (queued != publish_queue_topics.end ())
+        {
+          publish_message& old =
+                  publish_queue[queued->second - publish_queue_first];
+
+          publish_queue_counters.coalesced++;
+          if (publish_queue.size () >= capacity)
+            {
+              old.value = value;
+              UNLOCK (publish_queue);
+              return;
+            }
+          old.superseded = true;
+          old.value.clear ();
+        }
+    }
+
+  if (publish_queue.size () >= capacity && overflow == PublishBlock)
+    {
+      struct timespec deadline;
+
+      openDHANA_mqtt__publish_queue__deadline (PUBLISH_QUEUE_BLOCK_MS,
+                                               deadline);
+      while (publish_queue.size () >= capacity)
+        if (pthread_cond_timedwait (&publish_queue_space_cond,
+                                    &publish_queue_mutex,
+                                    &deadline) == ETIMEDOUT)
+          break;
+    }
+
+  if (publish_queue.size () >= capacity)
+    {
+      publish_queue_counters.dropped++;
+
+      if (overflow == PublishDropOldest)
+        {
+          publish_message oldest;
+
+          openDHANA_mqtt__publish_queue__pop (oldest);
+          dropped = "publish queue full, oldest message dropped.";
+        }
+      else
+        {
+          UNLOCK (publish_queue);
+          WARNING ("mqtt/comms", "publish queue full, message dropped.");
+          return;
+        }
+    }
+
+  publish_queue.push_back (publish_message ());
+  publish_queue.back ().topic = topic;
+  publish_queue.back ().value = value;
+  if (overflow == PublishCoalesce)
+    publish_queue_topics[topic] = publish_queue_first + publish_queue.size () - 1;
+
+  publish_queue_counters.depth = publish_queue.size ();
+  if (publish_queue_counters.depth > publish_queue_counters.high_water)
+    publish_queue_counters.high_water = publish_queue_counters.depth;
+
+  pthread_cond_signal (&publish_queue_cond);
+  UNLOCK (publish_queue);
+
+  if (dropped != NULL)
+    WARNING ("mqtt/comms", dropped);
+}
+
+/// The spool file for QoS 1 and 2 publishes made while no broker is connected,
+/// replayed in order on connect. Only used by the publisher thread.
+///
+FILE *publish_spool = NULL;
+size_t publish_spool_records = 0;
+
+/// Close the spool file.
+///
+
+void
+openDHANA_mqtt__spool__close ()
+{
+  if (publish_spool != NULL)
+    fclose (publish_spool);
+  publish_spool = NULL;
+}
+
+/// Open the spool file, mqtt_spool_file, and count the messages left in it
+/// from before. A partly written message at the end is cut off.
+///
+
+void
+openDHANA_mqtt__spool__open ()
+{
+  const string& path = OPTION_STRING (mqtt_spool_file);
+  spool_record record;
+  struct stat info;
+  long good = 0;
+
+  // Nothing to replay unless the file is opened and read
+  publish_spool_records = 0;
+  if (path.empty ())
+    return;
+
+  publish_spool = fopen (path.c_str (), "a+b");
+  if (publish_spool == NULL || fstat (fileno (publish_spool), &info) != 0)
+    {
+      ERROR ("mqtt/spool", "\"" + path + "\", " + strerror (errno));
+      openDHANA_mqtt__spool__close ();
+      return;
+    }
+
+  rewind (publish_spool);
+  while (fread (&record, sizeof (record), 1, publish_spool) == 1)
+    {
+      long end = ftell (publish_spool) + record.topic_length
+              + record.payload_length;
+
+      if (end > info.st_size || fseek (publish_spool, end, SEEK_SET) != 0)
+        break;
+      good = end;
+      publish_spool_records++;
+    }
+
+  if (ftruncate (fileno (publish_spool), good) != 0)
+    WARNING ("mqtt/spool", "\"" + path + "\", " + strerror (errno));
+  fseek (publish_spool, 0, SEEK_END);
+
+  if (publish_spool_records > 0)
+    INFO ("mqtt/spool", "\"" + path + "\" has "
+          + std::to_string (publish_spool_records) + " messages to send.");
+}
+
+/// Add a message to the end of the spool file. When the file has
+/// mqtt_spool_size messages the message is dropped.
+///
+/// @param pub                  the publication.
+/// @param value                the value.
+/// @return                     __true__ if the message was spooled,
+///                             __false__ if it was dropped.
+///
+
+bool
+openDHANA_mqtt__spool__append (const mqtt_pub& pub, const string& value)
+{
+  spool_record record;
+
+  if (publish_spool_records >= (size_t) OPTION_INT (mqtt_spool_size))
+    {
+      WARNING ("mqtt/spool", "spool full, message dropped.");
+      return false;
+    }
+
+  record.topic_length = pub.mqtt_topic.length ();
+  record.payload_length = value.length ();
+  record.qos = pub.qos;
+  record.retain = pub.retain;
+  record.reserved = 0;
+
+  if (fwrite (&record, sizeof (record), 1, publish_spool) != 1
+      || fwrite (pub.mqtt_topic.data (), 1, record.topic_length,
+                 publish_spool) != record.topic_length
+      || fwrite (value.data (), 1, record.payload_length,
+                 publish_spool) != record.payload_length
+      || fflush (publish_spool) != 0)
+    {
+      WARNING ("mqtt/spool", "\"" + OPTION_STRING (mqtt_spool_file) + "\", "
+               + strerror (errno) + ", message dropped.");
+      return false;
+    }
+
+  publish_spool_records++;
+  return true;
+}
+
+/// Send the messages in the spool file to the broker, in order. If the
+/// connection is lost on the way, the messages not sent are kept. A message
+/// that mosquitto refuses for other reasons, it would never be sent, is
+/// dropped with a warning.
+///
+/// @return                     the number of messages sent.
+///
+
+size_t
+openDHANA_mqtt__spool__replay ()
+{
+  const string& path = OPTION_STRING (mqtt_spool_file);
+  spool_record record;
+  string topic;
+  string payload;
+  size_t sent = 0;
+  long unsent = -1; /// Offset of the first message to keep, -1 for none
+
+  if (publish_spool == NULL)
+    return 0;
+
+  rewind (publish_spool);
+  for (;;)
+    {
+      long start = ftell (publish_spool);
+
+      if (fread (&record, sizeof (record), 1, publish_spool) != 1)
+        break;
+
+      topic.resize (record.topic_length);
+      payload.resize (record.payload_length);
+      if ((record.topic_length
+           && fread (&topic[0], 1, record.topic_length,
+                     publish_spool) != record.topic_length)
+          || (record.payload_length
+              && fread (&payload[0], 1, record.payload_length,
+                        publish_spool) != record.payload_length))
+        {
+          unsent = start;
+          break;
+        }
+
+      int result = MOSQ_ERR_NO_CONN;
+
+      if (broker_connected)
+        result = mosquitto_publish (mosq, NULL, topic.c_str (),
+                                    payload.length (), payload.data (),
+                                    record.qos, record.retain);
+
+      if (result == MOSQ_ERR_SUCCESS)
+        {
+          openDHANA_mqtt__broker__wake ();
+          sent++;
+        }
+      else if (result == MOSQ_ERR_NO_CONN || result == MOSQ_ERR_CONN_LOST
+               || result == MOSQ_ERR_NOMEM || result == MOSQ_ERR_ERRNO)
+        {
+          // Keep this and the following messages
+          unsent = start;
+          break;
+        }
+      else
+        WARNING ("mqtt/spool", "publish to \"" + topic + "\" refused, "
+                 + mosquitto_strerror (result) + ", message dropped.");
+    }
+
+  if (unsent > 0)
+    {
+      // Move the messages not sent to the start of a new spool file
+      string rest_path = path + ".tmp";
+      FILE *rest = fopen (rest_path.c_str (), "wb");
+      char buffer[8192];
+      size_t got;
+
+      fseek (publish_spool, unsent, SEEK_SET);
+      while (rest != NULL
+             && (got = fread (buffer, 1, sizeof (buffer), publish_spool)) > 0)
+        fwrite (buffer, 1, got, rest);
+
+      if (rest == NULL || fclose (rest) != 0
+          || rename (rest_path.c_str (), path.c_str ()) != 0)
+        {
+          // Sent messages may be sent again, QoS 1 allows that
+          WARNING ("mqtt/spool", "\"" + rest_path + "\", " + strerror (errno));
+          sent = 0;
+        }
+      else
+        {
+          openDHANA_mqtt__spool__close ();
+          openDHANA_mqtt__spool__open ();
+        }
+    }
+  else if (unsent == -1)
+    {
+      if (ftruncate (fileno (publish_spool), 0) != 0)
+        WARNING ("mqtt/spool", "\"" + path + "\", " + strerror (errno));
+      publish_spool_records = 0;
+    }
+
+  if (publish_spool != NULL)
+    fseek (publish_spool, 0, SEEK_END);
+
+  if (sent > 0)
+    INFO ("mqtt/spool", "sent " + std::to_string (sent)
+          + " spooled messages.");
+  return sent;
+}
+
+/// Hold a value until the end of the coalesce window of its topic, or of its
+/// min_interval_ms. A value arriving within the window replaces the held one,
+/// and the last value is sent when the window ends.
+///
+/// @param topic                the id of the internal topic.
+/// @param value                the value.
+/// @param window_ms            the window.
+/// @param replace              __true__ to replace a value of the topic that
+///                             is already held, __false__ to keep it, it
+///                             arrived after this one.
+///
+
+void
+openDHANA_mqtt__publish_queue__hold (topic_id topic, const string& value,
+                                     long window_ms, bool replace)
+{
+  pthread_once (&publish_queue_once, openDHANA_mqtt__publish_queue__init);
+
+  LOCK (publish_queue);
+
+  std::unordered_map<topic_id, string>::iterator held =
+          publish_held.find (topic);
+
+  if (held != publish_held.end ())
+    {
+      if (replace)
+        held->second = value;
+      publish_queue_counters.coalesced++;
+    }
+  else
+    {
+      uint64_t due = openDHANA_mqtt__publish_queue__now () + window_ms;
+
+      publish_held[topic] = value;
+      publish_held_due.insert (std::make_pair (due, topic));
+      publish_queue_counters.held = publish_held.size ();
+
+      // The publisher thread may sleep past the new window
+      if (publish_held_due.begin ()->first == due)
+        pthread_cond_signal (&publish_queue_cond);
+    }
+
+  UNLOCK (publish_queue);
+}
+
+/// Wait for the next message to send, a held value whose window has ended or
+/// else the first message in the queue. When stopping, held values are sent
+/// at once. Must be called with the publish_queue lock.
+///
+/// When there are spooled messages and the broker is connected again, they
+/// are sent first, the message then gets the topic TOPIC_NONE.
+///
+/// @param message              gets the message.
+/// @return                     __true__ if there is a message, __false__ when
+///                             stopping and there is nothing more to send.
 ///
 
 bool
-openDHANA__config__process_this_line (const string& line)
+openDHANA_mqtt__publish_queue__next (publish_message& message)
 {
-  if (openDHANA__generic__reg_ex_match ("^#.*$", line))
-    return false; // a comment line, do not process
-  if (openDHANA__generic__reg_ex_match ("^;.*$", line))
-    return false; // a comment line, do not process
-  if (openDHANA__generic__reg_ex_match ("^//.*$", line))
-    return false; // a comment line, do not process
-  if (openDHANA__generic__reg_ex_match ("^\\s*$", line))
-    return false; // an empty line, do not process
+  for (;;)
+    {
+      if (publish_spool_records > 0 && broker_connected
+          && publish_queue_connected)
+        {
+          message.topic = TOPIC_NONE;
+          return true;
+        }
 
-  return true;
+      if (!publish_held_due.empty ()
+          && (publish_queue_stopping
+              || publish_held_due.begin ()->first
+              <= openDHANA_mqtt__publish_queue__now ()))
+        {
+          std::unordered_map<topic_id, string>::iterator held =
+                  publish_held.find (publish_held_due.begin ()->second);
+
+          message.topic = held->first;
+          message.value.swap (held->second);
+          publish_held.erase (held);
+          publish_held_due.erase (publish_held_due.begin ());
+          publish_queue_counters.held = publish_held.size ();
+          return true;
+        }
+
+      if (!publish_queue.empty ())
+        {
+          openDHANA_mqtt__publish_queue__pop (message);
+          pthread_cond_signal (&publish_queue_space_cond);
+          if (message.superseded)
+            continue;
+          return true;
+        }
+
+      if (publish_queue_stopping)
+        return false;
+
+      // Let go of a reloaded map before sleeping, it is freed outside the
+      // lock if this is the last reference
+      if (openDHANA_mqtt__config_files__map_stale ())
+        {
+          UNLOCK (publish_queue);
+          openDHANA_mqtt__config_files__refresh_map ();
+          LOCK (publish_queue);
+          continue;
+        }
+
+      if (publish_held_due.empty ())
+        pthread_cond_wait (&publish_queue_cond, &publish_queue_mutex);
+      else
+        {
+          struct timespec deadline;
+          uint64_t due = publish_held_due.begin ()->first;
+
+          deadline.tv_sec = due / 1000;
+          deadline.tv_nsec = (due % 1000) * 1000000L;
+          pthread_cond_timedwait (&publish_queue_cond, &publish_queue_mutex,
+                                  &deadline);
+        }
+    }
 }
 
-/// Split a configuration file line into the command and the options part
-///
-/// Example line:
-/// multilevel_lamp screen="housemap" display_value="sub_lamp4_get" ...
-///
-/// @param line                 one line from a configuration file. Empty lines
-///                             and lines with comments must not be passed to
-///                             this function.
-/// @returns                    A string vector with the first element
-///                             containing the command and the second element
-///                             all the parameters.
+/// Wait for the broker to connect, or PUBLISH_QUEUE_RETRY_MS. Must be called
+/// with the publish_queue lock.
 ///
 
-string_vector
-openDHANA__config__split_line (const string& line)
+void
+openDHANA_mqtt__publish_queue__wait_connected ()
 {
-  return openDHANA__generic__reg_ex_match_groups (2,
-                                                  "^\\s*(\\w+)\\s+(.*)$",
-                                                  line);
+  struct timespec deadline;
+
+  publish_queue_connected = false;
+  openDHANA_mqtt__publish_queue__deadline (PUBLISH_QUEUE_RETRY_MS, deadline);
+  while (!publish_queue_connected && !publish_queue_stopping)
+    if (pthread_cond_timedwait (&publish_queue_cond, &publish_queue_mutex,
+                                &deadline) == ETIMEDOUT)
+      break;
 }
 
-/// Split a string with options into a vector of options
-///
-/// Example string:
-/// screen="housemap" display_value="sub_lamp4_get" ...
-///
-/// These versions of options are allowed:
-/// - key="string"
-/// - key='string'
-/// - key=letters_or_underscores
-/// - key=12345 (positive integers)
-/// - key=-12345 (negative integers)
-/// - key=0.12345 (postove decimal numbers)
-/// - key=-0.12345 (negative decimal numbers)
+/// Publisher thread. Sends the messages in the queue to the broker, in order.
 ///
-/// @param all_options          the string with options.
-///                             @see openDHANA__config__split_line
-/// @returns			A vector with the first element containing the
-///                             command and the second element all
-///                             the parameters.
+/// Without a connection, and with a spool file, QoS 1 and 2 messages are
+/// spooled and QoS 0 messages are dropped. Without a spool file the message
+/// is put back first in the queue and the thread waits for the connect, or
+/// PUBLISH_QUEUE_RETRY_MS. When stopping, the queue and the held values are
+/// sent first, messages that can't be sent or spooled are counted as failed.
 ///
 
-string_vector
-openDHANA__config__split_parameters (const string& all_options)
+void *
+openDHANA_mqtt__publish_queue__thread (void *param)
 {
-  return openDHANA__generic__reg_ex_match_groups_loop ("\\s*\\w+\\s*=\\s*(-?[0-9]*\\.[0-9]+|-?[0-9]+|\\w+|\"[^\"]*\"|'[^']*')\\s*",
-                                                       all_options);
-}
+  openDHANA_mqtt__spool__open ();
 
+  LOCK (publish_queue);
 
-#endif // openDHANA__config__
+  for (;;)
+    {
+      publish_message message;
 
-//=============================================================================
-// openDHANA__option__
-//=============================================================================
-#ifndef openDHANA__option__
+      if (!openDHANA_mqtt__publish_queue__next (message))
+        break;
+      bool stopping = publish_queue_stopping;
+      UNLOCK (publish_queue);
+
+      if (message.topic == TOPIC_NONE)
+        {
+          size_t replayed = openDHANA_mqtt__spool__replay ();
 
-std::map<string, Option> openDHANA_option_store;
+          LOCK (publish_queue);
+          publish_queue_counters.replayed += replayed;
+          if (publish_spool_records > 0)
+            openDHANA_mqtt__publish_queue__wait_connected ();
+          continue;
+        }
 
-Option::Option (void) { }
+      const mqtt_pub *pub =
+              openDHANA_mqtt__config_files__current_map ()->publication (message.topic);
 
-Option::Option (const bool required, const string& default_value,
-                const string& reg_ex)
-{
-  _reg_ex = reg_ex;
-  _default_value = default_value;
-  _required = required;
-}
+      long wait_ms = 0;
 
-void
-Option::setValue (const string& value)
-{
-  _value = value;
-}
+      if (pub != NULL && !openDHANA_mqtt__publish_filter__pass (*pub,
+                                                                message.value,
+                                                                wait_ms)
+          && (wait_ms == 0 || !stopping))
+        {
+          // Too soon after the last value, hold it for the rest of the
+          // interval, a newer value replaces it. A value held for
+          // coalesce_ms while this one was checked is newer
+          if (wait_ms > 0)
+            openDHANA_mqtt__publish_queue__hold (message.topic, message.value,
+                                                 wait_ms,
+                                                 pub->coalesce_ms <= 0);
+          LOCK (publish_queue);
+          continue;
+        }
 
-string
-Option::getRegEx ()
-{
-  return _reg_ex;
-}
+      int result = MOSQ_ERR_SUCCESS;
+      bool spooled = false;
+
+      if (pub == NULL)
+        // Removed by a reload while it was queued
+        WARNING ("mqtt/comms",
+                 "unmapped internal_topic \""
+                 + openDHANA_mqtt__topics__name (message.topic)
+                 + "\", no publish done. check your config files.");
+      else if (!broker_connected)
+        result = MOSQ_ERR_NO_CONN;
+      else
+        {
+          result = mosquitto_publish (mosq,
+                                      NULL,
+                                      pub->mqtt_topic.c_str (),
+                                      message.value.length (),
+                                      message.value.c_str (),
+                                      pub->qos,
+                                      pub->retain);
+          openDHANA_mqtt__broker__wake ();
+        }
 
-bool
-Option::isRequired (void)
-{
-  return _required;
-}
+      if (result == MOSQ_ERR_NO_CONN && publish_spool != NULL && pub->qos > 0)
+        spooled = openDHANA_mqtt__spool__append (*pub, message.value);
+      else if (result != MOSQ_ERR_SUCCESS
+               && (result != MOSQ_ERR_NO_CONN || publish_queue_stopping
+                   || publish_spool != NULL))
+        WARNING ("mqtt/comms",
+                 "publish to \"" + pub->mqtt_topic + "\" failed, "
+                 + mosquitto_strerror (result) + ".");
 
-string
-Option::getDefaultValue (void)
-{
-  return _default_value;
+      if (pub != NULL && (spooled || result == MOSQ_ERR_SUCCESS))
+        openDHANA_mqtt__publish_filter__sent (*pub, message.value);
+
+      LOCK (publish_queue);
+
+      if (spooled)
+        publish_queue_counters.spooled++;
+      else if (result == MOSQ_ERR_NO_CONN && !publish_queue_stopping
+               && publish_spool == NULL)
+        {
+          // Put it back and wait for the connection
+          publish_queue.push_front (publish_message ());
+          publish_queue_first--;
+          publish_queue.front ().topic = message.topic;
+          publish_queue.front ().value.swap (message.value);
+          if (publish_queue_topics.find (message.topic)
+              == publish_queue_topics.end ()
+              && OPTION_ENUM (mqtt_publish_overflow) == PublishCoalesce)
+            publish_queue_topics[message.topic] = publish_queue_first;
+          publish_queue_counters.depth = publish_queue.size ();
+
+          openDHANA_mqtt__publish_queue__wait_connected ();
+        }
+      else if (result != MOSQ_ERR_SUCCESS || pub == NULL)
+        publish_queue_counters.failed++;
+      else
+        publish_queue_counters.published++;
+    }
+
+  UNLOCK (publish_queue);
+
+  openDHANA_mqtt__spool__close ();
+  return NULL;
 }
 
-string
-Option::getValue (void)
+/// Tell the publisher thread that the broker is connected.
+///
+
+void
+openDHANA_mqtt__publish_queue__connected ()
 {
-  return _value;
+  pthread_once (&publish_queue_once, openDHANA_mqtt__publish_queue__init);
+
+  LOCK (publish_queue);
+  publish_queue_connected = true;
+  pthread_cond_signal (&publish_queue_cond);
+  UNLOCK (publish_queue);
 }
 
-/// Get the value of an option
-///
-/// If the option doesn't exist, then print an error message
+/// Wake the publisher thread after a reload of the map, so it lets go of the
+/// old map while it is idle.
 ///
-/// @param option               the option we want.
-/// @return                     the options value or "**error**" if no option
-///                             was found
 
-string
-openDHANA__option__get_value (const string option)
+void
+openDHANA_mqtt__publish_queue__map_changed ()
 {
+  pthread_once (&publish_queue_once, openDHANA_mqtt__publish_queue__init);
 
-  if (openDHANA_option_store.count (option))
-    return openDHANA_option_store[option].getValue ();
-
-  ERROR ("config/option", "option \"" + option + "\" is not defined.");
-  return "**error**";
+  LOCK (publish_queue);
+  pthread_cond_signal (&publish_queue_cond);
+  UNLOCK (publish_queue);
 }
 
-/// Get the value of an option
-///
-/// If the option doesn't exist, then print an error message
+/// Start the publisher thread.
 ///
-/// @param option               the option we want.
-/// @return                     the options value or "**error**" if no option
-///                             was found
 
-string
-openDHANA__option__get_default_value (const string option)
+void
+openDHANA_mqtt__publish_queue__start ()
 {
+  pthread_once (&publish_queue_once, openDHANA_mqtt__publish_queue__init);
 
-  if (openDHANA_option_store.count (option))
-    return openDHANA_option_store[option].getDefaultValue ();
-
-  ERROR ("config/option", "option \"" + option + "\" is not defined.");
-  return "**error**";
+  publish_queue_stopping = false;
+  if (pthread_create (&publish_queue_thread, NULL,
+                      openDHANA_mqtt__publish_queue__thread, NULL) != 0)
+    {
+      ERROR ("mqtt/comms", "error creating publisher thread.");
+      return;
+    }
+  publish_queue_running = true;
 }
 
+/// Stop the publisher thread, after it has sent the queued messages, and log
+/// the counters.
+///
 
+void
+openDHANA_mqtt__publish_queue__stop ()
+{
+  if (!publish_queue_running)
+    return;
+
+  LOCK (publish_queue);
+  publish_queue_stopping = true;
+  pthread_cond_signal (&publish_queue_cond);
+  UNLOCK (publish_queue);
+
+  pthread_join (publish_queue_thread, NULL);
+  publish_queue_running = false;
+
+  publish_queue_stats stats;
+  char counters[256];
+
+  openDHANA_mqtt__publish_queue__stats (stats);
+  snprintf (counters, sizeof (counters),
+            "publish queue: %lu published, %lu dropped, %lu coalesced, "
+            "%lu failed, %lu filtered, %lu spooled, %lu replayed, "
+            "at most %zu queued.",
+            stats.published, stats.dropped, stats.coalesced, stats.failed,
+            stats.filtered, stats.spooled, stats.replayed, stats.high_water);
+  INFO ("mqtt/comms", counters);
+}
 
-/// Display a warning message about missing or invalid options.
+/// Get the counters of the publish queue.
 ///
-/// @param all_options          the string with options.
-///                             @see openDHANA__config__split_line
-/// @returns			Nothing.
+/// @param stats                gets the counters.
 ///
 
 void
-openDHANA__options__invalid_missing_options (const string file,
-                                             int line_number)
+openDHANA_mqtt__publish_queue__stats (publish_queue_stats& stats)
 {
+  pthread_once (&publish_queue_once, openDHANA_mqtt__publish_queue__init);
 
-  char line_number_str[10];
-  snprintf (line_number_str, sizeof(line_number), "%d", line_number);
+  LOCK (publish_queue);
+  stats = publish_queue_counters;
+  UNLOCK (publish_queue);
 
-  WARNING ("config/syntax",
-           "line \"" + file + ":" + line_number_str
-           + "\" invalid or missing options, ignored.");
+  LOCK (publish_filter);
+  stats.filtered = publish_filter_count;
+  UNLOCK (publish_filter);
 }
 
-/// Display a warning message about unknown commands in a config file.
+
+/// Parse a value for the deadband filter.
 ///
-/// @param all_options          the string with options.
-///                             @see openDHANA__config__split_line
-/// @returns			Nothing.
+/// @param value                the value.
+/// @param number               gets the value as a number.
+/// @return                     __true__ if the whole value is a finite
+///                             number, "nan" and "inf" are not numeric.
 ///
 
-void
-openDHANA__options__uknown_definition (const string definition)
+bool
+openDHANA_mqtt__publish_filter__number (const string& value, double& number)
 {
+  const char *text = value.c_str ();
+  char *end;
 
-  WARNING ("config/syntax",
-           "unknown definition \"" + definition + "\", ignored.");
+  number = strtod (text, &end);
+  return end != text && *end == '\0' && isfinite (number);
 }
 
-/// Read options from an .option file
+/// Check a value against the deadband, min_interval_ms and only_on_change
+/// filters of its publication, and the last value of the topic that was
+/// handed to mosquitto, @see openDHANA_mqtt__publish_filter__sent. Only the
+/// publisher thread checks, when the value is about to be sent.
 ///
-/// Comments and empty lines are ignored
+/// A deadband only compares numeric values, a value that isn't numeric passes
+/// if it differs from the last one. A value that passes them but comes within
+/// min_interval_ms of the last one isn't dropped, it is to be sent when the
+/// interval has passed, unless a newer value replaces it.
+///
+/// @param pub                  the publication.
+/// @param value                the value.
+/// @param wait_ms              set to the rest of min_interval_ms if that is
+///                             what stops the value, 0 otherwise.
+/// @return                     __true__ if the value is to be published now,
+///                             __false__ if it is filtered or must wait.
 ///
-/// @param path                 the path of the file to read.
-/// @return                     A string vector with the options. Each option
-///                             is still one string.
-//
 
-string_vector
-openDHANA__options__read_file (const string& path)
+bool
+openDHANA_mqtt__publish_filter__pass (const mqtt_pub& pub, const string& value,
+                                      long& wait_ms)
 {
-  char buffer[255];
-  string_vector options;
+  wait_ms = 0;
 
-  FILE *f = openDHANA__generic__open_file (path);
-  if (f == NULL)
-    exit (1);
+  if (pub.deadband <= 0 && pub.min_interval_ms <= 0 && !pub.only_on_change)
+    return true;
+
+  uint64_t now = openDHANA_mqtt__publish_queue__now ();
+  double number;
+  bool numeric = openDHANA_mqtt__publish_filter__number (value, number);
+  bool pass = true;
+
+  LOCK (publish_filter);
 
-  while (!feof (f))
+  std::unordered_map<topic_id, publish_filter_state>::const_iterator last =
+          publish_filter_states.find (pub.topic);
+
+  if (last != publish_filter_states.end ())
     {
-      if (fgets (buffer, sizeof (buffer), f))
-        {
-          if (openDHANA__config__process_this_line (buffer))
-            {
-              // Save the option
+      const publish_filter_state& state = last->second;
 
-              options.push_back (buffer);
-            }
+      if (pub.deadband > 0 && numeric && state.numeric)
+        pass = fabs (number - state.number) >= pub.deadband;
+      else if (pub.deadband > 0 || pub.only_on_change)
+        pass = value != state.value;
+
+      if (pass && pub.min_interval_ms > 0
+          && now - state.sent_ms < (uint64_t) pub.min_interval_ms)
+        {
+          wait_ms = pub.min_interval_ms - (now - state.sent_ms);
+          pass = false;
         }
     }
-  fclose (f);
-  return options;
+
+  if (!pass && wait_ms == 0)
+    publish_filter_count++;
+
+  UNLOCK (publish_filter);
+  return pass;
 }
 
-/// Check that the "batch" of options we have are valid.
+/// Remember a value as the last one of its topic that was handed to
+/// mosquitto, or spooled, for the filters of its publication. Called by the
+/// publisher thread.
 ///
-/// @param given_options        the list with options from files and command
-///                             line.
-/// @param defined_options      the list withe the definitions of required and
-///                             optional options.
-/// @returns			___true___ if all options are ok, __false__
-///                             otherwise.
+/// @param pub                  the publication.
+/// @param value                the value.
 ///
 
-bool
-openDHANA__options__check (const string_vector& given_options,
-                           std::map<string, Option>& defined_options)
+void
+openDHANA_mqtt__publish_filter__sent (const mqtt_pub& pub, const string& value)
 {
-  bool all_ok = true;
+  if (pub.deadband <= 0 && pub.min_interval_ms <= 0 && !pub.only_on_change)
+    return;
 
-  // Set the default values
+  LOCK (publish_filter);
 
-  for (std::map<string, Option>::const_iterator defined_option =
-          defined_options.begin (); defined_option != defined_options.end ();
-          ++defined_option)
-    {
-      Option opt = defined_option->second;
-      if (opt.getDefaultValue () != "")
-        {
-          defined_options[defined_option->first]
-                  .setValue (opt.getDefaultValue ());
-        }
-    }
+  publish_filter_state& state = publish_filter_states[pub.topic];
 
-  // Go through the given options and verify that they are valid, and get their
-  // values.
-  // An option can be present more than one one, if for example a parameter that
-  // is present in the .options file is overridden on the command line.
-  // Therefore we walk the entire given options list even if we get a match.
+  state.value = value;
+  state.numeric = openDHANA_mqtt__publish_filter__number (value, state.number);
+  state.sent_ms = openDHANA_mqtt__publish_queue__now ();
 
-  for (string_vector::const_iterator given_option = given_options.begin ();
-          given_option != given_options.end ();
-          ++given_option)
-    {
-      bool match = false;
-      for (std::map<string, Option>::const_iterator defined_option =
-              defined_options.begin ();
-              defined_option != defined_options.end ();
-              ++defined_option)
-        {
-          Option opt = defined_option->second;
-          if (openDHANA__generic__reg_ex_match (opt.getRegEx (), *given_option))
-            {
-              match = true;
-
-              // Get the value
-              string_vector kv =
-                      openDHANA__generic__reg_ex_match_groups (2,
-                                                               opt.getRegEx (),
-                                                               *given_option);
-              defined_options[defined_option->first].setValue (kv[1]);
-            }
-        }
+  UNLOCK (publish_filter);
+}
 
-      if (!match)
-        {
-          WARNING ("config/syntax", "invalid option \"" + *given_option + "\"");
-          all_ok = false;
-        }
-    }
+/// Map internal_topic to MQTT topic and queue the value for the MQTT broker.
+///
+/// The current map is used without locking, a concurrent reload does not
+/// block the publish. The value is sent by the publisher thread, the caller
+/// does not wait for the network. A publication with coalesce_ms only sends
+/// the last value within its window. The publisher thread applies the filters
+/// of the publication when it sends the value.
+///
+/// @param topic                the id of the internal topic from the module.
+/// @param value                the value.
+///
 
-  // Finally, check that all the required defined options are given
+void
+openDHANA_mqtt__communication__publish (topic_id topic,
+                                        const string& value)
+{
+  // Check if we have a publish rule for this
+  const mqtt_pub *pub =
+          openDHANA_mqtt__config_files__current_map ()->publication (topic);
+
+  if (pub != NULL && pub->coalesce_ms > 0)
+    openDHANA_mqtt__publish_queue__hold (topic, value, pub->coalesce_ms, true);
+  else if (pub != NULL)
+    openDHANA_mqtt__publish_queue__push (topic, value);
+  else
+    WARNING ("mqtt/comms",
+             "unmapped internal_topic \"" + openDHANA_mqtt__topics__name (topic)
+             + "\", no publish done. check your config files.");
+}
+
+/// Map internal_topic to MQTT topic and queue the value for the MQTT broker.
+///
+/// @see openDHANA_mqtt__communication__publish (topic_id, const string&)
+///
+/// @param internal_topic       the internal topic from the module.
+/// @param value                the value.
+///
+
+void
+openDHANA_mqtt__communication__publish (const string& internal_topic,
+                                        const string& value)
+{
+  const mqtt_pub *pub =
+          openDHANA_mqtt__config_files__current_map ()->publication (internal_topic);
+
+  if (pub != NULL && pub->coalesce_ms > 0)
+    openDHANA_mqtt__publish_queue__hold (pub->topic, value, pub->coalesce_ms,
+                                         true);
+  else if (pub != NULL)
+    openDHANA_mqtt__publish_queue__push (pub->topic, value);
+  else
+    WARNING ("mqtt/comms",
+             "unmapped internal_topic \"" + internal_topic
+             + "\", no publish done. check your config files.");
+}
+
+/// Connect callback from mosquitto.
+///
+/// When the broker resumed a persistent session and its subscriptions are
+/// known, only the changes are subscribed to. Subscribing again would make
+/// the broker send all retained messages again.
+///
+
+void
+openDHANA_mqtt__communication__connect_callback (struct mosquitto *mosq,
+                                                 void *userdata,
+                                                 int result,
+                                                 int flags)
+{
+  INFO ("mqtt/comms", "connecting to MQTT broker.");
 
-  for (std::map<string, Option>::const_iterator defined_option =
-          defined_options.begin (); defined_option != defined_options.end ();
-          ++defined_option)
+  if (!result)
     {
-      Option opt = defined_option->second;
-      if (opt.isRequired ())
+      broker_connected = true;
+      openDHANA_mqtt__broker__accepted ();
+
+      // Keep the map, a reload may replace it while we subscribe
+      mqtt_map_ptr map = openDHANA_mqtt__config_files__get_map ();
+      const std::map<string, mqtt_sub>& subscriptions = map->subscriptions;
+      std::map<string, mqtt_sub> added;
+      std::map<string, mqtt_sub> removed;
+
+      LOCK (session);
+      // Bit 0 of the CONNACK flags is "session present"
+      bool resumed = (flags & 1) && session_known;
+      if (resumed)
+        openDHANA_mqtt__config_files__diff_subscriptions (session_subscriptions,
+                                                          subscriptions,
+                                                          added,
+                                                          removed);
+      else
+        session_subscriptions.clear ();
+      session_known = true;
+      UNLOCK (session);
+
+      if (resumed)
         {
-          bool match = false;
-          for (string_vector::const_iterator given_option =
-                  given_options.begin (); given_option != given_options.end ();
-                  ++given_option)
-            {
-              if (openDHANA__generic__reg_ex_match (opt.getRegEx (),
-                                                    *given_option))
-                {
-                  match = true;
-                  break;
-                }
-            }
+          char changes[80];
 
-          if (!match)
-            {
+          snprintf (changes, sizeof (changes),
+                    "%zu subscriptions added, %zu removed",
+                    added.size (), removed.size ());
+          INFO ("mqtt/comms", string ("session resumed, ") + changes + ".");
 
-              WARNING ("config/syntax",
-                       "required option \"" + defined_option->first
-                       + "\" is missing.");
-              all_ok = false;
-            }
+          if (!removed.empty ())
+            openDHANA_mqtt__communication__unsubscribe (removed);
+          if (!added.empty ())
+            openDHANA_mqtt__communication__subscribe (added);
         }
+      else
+        // Connected, subscribe to all our topics
+        openDHANA_mqtt__communication__subscribe (subscriptions);
+
+      if (!OPTION_STRING (mqtt_log_control_topic).empty ())
+        mosquitto_subscribe (mosq, NULL,
+                             OPTION_STRING (mqtt_log_control_topic).c_str (),
+                             0);
+
+      // Send what was queued while disconnected
+      openDHANA_mqtt__publish_queue__connected ();
     }
-  return all_ok;
+  else
+    openDHANA_mqtt__broker__refused (result);
 }
 
-/// Set the generic options that are needed by all modules
+/// Disconnect callback from mosquitto. The broker thread connects again.
 ///
 
 void
-openDHANA__options__set_generic ()
+openDHANA_mqtt__communication__disconnect_callback (struct mosquitto *mosq,
+                                                    void *userdata,
+                                                    int result)
 {
+  broker_connected = false;
 
-  openDHANA_option_store["mqtt_bind_address"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_bind_address)\\s*=\\s*([0-9]+)\\s*$");
+  // The SUBACKs will not come, the subscriptions are sent again on connect
+  LOCK (subscribe_pending);
+  subscribe_pending.clear ();
+  UNLOCK (subscribe_pending);
+}
 
-  openDHANA_option_store["mqtt_disable_clean_session"] =
-          Option (OptionOptional, "false",
-                  "^\\s*(mqtt_disable_clean_session)\\s*=\\s*(true|false)\\s*$");
+/// Subscribe callback from mosquitto. The granted topics are added to the
+/// subscriptions of the session, the refused ones are logged and removed, and
+/// the session is saved.
+///
 
-  openDHANA_option_store["mqtt_cafile"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_cafile)\\s*=\\s*\"(.*)\"\\s*$");
+void
+openDHANA_mqtt__communication__subscribe_callback (struct mosquitto *mosq,
+                                                   void *userdata,
+                                                   int mid,
+                                                   int qos_count,
+                                                   const int *granted_qos)
+{
+  string_vector granted;
+  string_vector refused;
+  int qos = 0;
+  char done[80] = "";
 
-  openDHANA_option_store["mqtt_cert"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_cert)\\s*=\\s*\"(.*)\"\\s*$");
+  LOCK (subscribe_pending);
 
-  openDHANA_option_store["mqtt_ciphers"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_ciphers)\\s*=\\s*\"(.*)\"\\s*$");
+  std::map<int, subscribe_batch>::iterator batch = subscribe_pending.find (mid);
 
-  openDHANA_option_store["daemon"] =
-          Option (OptionOptional, "false",
-                  "^\\s*(daemon)\\s*=\\s*(true|false)\\s*$");
+  if (batch != subscribe_pending.end ())
+    {
+      // 0x80 is a refused topic
+      for (int i = 0; i < qos_count && i < (int) batch->second.topics.size ();
+              i++)
+        if (granted_qos[i] == 0x80)
+          refused.push_back (batch->second.topics[i]);
+        else
+          granted.push_back (batch->second.topics[i]);
+      qos = batch->second.qos;
+
+      subscribe_pending.erase (batch);
+      if (subscribe_pending.empty ())
+        snprintf (done, sizeof (done),
+                  "%zu subscriptions acknowledged in %llu ms.",
+                  subscribe_topics,
+                  (unsigned long long) (openDHANA_mqtt__publish_queue__now ()
+                                        - subscribe_started));
+    }
 
-  openDHANA_option_store["mqtt_debug"] =
-          Option (OptionOptional, "false",
-                  "^\\s*(mqtt_debug)\\s*=\\s*(true|false)\\s*$");
+  UNLOCK (subscribe_pending);
 
-  openDHANA_option_store["mqtt_host"] =
-          Option (OptionOptional, "localhost",
-                  "^\\s*(mqtt_host)\\s*=\\s*\"(.*)\"\\s*$");
+  for (string_vector::const_iterator topic = refused.begin ();
+          topic != refused.end (); ++topic)
+    WARNING ("mqtt/comms",
+             "subscription to \"" + *topic + "\" refused by the broker.");
 
-  openDHANA_option_store["mqtt_id"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_id)\\s*=\\s*\"(.*)\"\\s*$");
+  if (!granted.empty () || !refused.empty ())
+    {
+      LOCK (session);
+      // The QoS asked for, a lower granted QoS isn't subscribed to again
+      for (string_vector::const_iterator topic = granted.begin ();
+              topic != granted.end (); ++topic)
+        session_subscriptions[*topic].qos = qos;
+      for (string_vector::const_iterator topic = refused.begin ();
+              topic != refused.end (); ++topic)
+        session_subscriptions.erase (*topic);
+      openDHANA_mqtt__session__save ();
+      UNLOCK (session);
+    }
 
-  openDHANA_option_store["mqtt_id_prefix"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_id_prefix)\\s*=\\s*\"(.*)\"\\s*$");
+  if (done[0] != '\0')
+    INFO ("mqtt/comms", done);
+}
 
-  openDHANA_option_store["mqtt_insecure"] =
-          Option (OptionOptional, "false",
-                  "^\\s*(mqtt_insecure)\\s*=\\s*(true|false)\\s*$");
+/// We got a message from the broker.
+///
+/// Map the MQTT topic to an internal topic and call the module in order for it
+/// to process the message.
+///
 
-  openDHANA_option_store["mqtt_keepalive"] =
-          Option (OptionOptional, "60",
-                  "^\\s*(mqtt_keepalive)\\s*=\\s*([0-9]+)\\s*$");
+void
+openDHANA_mqtt__communication__message_callback (struct mosquitto *mosq,
+                                                 void *userdata,
+                                                 const struct mosquitto_message * message)
+{
+  // Log levels are changed at run time through the control topic
+  const string& control_topic = OPTION_STRING (mqtt_log_control_topic);
+  if (!control_topic.empty () && control_topic == message->topic)
+    {
+      openDHANA__generic__log_control (string ((char *) message->payload,
+                                               message->payloadlen));
+      return;
+    }
 
-  openDHANA_option_store["mqtt_key"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_key)\\s*=\\s*\"(.*)\"\\s*$");
+  if (message->payloadlen)
+    {
+      // Map the mqtt_topic to the internal_topic. The map is kept until the
+      // module is done, a Lua script that publishes calls current_map again
+      // and may move this thread on to a reloaded map.
+      mqtt_map_ptr map = openDHANA_mqtt__config_files__current_map ();
+      string_vector wildcards;
+      const mqtt_sub *sub =
+              map->match (line_view (message->topic, strlen (message->topic)),
+                          wildcards);
+
+      if (sub == NULL)
+        {
+          // Removed by a reload before the unsubscribe took effect
+          INFO ("mqtt/comms",
+                "unmapped MQTT topic \"" + string (message->topic) + "\"");
+          return;
+        }
 
-  openDHANA_option_store["mqtt_log_file"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_log_file)\\s*=\\s*\"(.*)\"\\s*$");
+      // Call the module with a view of the payload, it isn't NUL terminated
+      // and may be binary. What the module keeps it copies.
+      moduleMessageCallback (sub->topic,
+                             sub->internal_topic,
+                             line_view ((const char *) message->payload,
+                                        message->payloadlen),
+                             wildcards);
+    }
+  else
+    {
+      // This might be a reset of a retained message
+      // (mosquitto_pub -t <topic> -r -n)
 
-  openDHANA_option_store["mqtt_map_file"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_map_file)\\s*=\\s*\"(.*)\"\\s*$");
+      INFO ("mqtt/comms",
+            "empty MQTT message \"" + string (message->topic) + "\"");
+    }
+}
 
-  openDHANA_option_store["mqtt_port"] =
-          Option (OptionOptional, "1883",
-                  "^\\s*(mqtt_port)\\s*=\\s*([0-9]+)\\s*$");
+/// Shortest and longest wait before connecting again, after a failed round of
+/// connects to the brokers or a lost connection. The wait doubles every time,
+/// and starts over when a connection has lasted BROKER_RETRY_MAX_MS.
+///
+#define BROKER_RETRY_MIN_MS             1000
+#define BROKER_RETRY_MAX_MS             60000
 
-  openDHANA_option_store["mqtt_pw"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_pw)\\s*=\\s*\"(.*)\"\\s*$");
+/// How long a health check waits for a TCP connection to a broker.
+///
+#define BROKER_CHECK_TIMEOUT_MS         1000
 
-  openDHANA_option_store["mqtt_psk"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_psk)\\s*=\\s*\"(.*)\"\\s*$");
+/// With mqtt_event_loop=epoll, the time between the ticks that do the
+/// mosquitto housekeeping, the reconnects and the health checks, and how long
+/// the packets still queued are sent for at the disconnect.
+///
+#define BROKER_TICK_MS                  1000
+#define BROKER_FLUSH_MS                 1000
 
-  openDHANA_option_store["mqtt_psk_identity"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_psk_identity)\\s*=\\s*\"(.*)\"\\s*$");
+/// The brokers from mqtt_host, in order of preference, and the one connected
+/// to, or last tried.
+///
+std::vector<mqtt_broker> brokers;
+size_t broker_current = 0;
 
-  openDHANA_option_store["mqtt_srv_lookups"] =
-          Option (OptionOptional, "false",
-                  "^\\s*(mqtt_srv_lookups)\\s*=\\s*(true|false)\\s*$");
+/// __true__ when the socket to a broker is connected, the connection is
+/// handled by the broker thread.
+///
+bool broker_attached = false;
 
-  openDHANA_option_store["mqtt_tls_version"] =
-          Option (OptionOptional, "tlsv1.2",
-                  "^\\s*(mqtt_tls_version)\\s*=\\s*\"(.*)\"\\s*$");
+/// Signalled on stop, to end the wait between connects.
+///
+pthread_cond_t broker_cond;
+CREATE_LOCK (broker);
+pthread_t broker_thread;
+bool broker_running = false;
+std::atomic<bool> broker_stopping (false);
+
+/// With mqtt_event_loop=epoll: the socket of the connection, the epoll events
+/// it is waited for, the tick timer, and the eventfd the publisher thread
+/// wakes the reactor with when it has queued a packet.
+///
+int broker_socket = -1;
+uint32_t broker_events = 0;
+int broker_tick = -1;
+int broker_wake = -1;
 
-  openDHANA_option_store["mqtt_username"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_username)\\s*=\\s*\"(.*)\"\\s*$");
+/// With mqtt_event_loop=epoll, the state the broker thread keeps on its stack.
+///
+long broker_retry_ms = BROKER_RETRY_MIN_MS;
+uint64_t broker_next_attempt = 0;
+uint64_t broker_connected_at = 0;
+uint64_t broker_next_check = 0;
+bool broker_switching = false;
+size_t broker_next_first = 0;
+
+/// __true__ when the broker connected to has refused the connection in its
+/// CONNACK, the next one is then tried.
+///
+std::atomic<bool> broker_refused (false);
 
-  openDHANA_option_store["mqtt_wait_for_broker"] =
-          Option (OptionOptional, "false",
-                  "^\\s*(mqtt_wait_for_broker)\\s*=\\s*(true|false)\\s*$");
+/// With mqtt_event_loop=epoll, connects and health checks wait for DNS and
+/// TCP, so they are made by a worker thread and the reactor never waits. The
+/// worker wakes the reactor when it is done. It connects from
+/// broker_worker_first on, or checks broker_worker_candidates.
+///
+pthread_t broker_worker;
+std::atomic<int> broker_worker_state (BrokerWorkerIdle);
+bool broker_worker_connect = false;
+size_t broker_worker_first = 0;
+std::vector<mqtt_broker> broker_worker_candidates;
+bool broker_worker_result = false;
+
+/// Parse a list of brokers, separated by spaces or commas. A broker is
+/// "host", "host:port" or "[address]:port", without a port the default port
+/// is used.
+///
+/// @param hosts                the list.
+/// @param default_port         the default port.
+/// @param list                 gets the brokers.
+///
 
-  openDHANA_option_store["mqtt_will_payload"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_will_payload)\\s*=\\s*\"(.*)\"\\s*$");
+void
+openDHANA_mqtt__broker__parse (const string& hosts, int default_port,
+                               std::vector<mqtt_broker>& list)
+{
+  size_t start = 0;
 
-  openDHANA_option_store["mqtt_will_qos"] =
-          Option (OptionOptional, "0",
-                  "^\\s*(mqtt_will_qos)\\s*=\\s*(0|1|2)\\s*$");
+  list.clear ();
+  while ((start = hosts.find_first_not_of (" \t,", start)) != string::npos)
+    {
+      size_t end = hosts.find_first_of (" \t,", start);
+      string host = hosts.substr (start, end - start);
+      mqtt_broker broker;
+      size_t colon = host.rfind (':');
 
-  openDHANA_option_store["mqtt_will_retain"] =
-          Option (OptionOptional, "false",
-                  "^\\s*(mqtt_will_retain)\\s*=\\s*(true|false)\\s*$");
+      broker.port = default_port;
+      if (host[0] == '[' && host.find (']') != string::npos)
+        {
+          size_t bracket = host.find (']');
 
-  openDHANA_option_store["mqtt_will_topic"] =
-          Option (OptionOptional, "",
-                  "^\\s*(mqtt_will_topic)\\s*=\\s*\"(.*)\"\\s*$");
+          if (colon == bracket + 1)
+            broker.port = atoi (host.c_str () + colon + 1);
+          host = host.substr (1, bracket - 1);
+        }
+      else if (colon != string::npos && host.find (':') == colon)
+        {
+          broker.port = atoi (host.c_str () + colon + 1);
+          host.erase (colon);
+        }
+      broker.host = host;
+      list.push_back (broker);
+
+      start = end;
+    }
 }
 
-/// Set internal values based on options values
+/// Get a broker as "host:port", or "[address]:port", for log messages.
+///
+/// @param broker               the broker.
+/// @return                     the name.
 ///
 
-void
-openDHANA__options__process ()
+string
+openDHANA_mqtt__broker__name (const mqtt_broker& broker)
 {
-
-  if (OPTION (mqtt_debug) == "true")
-    dhana_mqtt_debug = true;
+  if (broker.host.find (':') != string::npos)
+    return "[" + broker.host + "]:" + std::to_string (broker.port);
+  return broker.host + ":" + std::to_string (broker.port);
 }
 
-/// Get the options from files and the command line. Also read the mqttmap.
+/// Health check of a broker, can a TCP connection be made to it within
+/// BROKER_CHECK_TIMEOUT_MS?
 ///
-/// @param option_file          the file containing the options.
-/// @param argc                 from command line.
-/// @param argv                 from command line
+/// @param broker               the broker.
+/// @return                     __true__ if the broker is reachable,
+///                             __false__ otherwise.
 ///
 
-void
-openDHANA__options__get (const string& option_file,
-                         int argc,
-                         char* argv[])
+bool
+openDHANA_mqtt__broker__reachable (const mqtt_broker& broker)
 {
-  openDHANA__options__set_generic (); // Add MQTT options
-
-  string_vector options = openDHANA__options__read_file (option_file);
-
-  // Read the command line and get its parameters, they will override the same
-  // parameter from the file
+  struct addrinfo hints;
+  struct addrinfo *addresses;
+  bool reachable = false;
 
-  for (int i = 1; i != argc; i++)
-    options.push_back (argv[i]);
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
 
+  if (getaddrinfo (broker.host.c_str (), std::to_string (broker.port).c_str (),
+                   &hints, &addresses) != 0)
+    return false;
 
-  if (!openDHANA__options__check (options, openDHANA_option_store))
+  for (struct addrinfo *address = addresses;
+          address != NULL && !reachable; address = address->ai_next)
     {
+      int s = socket (address->ai_family,
+                      address->ai_socktype | SOCK_NONBLOCK,
+                      address->ai_protocol);
 
-      ERROR ("config/syntax",
-             "invalid or missing options was encountered, exiting.");
-      exit (1);
+      if (s < 0)
+        continue;
+
+      if (connect (s, address->ai_addr, address->ai_addrlen) == 0)
+        reachable = true;
+      else if (errno == EINPROGRESS)
+        {
+          struct pollfd fd;
+          int error = 0;
+          socklen_t length = sizeof (error);
+
+          fd.fd = s;
+          fd.events = POLLOUT;
+          reachable = poll (&fd, 1, BROKER_CHECK_TIMEOUT_MS) == 1
+                  && getsockopt (s, SOL_SOCKET, SO_ERROR, &error, &length) == 0
+                  && error == 0;
+        }
+      close (s);
     }
 
-  //  for (std::map<string, Option>::const_iterator it =
-  //      openDHANA_option_store.begin (); it != openDHANA_option_store.end ();
-  //      ++it)
-  //    {
-  //      Option o = it->second;
-  //      printf ("%s---%s\n", it->first.c_str (), o.getValue ().c_str ());
-  //    }
+  freeaddrinfo (addresses);
+  return reachable;
+}
 
-  // Set internal options based on options
-  openDHANA__options__process ();
+/// Connect to the first broker, in order of preference, that accepts the
+/// connection. Whether the broker accepts the session is only known from its
+/// CONNACK, @see openDHANA_mqtt__broker__refused.
+///
+/// @param first                the index of the first broker to try.
+/// @return                     __true__ if connected, __false__ if no broker
+///                             could be connected to.
+///
 
-  openDHANA_mqtt__config_files__read_mqttmap (OPTION (mqtt_map_file));
-}
+bool
+openDHANA_mqtt__broker__connect_from (size_t first)
+{
+  for (size_t i = first; i < brokers.size (); i++)
+    {
+      int result = mosquitto_connect (mosq, brokers[i].host.c_str (),
+                                      brokers[i].port,
+                                      OPTION_INT (mqtt_keepalive));
 
-#endif // openDHANA__option__
+      if (result == MOSQ_ERR_SUCCESS)
+        {
+          broker_current = i;
+          INFO ("mqtt/comms", "connected to \""
+                + openDHANA_mqtt__broker__name (brokers[i]) + "\".");
+          return true;
+        }
 
-static std::map<int, string> valueGenre;
+      WARNING ("mqtt/comms",
+               "unable to connect to \""
+               + openDHANA_mqtt__broker__name (brokers[i])
+               + "\" with keepalive \"" + OPTION_STRING (mqtt_keepalive)
+               + "\", "
+               + (result == MOSQ_ERR_ERRNO ?
+                  strerror (errno) : mosquitto_strerror (result)) + ".");
+    }
 
-struct mosquitto *mosq = NULL;
+  return false;
+}
 
-// TODO: Remove these
+/// Wait before connecting again.
+///
+/// @param ms                   how long to wait.
+/// @return                     __false__ if stopping, __true__ otherwise.
+///
 
-void
-setDoubleList (std::map<int, string> &forward,
-               std::map<string, int> &reverse, int key, string value)
+bool
+openDHANA_mqtt__broker__wait (long ms)
 {
+  struct timespec deadline;
 
-  forward[key] = value;
-  reverse[value] = key;
+  openDHANA_mqtt__publish_queue__deadline (ms, deadline);
+
+  LOCK (broker);
+  while (!broker_stopping)
+    if (pthread_cond_timedwait (&broker_cond, &broker_mutex,
+                                &deadline) == ETIMEDOUT)
+      break;
+  UNLOCK (broker);
+
+  return !broker_stopping;
 }
 
+/// The broker connected to has accepted the connection in its CONNACK.
+///
+
 void
-setDoubleList (string_map &forward,
-               string_map &reverse, string key,
-               string value)
+openDHANA_mqtt__broker__accepted ()
 {
-
-  forward[key] = value;
-  reverse[value] = key;
+  brokers[broker_current].refused = false;
 }
 
+/// The broker connected to has refused the connection in its CONNACK, bad
+/// credentials or client id. mosquitto then ends the connection, and the next
+/// broker is tried.
+///
+/// @param result               the CONNACK return code.
+///
 
-//=============================================================================
-// openDHANA_mqtt__
-//=============================================================================
-#ifndef openDHANA_mqtt__
+void
+openDHANA_mqtt__broker__refused (int result)
+{
+  ERROR ("mqtt/comms", "connection refused by \""
+         + openDHANA_mqtt__broker__name (brokers[broker_current])
+         + "\", return code " + std::to_string (result) + ".");
 
-CREATE_LOCK (openDHANA_mqtt_publications);
+  brokers[broker_current].refused = true;
+  broker_refused = true;
+}
 
-/// Read a .mqttmap file
+/// Get the brokers before the connected one in mqtt_host, that a health check
+/// is to find up again. A broker that refused the connection is left out, a
+/// TCP connection doesn't tell if it would accept it now.
 ///
-/// @param path                 the path to the file.
+/// @param candidates           gets the brokers.
 ///
 
 void
-openDHANA_mqtt__config_files__read_mqttmap (const string& path)
+openDHANA_mqtt__broker__candidates (std::vector<mqtt_broker>& candidates)
 {
-  LOCK (openDHANA_mqtt_publications);
-
-  char buffer[255];
-  int line_number = 0;
-
-  std::map < string, Option > publish;
+  candidates.clear ();
+  for (size_t i = 0; i < broker_current; i++)
+    if (!brokers[i].refused)
+      candidates.push_back (brokers[i]);
+}
 
-  publish["mqtt_topic"] =
-          Option (OptionRequired, "",
-                  "^\\s*(mqtt_topic)\\s*=\\s*\"(.*)\"\\s*$");
+/// Check if one of a list of brokers is up.
+///
+/// @param candidates           the brokers.
+/// @return                     __true__ if one is, __false__ otherwise.
+///
 
-  publish["internal_topic"] =
-          Option (OptionRequired, "",
-                  "^\\s*(internal_topic)\\s*=\\s*\"(.*)\"\\s*$");
+bool
+openDHANA_mqtt__broker__any_up (const std::vector<mqtt_broker>& candidates)
+{
+  for (std::vector<mqtt_broker>::const_iterator broker = candidates.begin ();
+          broker != candidates.end (); ++broker)
+    if (openDHANA_mqtt__broker__reachable (*broker))
+      {
+        INFO ("mqtt/comms", "\""
+              + openDHANA_mqtt__broker__name (*broker)
+              + "\" is up again, reconnecting.");
+        return true;
+      }
 
-  publish["retain"] =
-          Option (OptionRequired, "",
-                  "^\\s*(retain)\\s*=\\s*(true|false)\\s*$");
+  return false;
+}
 
-  publish["qos"] =
-          Option (OptionRequired, "",
-                  "^\\s*(qos)\\s*=\\s*(0|1|2)\\s*$");
+/// Check if a broker before the connected one in mqtt_host is up again.
+///
+/// @return                     __true__ if one is, __false__ otherwise.
+///
 
-  std::map < string, Option > subscribe;
+bool
+openDHANA_mqtt__broker__preferred_up ()
+{
+  std::vector<mqtt_broker> candidates;
 
-  subscribe["mqtt_topic"] =
-          Option (OptionRequired, "",
-                  "^\\s*(mqtt_topic)\\s*=\\s*\"(.*)\"\\s*$");
+  openDHANA_mqtt__broker__candidates (candidates);
+  return openDHANA_mqtt__broker__any_up (candidates);
+}
 
-  subscribe["internal_topic"] =
-          Option (OptionRequired, "",
-                  "^\\s*(internal_topic)\\s*=\\s*\"(.*)\"\\s*$");
+/// Broker thread. Runs the mosquitto loop, and connects again, with an
+/// exponential backoff, when the connection is lost. Connects start from the
+/// first broker in mqtt_host, and every mqtt_broker_check_interval seconds
+/// the brokers before the connected one are checked, to go back to a
+/// preferred broker when it is up again. A broker that refuses the connection
+/// in its CONNACK is followed by the next one, and by the wait after the
+/// last.
+///
 
-  subscribe["qos"] =
-          Option (OptionRequired, "",
-                  "^\\s*(qos)\\s*=\\s*(0|1|2)\\s*$");
+void *
+openDHANA_mqtt__broker__thread (void *param)
+{
+  long retry_ms = BROKER_RETRY_MIN_MS;
+  size_t first = 0;
 
-  FILE *f = openDHANA__generic__open_file (path);
-  if (f == NULL)
+  while (!broker_stopping)
     {
-      UNLOCK (openDHANA_mqtt_publications);
-      exit (1);
-    }
+      if (!broker_attached)
+        {
+          if (!openDHANA_mqtt__broker__connect_from (first))
+            {
+              first = 0;
+              if (!openDHANA_mqtt__broker__wait (retry_ms))
+                break;
+              retry_ms = std::min (retry_ms * 2, (long) BROKER_RETRY_MAX_MS);
+              continue;
+            }
+          broker_attached = true;
+        }
 
-  // Clear the list, we might be rereading the list
-  openDHANA_mqtt_publications.clear ();
+      uint64_t connected_at = openDHANA_mqtt__publish_queue__now ();
+      uint64_t check_ms = OPTION_INT (mqtt_broker_check_interval) * 1000;
+      uint64_t next_check = connected_at + check_ms;
+      bool switching = false;
+      int result;
 
-  while (!feof (f))
-    {
-      if (fgets (buffer, sizeof (buffer), f))
+      while ((result = mosquitto_loop (mosq, 1000, 1)) == MOSQ_ERR_SUCCESS
+             && !broker_stopping)
         {
-          if (openDHANA__config__process_this_line (buffer))
+          uint64_t now = openDHANA_mqtt__publish_queue__now ();
+
+          openDHANA_mqtt__config_files__refresh_map ();
+
+          if (broker_current == 0 || check_ms == 0 || now < next_check)
+            continue;
+
+          next_check = now + check_ms;
+          if (openDHANA_mqtt__broker__preferred_up ())
             {
-              string_vector line = openDHANA__config__split_line (buffer);
+              mosquitto_disconnect (mosq);
+              switching = true;
+            }
+        }
 
-              // TODO: add support for "macros" so that you can define a config tree for a specifik type of device and use that with many
-              // macro "aeon_labs_multi_sensor_configs" "power_management/on_time" "${1}:config:COMMAND_CLASS_CONFIGURATION:1:3:short"
-              // macro "aeon_labs_multi_sensor_configs" "reports/group_1_reports" "${1}:config:COMMAND_CLASS_CONFIGURATION:1:101:int"
-              // sweden/strangnas/garage/sensor/config/${aeon_labs_multi_sensor_configs, 2}
+      broker_attached = false;
+      broker_connected = false;
+      if (broker_stopping)
+        break;
 
-              if (line[0] == "publish")
-                {
-                  string_vector options =
-                          openDHANA__config__split_parameters (line[1]);
+      first = 0;
+      if (broker_refused)
+        {
+          broker_refused = false;
+          first = broker_current + 1;
+          if (first < brokers.size ())
+            continue;
+          first = 0;
+          if (!openDHANA_mqtt__broker__wait (retry_ms))
+            break;
+          retry_ms = std::min (retry_ms * 2, (long) BROKER_RETRY_MAX_MS);
+          continue;
+        }
+      if (switching)
+        continue;
 
-                  // Are all options provided ok?
-                  if (!openDHANA__options__check (options, publish))
-                    openDHANA__options__invalid_missing_options (path,
-                                                                 line_number);
-                  else
-                    {
-                      mqtt_pub pub;
+      WARNING ("mqtt/comms", "connection to \""
+               + openDHANA_mqtt__broker__name (brokers[broker_current])
+               + "\" lost, "
+               + (result == MOSQ_ERR_ERRNO ?
+                  strerror (errno) : mosquitto_strerror (result)) + ".");
+
+      if (openDHANA_mqtt__publish_queue__now () - connected_at
+          >= BROKER_RETRY_MAX_MS)
+        retry_ms = BROKER_RETRY_MIN_MS;
+      if (!openDHANA_mqtt__broker__wait (retry_ms))
+        break;
+      retry_ms = std::min (retry_ms * 2, (long) BROKER_RETRY_MAX_MS);
+    }
 
-                      pub.mqtt_topic = publish["mqtt_topic"].getValue ();
-                      pub.retain = publish["retain"].getValue () == "true" ?
-                              true : false;
-                      pub.qos = atoi (publish["qos"].getValue ().c_str ());
+  return NULL;
+}
 
-                      openDHANA_mqtt_publications[publish["internal_topic"].getValue ()] =
-                              pub;
-                    }
-                }
-              if (line[0] == "subscribe")
-                {
-                  string_vector options =
-                          openDHANA__config__split_parameters (line[1]);
+/// Get the epoll events to wait for on the socket of the connection.
+///
+/// @return                     EPOLLIN, and EPOLLOUT when mosquitto has
+///                             packets to send.
+///
 
-                  // Are all options provided ok?
-                  if (!openDHANA__options__check (options, subscribe))
-                    openDHANA__options__invalid_missing_options (path,
-                                                                 line_number);
-                  else
-                    {
+uint32_t
+openDHANA_mqtt__broker__events ()
+{
+  uint32_t events = EPOLLIN;
+
+  if (mosquitto_want_write (mosq))
+    events |= EPOLLOUT;
+  return events;
+}
 
-                      mqtt_sub sub;
+/// Remove the socket of an ended connection from the reactor, and decide when
+/// to connect again, as the broker thread does.
+///
+/// @param result               the mosquitto error that ended it.
+///
 
-                      sub.internal_topic =
-                              subscribe["internal_topic"].getValue ();
-                      sub.qos = atoi (subscribe["qos"].getValue ().c_str ());
+void
+openDHANA_mqtt__broker__detach (int result)
+{
+  uint64_t now = openDHANA_mqtt__publish_queue__now ();
 
-                      openDHANA_mqtt_subscriptions[subscribe["mqtt_topic"].getValue ()] =
-                              sub;
-                    }
-                }
-            }
+  openDHANA__reactor__remove (broker_socket);
+  broker_socket = -1;
+  broker_attached = false;
+  broker_connected = false;
+
+  broker_next_first = 0;
+  if (broker_refused)
+    {
+      broker_refused = false;
+      broker_next_first = broker_current + 1;
+      if (broker_next_first < brokers.size ())
+        broker_next_attempt = now;
+      else
+        {
+          broker_next_first = 0;
+          broker_next_attempt = now + broker_retry_ms;
+          broker_retry_ms = std::min (broker_retry_ms * 2,
+                                      (long) BROKER_RETRY_MAX_MS);
         }
+      return;
     }
-  fclose (f);
 
-  UNLOCK (openDHANA_mqtt_publications);
+  if (broker_switching)
+    {
+      broker_next_attempt = now;
+      return;
+    }
+
+  WARNING ("mqtt/comms", "connection to \""
+           + openDHANA_mqtt__broker__name (brokers[broker_current])
+           + "\" lost, "
+           + (result == MOSQ_ERR_ERRNO ?
+              strerror (errno) : mosquitto_strerror (result)) + ".");
+
+  if (now - broker_connected_at >= BROKER_RETRY_MAX_MS)
+    broker_retry_ms = BROKER_RETRY_MIN_MS;
+  broker_next_attempt = now + broker_retry_ms;
+  broker_retry_ms = std::min (broker_retry_ms * 2, (long) BROKER_RETRY_MAX_MS);
 }
 
-/// MQTT configuration has changed. Unsubscribe, reread, and subscribe.
-/// Called by @openDHANA__config__file_monitor.
+/// The socket of the connection is ready in the reactor, read and write the
+/// packets.
 ///
-/// @param path                 path to file.
+/// @param fd                   the socket.
+/// @param events               the epoll events.
 ///
 
 void
-openDHANA_mqtt__config_files__config_changed (const string path)
+openDHANA_mqtt__broker__socket_ready (int fd, uint32_t events)
 {
+  int result = MOSQ_ERR_SUCCESS;
 
-  openDHANA_mqtt__communication__unsubscribe (openDHANA_mqtt_subscriptions);
-  openDHANA_mqtt__config_files__read_mqttmap (path);
-  openDHANA_mqtt__communication__subscribe (openDHANA_mqtt_subscriptions);
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    result = mosquitto_loop_read (mosq, 1);
+  if (result == MOSQ_ERR_SUCCESS && (events & EPOLLOUT))
+    result = mosquitto_loop_write (mosq, 1);
+
+  // mosquitto closes the socket when the connection ends, or after sending
+  // a disconnect
+  if (result != MOSQ_ERR_SUCCESS || mosquitto_socket (mosq) != fd)
+    openDHANA_mqtt__broker__detach (result);
 }
 
-/// Set up file monitoring for all the files required.
+/// Add the socket of a new connection to the reactor.
 ///
 
 void
-openDHANA_mqtt__config_files__monitor ()
+openDHANA_mqtt__broker__attach ()
+{
+  broker_socket = mosquitto_socket (mosq);
+  broker_events = openDHANA_mqtt__broker__events ();
+  openDHANA__reactor__add (broker_socket, broker_events,
+                           openDHANA_mqtt__broker__socket_ready);
+
+  broker_attached = true;
+  broker_switching = false;
+  broker_connected_at = openDHANA_mqtt__publish_queue__now ();
+  broker_next_check = broker_connected_at
+          + OPTION_INT (mqtt_broker_check_interval) * 1000;
+}
+
+/// Broker worker thread, makes a connect or a health check for the reactor.
+///
+
+void *
+openDHANA_mqtt__broker__worker (void *param)
 {
+  if (broker_worker_connect)
+    broker_worker_result =
+            openDHANA_mqtt__broker__connect_from (broker_worker_first);
+  else
+    broker_worker_result =
+            openDHANA_mqtt__broker__any_up (broker_worker_candidates);
 
-  openDHANA__config__file_monitor (OPTION (mqtt_map_file),
-                                   &openDHANA_mqtt__config_files__config_changed);
+  broker_worker_state = BrokerWorkerDone;
+  openDHANA_mqtt__broker__wake ();
+  return NULL;
 }
 
-/// Subscribe to the topics in a list
+/// Start the broker worker thread.
 ///
-/// @param mqtt_subscriptions   the list with subscriptions.
+/// @param connect              __true__ to connect, from broker_next_first
+///                             on, __false__ for a health check of the
+///                             brokers before the connected one.
 ///
 
 void
-openDHANA_mqtt__communication__subscribe (const std::map<string, mqtt_sub>& mqtt_subscriptions)
+openDHANA_mqtt__broker__work (bool connect)
 {
-  LOCK (openDHANA_mqtt_publications);
-
-  INFO ("mqtt/comms", "subscribing to topics.");
-
-  for (std::map<string, mqtt_sub>::const_iterator mqtt_subscription =
-          mqtt_subscriptions.begin ();
-          mqtt_subscription != mqtt_subscriptions.end ();
-          ++mqtt_subscription)
+  broker_worker_connect = connect;
+  broker_worker_first = broker_next_first;
+  if (!connect)
     {
-      //TODO:addsupport for secondary
-
-      mqtt_sub sub = mqtt_subscription->second;
-      mosquitto_subscribe (mosq, NULL, mqtt_subscription->first.c_str (),
-                           sub.qos);
-      INFO ("mqtt/comms", "subscribe \"" + mqtt_subscription->first + "\".");
+      openDHANA_mqtt__broker__candidates (broker_worker_candidates);
+      if (broker_worker_candidates.empty ())
+        return;
     }
 
-  INFO ("mqtt/comms", "all topics subscribed.");
-
-  UNLOCK (openDHANA_mqtt_publications);
+  broker_worker_state = BrokerWorkerRunning;
+  if (pthread_create (&broker_worker, NULL,
+                      openDHANA_mqtt__broker__worker, NULL) != 0)
+    {
+      // Tried again on the next tick
+      broker_worker_state = BrokerWorkerIdle;
+      WARNING ("mqtt/comms", "error creating broker worker thread.");
+    }
 }
 
-/// Unsubscribe to the topics in a list
+/// Take the result of the broker worker thread when it is done: attach a new
+/// connection, or disconnect to go back to a preferred broker.
 ///
-/// @param mqtt_subscriptions   the list with subscriptions.
+/// @param wait                 __true__ to wait for the worker to be done.
 ///
 
 void
-openDHANA_mqtt__communication__unsubscribe (const std::map<string, mqtt_sub>& mqtt_subscriptions)
+openDHANA_mqtt__broker__worker_done (bool wait)
 {
-  LOCK (openDHANA_mqtt_publications);
+  if (broker_worker_state == BrokerWorkerIdle
+      || (!wait && broker_worker_state != BrokerWorkerDone))
+    return;
 
-  INFO ("mqtt/comms", "unsubscribing to topics.");
+  pthread_join (broker_worker, NULL);
+  broker_worker_state = BrokerWorkerIdle;
 
-  for (std::map<string, mqtt_sub>::const_iterator mqtt_subscription =
-          mqtt_subscriptions.begin ();
-          mqtt_subscription != mqtt_subscriptions.end ();
-          ++mqtt_subscription)
+  if (broker_worker_connect)
     {
-      //TODO:addsupport for secondary
-
-      mqtt_sub sub = mqtt_subscription->second;
-      mosquitto_unsubscribe (mosq, NULL, mqtt_subscription->first.c_str ());
-      INFO ("mqtt/comms", "unsubscribe \"" + mqtt_subscription->first + "\".");
+      if (broker_worker_result)
+        openDHANA_mqtt__broker__attach ();
+      else
+        {
+          broker_next_first = 0;
+          broker_next_attempt = openDHANA_mqtt__publish_queue__now ()
+                  + broker_retry_ms;
+          broker_retry_ms = std::min (broker_retry_ms * 2,
+                                      (long) BROKER_RETRY_MAX_MS);
+        }
+    }
+  else if (broker_worker_result && broker_attached && !broker_switching)
+    {
+      mosquitto_disconnect (mosq);
+      broker_switching = true;
     }
-
-  INFO ("mqtt/comms", "all topics unsubscribed.");
-
-  UNLOCK (openDHANA_mqtt_publications);
 }
 
-
-/// Map internal_topic to MQTT topic and publish the value to the MQTT broker.
+/// The tick timer of the reactor has expired. Does the keepalive and the
+/// health check of the connection, or connects again when the wait is over.
+/// The health checks and the connects are made by the worker thread.
 ///
-/// @param mqtt_subscriptions   the list with subscriptions.
-/// @param internal_topic       the internal topic from the module.
-/// @param value                the value.
+/// @param fd                   the timerfd.
+/// @param events               the epoll events.
 ///
 
 void
-openDHANA_mqtt__communication__publish (std::map<string, mqtt_pub>& mqtt_publications,
-                                        const string& internal_topic,
-                                        const string& value)
+openDHANA_mqtt__broker__tick_ready (int fd, uint32_t events)
 {
-  LOCK (openDHANA_mqtt_publications);
+  uint64_t now = openDHANA_mqtt__publish_queue__now ();
 
-  // Check if we have a publish rule for this
-  if (mqtt_publications.count (internal_topic) != 0)
+  openDHANA_mqtt__broker__worker_done (false);
+  openDHANA_mqtt__config_files__refresh_map ();
+
+  if (broker_attached)
     {
-      // Yes, publish it
+      int result = mosquitto_loop_misc (mosq);
 
-      mqtt_pub mqtt = mqtt_publications[internal_topic];
+      if (result != MOSQ_ERR_SUCCESS
+          || mosquitto_socket (mosq) != broker_socket)
+        {
+          openDHANA_mqtt__broker__detach (result);
+          return;
+        }
 
-      mosquitto_publish (mosq,
-                         NULL,
-                         mqtt.mqtt_topic.c_str (),
-                         value.length (),
-                         value.c_str (),
-                         mqtt.qos,
-                         mqtt.retain);
-    }
-  else
-    {
+      uint64_t check_ms = OPTION_INT (mqtt_broker_check_interval) * 1000;
 
-      WARNING ("mqtt/comms",
-               "unmapped internal_topic \"" + internal_topic
-               + "\", no publish done. check your config files.");
+      if (broker_current == 0 || check_ms == 0 || broker_switching
+          || broker_worker_state != BrokerWorkerIdle
+          || now < broker_next_check)
+        return;
+
+      broker_next_check = now + check_ms;
+      openDHANA_mqtt__broker__work (false);
+      return;
     }
 
-  UNLOCK (openDHANA_mqtt_publications);
+  if (broker_worker_state != BrokerWorkerIdle || now < broker_next_attempt)
+    return;
+
+  openDHANA_mqtt__broker__work (true);
 }
 
-/// Connect callback from mosquitto.
+/// The publisher thread has woken the reactor.
+///
+/// @param fd                   the eventfd.
+/// @param events               the epoll events.
 ///
 
 void
-openDHANA_mqtt__communication__connect_callback (struct mosquitto *mosq,
-                                                 void *userdata,
-                                                 int result)
+openDHANA_mqtt__broker__wake_ready (int fd, uint32_t events)
 {
-  // TODO: if the mqtt server is not responding, wait and try until it works. Control by option
-
-  INFO ("mqtt/comms", "connecting to MQTT broker.");
+  uint64_t count;
 
-  if (!result)
-    // Connected, subscribe to all our tooics
-    openDHANA_mqtt__communication__subscribe (openDHANA_mqtt_subscriptions);
+  if (read (fd, &count, sizeof (count)) == -1)
+    return;
 
-  else
-    ERROR ("mqtt/comms", "connect to MQTT broker failed.");
+  openDHANA_mqtt__broker__worker_done (false);
 }
 
-/// Subscribe callback from mosquitto.
+/// Wake the reactor, so that a packet queued by another thread is sent. Does
+/// nothing unless mqtt_event_loop=epoll.
 ///
 
 void
-openDHANA_mqtt__communication__subscribe_callback (struct mosquitto *mosq,
-                                                   void *userdata,
-                                                   int mid,
-                                                   int qos_count,
-                                                   const int *granted_qos) {
-  // Do nothing right now
+openDHANA_mqtt__broker__wake ()
+{
+  uint64_t one = 1;
+
+  if (broker_wake != -1 && write (broker_wake, &one, sizeof (one)) == -1)
+    WARNING ("mqtt/comms", "waking the reactor failed, "
+             + string (strerror (errno)) + ".");
 }
 
-/// We got a message from the broker.
-///
-/// Map the MQTT topic to an internal topic and call the module in order for it
-/// to process the message.
+/// Called by the reactor after each round of events, waits for the socket to
+/// be writable only while mosquitto has packets to send.
 ///
 
 void
-openDHANA_mqtt__communication__message_callback (struct mosquitto *mosq,
-                                                 void *userdata,
-                                                 const struct mosquitto_message * message)
+openDHANA_mqtt__broker__idle ()
 {
-  LOCK (openDHANA_mqtt_publications);
+  if (!broker_attached)
+    return;
 
-  if (message->payloadlen)
+  uint32_t events = openDHANA_mqtt__broker__events ();
+
+  if (events != broker_events)
     {
-      // Map the mqtt_topic to the internal_topic
-      // TODO:Add map as parameter
-      string internal_topic =
-              openDHANA_mqtt_subscriptions[message->topic].internal_topic;
+      openDHANA__reactor__modify (broker_socket, events);
+      broker_events = events;
+    }
+}
 
-      // Release the lock because the module might publish a message as a
-      // result of the received message.
+/// Get the MQTT client id.
+///
+/// It is mqtt_id, or else mqtt_id_prefix followed by the program name and the
+/// host name, so that the modules on a host get different ids. Without both,
+/// a persistent session, mqtt_disable_clean_session, gets the program name
+/// followed by the host name, so that the session is found again after a
+/// restart, and a clean session gets a unique id.
+///
+/// A persistent session needs an id that is the same at every start and used
+/// by no other client, mqtt_id must be set with that in mind.
+///
+/// @return                     the client id.
+///
 
-      UNLOCK (openDHANA_mqtt_publications);
+string
+openDHANA_mqtt__broker__client_id ()
+{
+  char host[256] = "";
 
-      // Call the module
-      moduleMessageCallback (internal_topic, (char *) message->payload);
-    }
-  else
-    {
-      // This might be a reset of a retained message
-      // (mosquitto_pub -t <topic> -r -n)
+  if (!OPTION_STRING (mqtt_id).empty ())
+    return OPTION_STRING (mqtt_id);
 
-      INFO ("mqtt/comms",
-            "empty MQTT message \"" + string (message->topic) + "\"");
+  gethostname (host, sizeof (host) - 1);
 
-      UNLOCK (openDHANA_mqtt_publications);
-    }
+  if (!OPTION_STRING (mqtt_id_prefix).empty ())
+    return OPTION_STRING (mqtt_id_prefix) + program_invocation_short_name
+            + "-" + host;
+
+  if (OPTION_BOOL (mqtt_disable_clean_session))
+    return string (program_invocation_short_name) + "-" + host;
+
+  return openDHANA___generic__md5_hash_unique ();
 }
 
 /// Connect to the MQTT broker.
 ///
+/// mqtt_host is a list of brokers in order of preference, the first that
+/// accepts the connection is used. If none does, the module gives up, unless
+/// mqtt_wait_for_broker is set, then the broker thread keeps trying.
+///
+/// @return                     __true__ if connected, or waiting for a
+///                             broker, __false__ otherwise.
+///
 
 bool
 openDHANA_mqtt__communication__connect_broker ()
 {
-  mosq = mosquitto_new (openDHANA___generic__md5_hash_unique ().c_str (),
-                        true,
+  string client_id = openDHANA_mqtt__broker__client_id ();
+  bool clean_session = !OPTION_BOOL (mqtt_disable_clean_session);
+
+  mosq = mosquitto_new (client_id.c_str (),
+                        clean_session,
                         NULL);
 
   if (!mosq)
@@ -1634,31 +7389,85 @@ openDHANA_mqtt__communication__connect_broker ()
   //      mosquitto_log_init(mosq, MOSQ_LOG_DEBUG | MOSQ_LOG_ERR | MOSQ_LOG_WARNING
   //                      | MOSQ_LOG_NOTICE | MOSQ_LOG_INFO, MOSQ_LOG_STDERR);
 
-  mosquitto_connect_callback_set (mosq,
-                                  openDHANA_mqtt__communication__connect_callback);
+  mosquitto_connect_with_flags_callback_set (mosq,
+                                             openDHANA_mqtt__communication__connect_callback);
+  mosquitto_disconnect_callback_set (mosq,
+                                     openDHANA_mqtt__communication__disconnect_callback);
   mosquitto_message_callback_set (mosq,
                                   openDHANA_mqtt__communication__message_callback);
   mosquitto_subscribe_callback_set (mosq,
                                     openDHANA_mqtt__communication__subscribe_callback);
 
-  string host = OPTION (mqtt_host);
-  string port = OPTION (mqtt_port);
-  string keepalive = OPTION (mqtt_keepalive);
+  // The loop runs in the broker thread, or the reactor, publishes are made
+  // from others
+  mosquitto_threaded_set (mosq, true);
 
-  //TODO: add support for waiting for MQTT broker
-  //TODO: add support for multiple brokers
-  if (mosquitto_connect (mosq, host.c_str (), atoi (port.c_str ()),
-                         atoi (keepalive.c_str ())))
-    {
+  INFO ("mqtt/comms", "client id \"" + client_id + "\", "
+        + (clean_session ? "clean session." : "persistent session."));
+  if (!clean_session)
+    openDHANA_mqtt__session__load ();
 
-      ERROR ("mqtt/comms",
-             "unable to connect to \"" + host + ":" + port
-             + "\" with keepalive \"" + keepalive + "\"");
+  openDHANA_mqtt__broker__parse (OPTION_STRING (mqtt_host),
+                                 OPTION_INT (mqtt_port), brokers);
+  if (brokers.empty ())
+    {
+      ERROR ("mqtt/comms", "no MQTT broker in \"mqtt_host\".");
       return false;
     }
 
-  // Start mosquitto loop. It will handle reconnects and processong of events
-  mosquitto_loop_start (mosq);
+  pthread_condattr_t attr;
+
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&broker_cond, &attr);
+  pthread_condattr_destroy (&attr);
+
+  broker_stopping = false;
+  broker_attached = openDHANA_mqtt__broker__connect_from (0);
+  if (!broker_attached)
+    {
+      if (!OPTION_BOOL (mqtt_wait_for_broker))
+        {
+          ERROR ("mqtt/comms", "unable to connect to any MQTT broker.");
+          return false;
+        }
+      WARNING ("mqtt/comms", "no MQTT broker reachable, waiting for one.");
+    }
+
+  if (openDHANA__reactor__enabled ())
+    {
+      // The reactor runs the mosquitto loop, in
+      // openDHANA__generic__process_loop
+      broker_wake = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (broker_wake != -1)
+        openDHANA__reactor__add (broker_wake, EPOLLIN,
+                                 openDHANA_mqtt__broker__wake_ready);
+      broker_tick = openDHANA__reactor__timer (openDHANA_mqtt__broker__tick_ready);
+      if (broker_tick == -1)
+        return false;
+      openDHANA__reactor__arm (broker_tick, BROKER_TICK_MS, BROKER_TICK_MS);
+      openDHANA__reactor__set_idle (openDHANA_mqtt__broker__idle);
+
+      broker_retry_ms = BROKER_RETRY_MIN_MS;
+      broker_next_attempt = 0;
+      if (broker_attached)
+        openDHANA_mqtt__broker__attach ();
+    }
+  else
+    {
+      // Start the mosquitto loop. It handles the processing of events, the
+      // broker thread reconnects
+      if (pthread_create (&broker_thread, NULL,
+                          openDHANA_mqtt__broker__thread, NULL) != 0)
+        {
+          ERROR ("mqtt/comms", "error creating broker thread.");
+          return false;
+        }
+      broker_running = true;
+    }
+
+  // Start sending queued publishes
+  openDHANA_mqtt__publish_queue__start ();
 
   return true;
 }
@@ -1669,11 +7478,52 @@ openDHANA_mqtt__communication__connect_broker ()
 void
 openDHANA_mqtt__communication__disconnect_broker ()
 {
+  // Send, or spool, what is queued before disconnecting
+  openDHANA_mqtt__publish_queue__stop ();
+
+  // A persistent session keeps its subscriptions, the broker queues messages
+  // for them until we are back
+  if (!OPTION_BOOL (mqtt_disable_clean_session))
+    openDHANA_mqtt__communication__unsubscribe (openDHANA_mqtt__config_files__get_map ()->subscriptions);
+
+  if (broker_running)
+    {
+      LOCK (broker);
+      broker_stopping = true;
+      pthread_cond_signal (&broker_cond);
+      UNLOCK (broker);
+
+      mosquitto_disconnect (mosq);
+      pthread_join (broker_thread, NULL);
+      broker_running = false;
+    }
+  else if (broker_tick != -1)
+    {
+      // The reactor has stopped, send what is queued and the disconnect
+      openDHANA_mqtt__broker__worker_done (true);
+      openDHANA__reactor__set_idle (NULL);
+      openDHANA__reactor__remove (broker_tick);
+      close (broker_tick);
+      broker_tick = -1;
+      if (broker_wake != -1)
+        {
+          openDHANA__reactor__remove (broker_wake);
+          close (broker_wake);
+          broker_wake = -1;
+        }
 
-  openDHANA_mqtt__communication__unsubscribe (openDHANA_mqtt_subscriptions);
+      if (broker_attached)
+        {
+          openDHANA__reactor__remove (broker_socket);
+          mosquitto_disconnect (mosq);
+          for (int ms = 0; ms < BROKER_FLUSH_MS
+                  && mosquitto_socket (mosq) != -1; ms += 100)
+            if (mosquitto_loop (mosq, 100, 1) != MOSQ_ERR_SUCCESS)
+              break;
+          broker_attached = false;
+        }
+    }
 
-  mosquitto_disconnect (mosq);
-  mosquitto_loop_stop (mosq, false);
   mosquitto_destroy (mosq);
 }
 
@@ -1689,58 +7539,128 @@ std::map<string, lua_State*> script_state;
 CREATE_LOCK (script_state);
 
 // Value cache that is sent to a script when it starts
-string_map openDHANA__lua__value_cache;
+std::map<topic_id, string> openDHANA__lua__value_cache;
+
+// Its address is the key, in the registry of a script, of the table of the
+// names of the functions by topic id
+static char openDHANA__lua__function_names_key;
+
+/// Push the function of a topic on the stack of a script.
+///
+/// The name of the function is made into a Lua string the first time a topic
+/// is seen by the script, and is then found in a table indexed by the topic
+/// id. The function itself is looked up in the globals with that string on
+/// every call, the way lua_getglobal does, so functions that are defined or
+/// replaced later, or provided by an __index metamethod of the globals, are
+/// seen. The string is only not hashed again.
+///
+/// @param topic                the id of the topic, TOPIC_NONE to look the
+///                             function up by name.
+/// @param function             the name of the function.
+/// @param script               the Lua state for the script.
+/// @return                     __true__ if the function was pushed, __false__
+///                             if the script has no such function.
+///
+
+bool
+openDHANA__lua__get_function (topic_id topic,
+                              const string& function,
+                              lua_State* script)
+{
+  if (topic == TOPIC_NONE)
+    lua_getglobal (script, function.c_str ());
+  else
+    {
+      lua_pushlightuserdata (script, &openDHANA__lua__function_names_key);
+      lua_rawget (script, LUA_REGISTRYINDEX);
+#ifdef LUA_RIDX_GLOBALS
+      lua_rawgeti (script, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+#else
+      lua_pushvalue (script, LUA_GLOBALSINDEX);
+#endif
+      lua_rawgeti (script, -2, topic + 1);
+
+      if (lua_isnil (script, -1))
+        {
+          // First time, intern the name and remember it
+          lua_pop (script, 1);
+          lua_pushlstring (script, function.data (), function.length ());
+          lua_pushvalue (script, -1);
+          lua_rawseti (script, -4, topic + 1);
+        }
+      // Like lua_getglobal, an __index metamethod of the globals is used
+      lua_gettable (script, -2);
+      lua_remove (script, -2); // The globals
+      lua_remove (script, -2); // The names
+    }
+
+  // Check the top of the stack, make sure it's a function
+  if (lua_isfunction (script, -1))
+    return true;
+
+  lua_pop (script, 1);
+  return false;
+}
 
 
 /// Call a function in a Lua script, if the function exists
 ///
+/// @param topic                the id of the topic the function is named
+///                             after, or TOPIC_NONE.
 /// @param function             the function to call.
 /// @param message              the string that is sent as a parameter to the
-///                             script.
+///                             script, Lua copies it. It may be binary.
+/// @param arguments            more strings that are sent as parameters after
+///                             the message, the levels matched by the
+///                             wildcards of a subscription.
 /// @param script               the Lua state for the script.
 /// @return                     __true__ if the function existed and was called
 ///                             ok, __false__ otherwise.
 ///
 
 bool
-openDHANA__lua__call_function_in_script (const string& function,
-                                         const string& message,
+openDHANA__lua__call_function_in_script (topic_id topic,
+                                         const string& function,
+                                         const line_view& message,
+                                         const string_vector& arguments,
                                          lua_State* script)
 {
   // Does this script have this function?
-  lua_getglobal (script, function.c_str ());
-
-  // Check the top of the stack, make sure it's a function
-  if (lua_isfunction (script, -1))
+  if (openDHANA__lua__get_function (topic, function, script))
     {
-      // Yes, push parameter and call it
-      lua_pushlstring (script, message.c_str (), message.length ());
+      // Yes, push parameters and call it
+      lua_pushlstring (script, message.data, message.length);
+      for (string_vector::const_iterator argument = arguments.begin ();
+              argument != arguments.end (); ++argument)
+        lua_pushlstring (script, argument->c_str (), argument->length ());
 
-      if (lua_pcall (script, 1, 0, 0) != 0)
+      if (lua_pcall (script, 1 + arguments.size (), 0, 0) != 0)
         {
           WARNING ("lua/exec",
                    "error calling function \"" + function + "\" with \""
-                   + message + "\".");
+                   + message.str () + "\".");
           return false;
         }
     }
-  else
-    {
-
-      lua_pop (script, 1); // No, didn't have that function, remove from the stack
-    }
   return true;
 }
 
 /// Call a function in all the Lua scripts, if it exists.
 ///
+/// @param topic                the id of the topic the function is named
+///                             after, or TOPIC_NONE.
 /// @param function             the function to call.
 /// @param message              the string that is sent as a parameter to the
+///                             scripts.
+/// @param arguments            more strings that are sent as parameters after
+///                             the message.
 ///
 
 void
-openDHANA__lua__call_function_in_all_scripts (const string& function,
-                                              const string& message)
+openDHANA__lua__call_function_in_all_scripts (topic_id topic,
+                                              const string& function,
+                                              const line_view& message,
+                                              const string_vector& arguments)
 {
   // Find out which scripts have a callback for the internal_topic
 
@@ -1749,7 +7669,8 @@ openDHANA__lua__call_function_in_all_scripts (const string& function,
   for (std::map<string, lua_State*>::iterator script =
           script_state.begin (); script != script_state.end (); script++)
     {
-      if (!openDHANA__lua__call_function_in_script (function, message, script->second))
+      if (!openDHANA__lua__call_function_in_script (topic, function, message,
+                                                    arguments, script->second))
         {
 
           WARNING ("lua/exec",
@@ -1762,6 +7683,21 @@ openDHANA__lua__call_function_in_all_scripts (const string& function,
   UNLOCK (script_state);
 }
 
+/// Call a function in all the Lua scripts, if it exists.
+///
+/// @see openDHANA__lua__call_function_in_all_scripts (topic_id, ...)
+///
+
+void
+openDHANA__lua__call_function_in_all_scripts (const string& function,
+                                              const line_view& message,
+                                              const string_vector& arguments)
+{
+  openDHANA__lua__call_function_in_all_scripts
+          (openDHANA_mqtt__topics__find (function), function, message,
+           arguments);
+}
+
 
 typedef int (*lua_callback)(lua_State *);
 std::map <string, lua_callback> openDHANA__lua__lua_functions;
@@ -1784,6 +7720,12 @@ openDHANA__lua__start_script (const string& path)
 
   luaL_openlibs (script_state[path]);
 
+  // The names of the functions by topic id, @see openDHANA__lua__get_function
+  lua_pushlightuserdata (script_state[path],
+                         &openDHANA__lua__function_names_key);
+  lua_newtable (script_state[path]);
+  lua_rawset (script_state[path], LUA_REGISTRYINDEX);
+
   for (std::map <string, lua_callback>::const_iterator callback = openDHANA__lua__lua_functions.begin ();
           callback != openDHANA__lua__lua_functions.end (); ++callback)
     {
@@ -1816,7 +7758,7 @@ openDHANA__lua__start_script (const string& path)
 
   // Give the script earlier parameters
 
-  for (string_map::const_iterator value =
+  for (std::map<topic_id, string>::const_iterator value =
           openDHANA__lua__value_cache.begin ();
           value != openDHANA__lua__value_cache.end ();
           ++value)
@@ -1824,7 +7766,9 @@ openDHANA__lua__start_script (const string& path)
       // printf("%s--%s\n", value->first.c_str(), value->second.c_str());
 
       openDHANA__lua__call_function_in_script (value->first,
+                                               openDHANA_mqtt__topics__name (value->first),
                                                value->second,
+                                               string_vector (),
                                                script_state[path]);
     }
 
@@ -1879,14 +7823,60 @@ class script_list_node
 public:
 
   struct stat node_stat;
+  uint64_t hash; /// Hash of the script contents
   bool seen;
 };
 
 std::map<string, script_list_node> script_list;
 
+/// Get the hash of the contents of a script.
+///
+/// @param path                 the path to the script.
+/// @param hash                 the hash.
+/// @return                     __true__ if the script could be read,
+///                             __false__ otherwise.
+///
+
+bool
+openDHANA__lua__script_hash (const string& path, uint64_t& hash)
+{
+  config_file file;
+
+  if (!file.open (path))
+    return false;
+
+  hash = file.hash ();
+  return true;
+}
+
+/// Log the time it took to start or restart a script.
+///
+/// @param what                 what was done with the script.
+/// @param path                 the path to the script.
+/// @param start                when it was started, CLOCK_MONOTONIC.
+///
+
+void
+openDHANA__lua__log_script_time (const string& what,
+                                 const string& path,
+                                 const struct timespec& start)
+{
+  struct timespec end;
+  char elapsed[32];
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  snprintf (elapsed, sizeof (elapsed), "%.1f",
+            (end.tv_sec - start.tv_sec) * 1000.0
+            + (end.tv_nsec - start.tv_nsec) / 1000000.0);
+  INFO ("lua/exec", what + " script \"" + path + "\" in " + elapsed + " ms.");
+}
+
 /// Scan a Lua directory for scripts. Start new scripts, restart modified 
 /// scripts and stop deleted scripts.
 ///
+/// A script is only restarted if its contents have changed, a new
+/// modification time alone is not enough.
+///
 /// @param path                 path to the directory containing the scripts.
 ///
 
@@ -1898,6 +7888,8 @@ openDHANA__lua__lua_dir_read (const string& path)
   DIR *dirp;
   struct dirent *dp;
   struct stat node_stat;
+  struct timespec start;
+  uint64_t hash;
 
   // Mark the scripts in the list as not seen
   for (std::map<string, script_list_node>::iterator script =
@@ -1918,33 +7910,64 @@ openDHANA__lua__lua_dir_read (const string& path)
               // Node doesn't exist
               ERROR ("lua/exec", "\"" + absolute_path + "\", "
                      + strerror (errno));
+              continue;
             }
 
           if (script_list.count (absolute_path) == 0)
             {
               // New script
+              if (!openDHANA__lua__script_hash (absolute_path, hash))
+                continue;
+
               script_list[absolute_path].node_stat = node_stat;
+              script_list[absolute_path].hash = hash;
               script_list[absolute_path].seen = true;
               INFO ("lua/exec", "found script: \"" + absolute_path + "\".");
+              clock_gettime (CLOCK_MONOTONIC, &start);
               openDHANA__lua__start_script (absolute_path);
+              openDHANA__lua__log_script_time ("started", absolute_path, start);
             }
           else
             {
-              if (script_list[absolute_path].node_stat.st_mtime
-                  != node_stat.st_mtime)
+              script_list[absolute_path].seen = true;
+
+              if (script_list[absolute_path].node_stat.st_mtim.tv_sec
+                  != node_stat.st_mtim.tv_sec
+                  || script_list[absolute_path].node_stat.st_mtim.tv_nsec
+                  != node_stat.st_mtim.tv_nsec
+                  || script_list[absolute_path].node_stat.st_size
+                  != node_stat.st_size)
                 {
-                  // File is changed
+                  // File is touched, check if the contents have changed
+                  if (!openDHANA__lua__script_hash (absolute_path, hash))
+                    {
+                      // Keep the old stat, the next scan tries again
+                      WARNING ("lua/exec",
+                               "touched script: \"" + absolute_path
+                               + "\", could not be read, not restarted.");
+                      continue;
+                    }
+
                   script_list[absolute_path].node_stat = node_stat;
-                  script_list[absolute_path].seen = true;
-                  INFO ("lua/exec",
-                        "modified script: \"" + absolute_path + "\".");
-                  openDHANA__lua__stop_script (absolute_path);
-                  openDHANA__lua__start_script (absolute_path);
-                }
-              else
-                {
-                  // File is unchanged, but seen
-                  script_list[absolute_path].seen = true;
+
+                  if (script_list[absolute_path].hash == hash)
+                    {
+                      INFO ("lua/exec",
+                            "touched script: \"" + absolute_path
+                            + "\", unchanged, not restarted.");
+                    }
+                  else
+                    {
+                      // File is changed
+                      script_list[absolute_path].hash = hash;
+                      INFO ("lua/exec",
+                            "modified script: \"" + absolute_path + "\".");
+                      clock_gettime (CLOCK_MONOTONIC, &start);
+                      openDHANA__lua__stop_script (absolute_path);
+                      openDHANA__lua__start_script (absolute_path);
+                      openDHANA__lua__log_script_time ("restarted",
+                                                       absolute_path, start);
+                    }
                 }
             }
         }
@@ -2059,9 +8082,7 @@ openDHANA__lua_function__publish (lua_State *L)
   string message = lua_tostring (L, 2);
 
   // Send the value to MQTT
-  openDHANA_mqtt__communication__publish (openDHANA_mqtt_publications,
-                                          internal_topic,
-                                          message);
+  openDHANA_mqtt__communication__publish (internal_topic, message);
 
   INFO ("lua/function", "Lua publish: \"" + internal_topic + "\" = \"" + message + "\".");
   return 0;
@@ -32,8 +32,13 @@ extern void openDHANA__lua__custom_scripts ();
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <atomic>
 #include <map>
+#include <set>
+#include <memory>
+#include <unordered_map>
 #include <string>
 #include <vector>
 #include <time.h>
@@ -46,9 +51,18 @@ extern void openDHANA__lua__custom_scripts ();
 #include <errno.h>
 #include <syslog.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
 #include <queue>
+#include <deque>
 
 #include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <dirent.h>
 
@@ -63,6 +77,8 @@ extern void openDHANA__lua__custom_scripts ();
 
 #include "openssl/md5.h"
 
+#include "openDHANA-log.h"
+
 extern "C"
 {
 #include "lua.h"
@@ -78,61 +94,492 @@ typedef std::string string;
 #define LOCK(var)   pthread_mutex_lock (&var##_mutex)
 #define UNLOCK(var) pthread_mutex_unlock (&var##_mutex)
 
-#define OPTION(option)  openDHANA__option__get_value(#option)
 #define OPTION_DEFAULT(option)  openDHANA__option__get_default_value(#option)
 
-#define ERROR(facility, message)    openDHANA__generic__log_error (facility, message, __func__, __LINE__)
-#define WARNING(facility, message)      openDHANA__generic__log_warning (facility, message, __func__, __LINE__)
-#define INFO(facility, message)         if (dhana_mqtt_debug) openDHANA__generic__log_info (facility, message, __func__, __LINE__)
+// Typed option values, read through a handle that is resolved the first time
+// the line is run.
+#define OPTION_HANDLE(option)   (*[] () { static const option_handle handle (#option); return &handle; } ())
+#define OPTION_STRING(option)   OPTION_HANDLE (option).value ()
+#define OPTION_BOOL(option)     OPTION_HANDLE (option).enabled ()
+#define OPTION_INT(option)      OPTION_HANDLE (option).number ()
+#define OPTION_ENUM(option)     OPTION_HANDLE (option).choice ()
+
+// Log through a call site that is set up the first time the line is run. The
+// message is only built if the facility's level lets it through and the call
+// site isn't rate limited.
+#define LOG_AT(level, facility, message) \
+  do \
+    { \
+      static log_site log_site_ (facility); \
+      if (log_site_.enabled (level)) \
+        log_site_.log (level, message, __func__, __LINE__); \
+    } \
+  while (0)
+
+#define ERROR(facility, message)        LOG_AT (LOG_LEVEL_ERROR, facility, message)
+#define WARNING(facility, message)      LOG_AT (LOG_LEVEL_WARNING, facility, message)
+#define INFO(facility, message)         LOG_AT (LOG_LEVEL_INFO, facility, message)
 
 #define STARTING(module) openDHANA__generic__log_info ("main/exec", "starting \"" + string(module) + "\" Version " + VERSION + ".", __func__, __LINE__)
 #define STOPPING(module) openDHANA__generic__log_info ("main/exec", "stopping \"" + string(module) + "\".", __func__, __LINE__)
 
 
+/// Log level of a facility that follows the default level.
+///
+#define LOG_LEVEL_DEFAULT       -2
+
+/// Log level of a facility that logs nothing.
+///
+#define LOG_LEVEL_OFF           -1
+
+/// Number of messages a call site may log each second, the rest are counted.
+///
+#define LOG_RATE_BURST          20
+
+/// Seconds that a message identical to the one before it from the same call
+/// site is counted instead of logged.
+///
+#define LOG_REPEAT_SECONDS      10
+
+/// How the log file is written. Same order as the values of mqtt_log_format.
+///
+enum LogFormat
+{
+  LogFormatText, LogFormatBinary
+};
+
+/// A log facility, "mqtt/comms", "lua/exec" and so on. Facilities are never
+/// deleted, call sites keep a pointer to theirs.
+///
+class log_facility
+{
+public:
+  log_facility (const std::string& name);
+  std::string name;
+  std::atomic<int> level; /// LOG_LEVEL_..., the most verbose level logged
+};
+
+/// A line that logs, @see LOG_AT. Rate limits the line and counts the
+/// messages that repeat, errors excepted.
+///
+class log_site
+{
+public:
+  log_site (const char *facility);
+  bool
+  enabled (int level);
+  void
+  log (int level, const std::string& message, const char *function,
+       int line_number);
+  void
+  flush (time_t now, bool all);
+  log_site *
+  next (void) const;
+private:
+  void
+  emit (int level, const std::string& message, const char *function,
+        int line_number);
+  void
+  summarize (int level, unsigned long repeated, unsigned long suppressed,
+             const char *function, int line_number);
+  log_site *_next; /// @see openDHANA__generic__log_flush_sites
+  log_facility *_facility;
+  std::atomic<const char *> _function; /// Set by the first log
+  std::atomic<int> _level;
+  std::atomic<int> _line_number;
+  std::atomic<time_t> _window;
+  std::atomic<unsigned> _window_count;
+  std::atomic<unsigned long> _suppressed;
+  std::atomic<uint64_t> _last_hash;
+  std::atomic<time_t> _last_time;
+  std::atomic<unsigned long> _repeated;
+  std::atomic<uint64_t> _binary_ids; /// @see log_site::emit
+};
+
+/// A dense id for an internal topic, @see openDHANA_mqtt__topics__intern.
+///
+typedef uint32_t topic_id;
+
+#define TOPIC_NONE      ((topic_id) -1)
+
 class mqtt_pub
 {
 public:
   string mqtt_topic;
+  topic_id topic; /// Set by mqtt_map::index
   bool retain;
   int qos;
+  int coalesce_ms; /// Send only the last value within this window, 0 sends at once
+  double deadband; /// Skip numeric values closer than this to the last sent, 0 is off
+  int min_interval_ms; /// Skip values sooner than this after the last sent, 0 is off
+  bool only_on_change; /// Skip values equal to the last sent
+};
+
+/// A SUBSCRIBE packet waiting for its SUBACK.
+///
+class subscribe_batch
+{
+public:
+  string_vector topics;
+  int qos;
+};
+
+/// A broker from mqtt_host.
+///
+class mqtt_broker
+{
+public:
+  mqtt_broker (void) : port (0), refused (false) { }
+  std::string host;
+  int port;
+  bool refused; /// Its last CONNACK refused us, it isn't health checked
+};
+
+/// What the broker worker thread does, with mqtt_event_loop=epoll.
+///
+enum BrokerWorker
+{
+  BrokerWorkerIdle, BrokerWorkerRunning, BrokerWorkerDone
+};
+
+/// A message in the spool file, followed by topic_length bytes of MQTT topic
+/// and payload_length bytes of payload. In host byte order.
+///
+struct spool_record
+{
+  uint32_t topic_length;
+  uint32_t payload_length;
+  uint8_t qos;
+  uint8_t retain;
+  uint16_t reserved;
+};
+
+/// What the publish queue does with a message when it is full. Same order as
+/// the values of mqtt_publish_overflow.
+///
+enum PublishOverflow
+{
+  PublishBlock, PublishDropOldest, PublishDropNewest, PublishCoalesce
+};
+
+/// A message waiting in the publish queue.
+///
+class publish_message
+{
+public:
+  publish_message (void) : topic (TOPIC_NONE), superseded (false) { }
+  topic_id topic;
+  string value;
+  bool superseded; /// A newer value of the topic is queued, skip this one
+};
+
+/// The last value sent on a topic, for the deadband, min_interval_ms and
+/// only_on_change filters of its publication.
+///
+class publish_filter_state
+{
+public:
+  std::string value;
+  double number; /// The value as a number, if numeric
+  bool numeric;
+  uint64_t sent_ms; /// When it was sent, CLOCK_MONOTONIC
+};
+
+/// Counters of the publish queue.
+///
+class publish_queue_stats
+{
+public:
+  size_t depth; /// Messages in the queue now
+  size_t high_water; /// Most messages that have been in the queue
+  size_t held; /// Messages waiting for the end of their coalesce window
+  unsigned long published;
+  unsigned long dropped; /// Dropped because the queue was full
+  unsigned long coalesced; /// Replaced by a newer value for the same topic,
+                           /// in the queue or in a coalesce window
+  unsigned long failed; /// Refused by mosquitto
+  unsigned long filtered; /// Stopped by the filters of the publication
+  unsigned long spooled; /// Written to the spool file, no broker connected
+  unsigned long replayed; /// Sent from the spool file
 };
 
 class mqtt_sub
 {
 public:
   string internal_topic;
+  topic_id topic; /// Set by mqtt_map::index
   int qos;
 };
 
+
+/// A view into a line buffer, used by the configuration file tokenizer. The
+/// view does not own the characters, the buffer must outlive it.
+///
+class line_view
+{
+public:
+  const char *data;
+  size_t length;
+  line_view (void);
+  line_view (const char *data, size_t length);
+  line_view (const std::string& s);
+  std::string
+  str (void) const;
+  bool
+  operator== (const char *s) const;
+  bool
+  operator== (const line_view& other) const;
+};
+
+typedef std::vector<line_view> line_view_vector;
+
+class line_view_hash
+{
+public:
+  size_t
+  operator() (const line_view& view) const;
+};
+
+/// A level in the trie of the wildcard subscriptions. The keys of the children
+/// point into the subscription topics of the map that owns the trie.
+///
+class topic_node
+{
+public:
+  topic_node (void);
+  std::unordered_map<line_view, topic_node *, line_view_hash> children;
+  topic_node *single; /// The "+" child
+  const mqtt_sub *subscription; /// A subscription that ends at this level
+  const mqtt_sub *multi; /// A "#" subscription at this level
+};
+
+/// The publications and subscriptions read from a .mqttmap file. A map is
+/// never changed once it is in use, a reload builds a new one.
+///
+/// The maps are ordered, for the reload diff and the snapshot. Publish and
+/// message dispatch look the topics up in hash indexes into them, built by
+/// index () before the map is put in use. Subscriptions with "+" or "#" are
+/// put in a trie instead.
+///
+class mqtt_map
+{
+public:
+  std::map<std::string, mqtt_pub> publications;
+  std::map<std::string, mqtt_sub> subscriptions;
+  mqtt_map (void) { }
+  /// Not copyable, the indexes point into the map that built them.
+  mqtt_map (const mqtt_map&) = delete;
+  mqtt_map&
+  operator= (const mqtt_map&) = delete;
+  void
+  index (void);
+  const mqtt_pub *
+  publication (const line_view& internal_topic) const;
+  const mqtt_pub *
+  publication (topic_id topic) const;
+  const mqtt_sub *
+  subscription (const line_view& mqtt_topic) const;
+  const mqtt_sub *
+  match (const line_view& mqtt_topic, string_vector& wildcards) const;
+private:
+  bool
+  add_wildcard (const std::string& mqtt_topic, const mqtt_sub *sub);
+  const mqtt_sub *
+  match_levels (const topic_node *node,
+                const std::vector<line_view>& levels,
+                size_t level,
+                std::vector<line_view>& matched) const;
+  std::unordered_map<line_view, const mqtt_pub *, line_view_hash> _publication_index;
+  std::vector<const mqtt_pub *> _publication_by_id;
+  std::unordered_map<line_view, const mqtt_sub *, line_view_hash> _subscription_index;
+  std::deque<topic_node> _topic_nodes; /// The first one is the root
+};
+
+typedef std::shared_ptr<const mqtt_map> mqtt_map_ptr;
+
 #define OptionRequired true
 #define OptionOptional false
 
+/// The type of an option value. The value is parsed into its type once, when
+/// it is set.
+///
+enum OptionType
+{
+  OptionString, OptionBool, OptionInt, OptionEnum
+};
+
+/// A configuration file read into memory and read line by line. The lines are
+/// views into the buffer and are only valid until the file is closed.
+///
+class config_file
+{
+public:
+  config_file (void);
+  ~config_file (void);
+  bool
+  open (const std::string& path);
+  void
+  close (void);
+  bool
+  nextLine (line_view& line);
+  int
+  lineNumber (void) const;
+  line_view
+  contents (void) const;
+  uint64_t
+  hash (void) const;
+  const struct stat&
+  status (void) const;
+private:
+  config_file (const config_file&);
+  config_file&
+  operator= (const config_file&);
+  std::string _buffer;
+  struct stat _status;
+  size_t _offset;
+  int _line_number;
+};
+
+/// A binary snapshot of the tables parsed from a configuration file, stored
+/// next to the file with a ".snapshot" suffix. The snapshot is only used if the
+/// size, modification time and hash of the configuration file are unchanged.
+/// They are taken from the config_file that was read, so a snapshot always
+/// describes the contents it was parsed from.
+///
+/// Values are written with the put methods and read back, in the same order,
+/// with the get methods.
+///
+class config_snapshot
+{
+public:
+  config_snapshot (void);
+  ~config_snapshot (void);
+  bool
+  load (const std::string& source_path, const config_file& source);
+  bool
+  save (const std::string& source_path, const config_file& source);
+  void
+  putString (const std::string& value);
+  void
+  putInt (const int value);
+  void
+  putDouble (const double value);
+  bool
+  getString (std::string& value);
+  bool
+  getInt (int& value);
+  bool
+  getDouble (double& value);
+private:
+  config_snapshot (const config_snapshot&);
+  config_snapshot&
+  operator= (const config_snapshot&);
+  bool
+  getBytes (void *value, size_t length);
+  std::string _buffer;
+  const char *_data;
+  size_t _size;
+  size_t _offset;
+};
+
+/// An option definition. The regular expression only describes the value, and
+/// must contain exactly one group that is the value to keep, e.g. "(true|false)"
+/// or "\"(.*)\"".
+///
 class Option
 {
 public:
   void
   setValue (const std::string& value);
+  bool
+  parseValue (const line_view& value);
+  void
+  reset (void);
+  void
+  setGiven (void);
+  bool
+  isGiven (void) const;
   std::string
-  getRegEx (void);
+  getRegEx (void) const;
   bool
-  isRequired (void);
+  isRequired (void) const;
   std::string
-  getDefaultValue (void);
+  getDefaultValue (void) const;
   std::string
-  getValue (void);
+  getValue (void) const;
+  OptionType
+  getType (void) const;
+  const std::string&
+  getString (void) const;
+  bool
+  getBool (void) const;
+  long
+  getInt (void) const;
+  int
+  getEnum (void) const;
   Option (void);
   Option (const bool required, const std::string& default_value,
-          const std::string& reg_ex);
+          const std::string& reg_ex, OptionType type = OptionString);
 private:
+  void
+  parseType (void);
   string _value;
   string _reg_ex;
   string _default_value;
   bool _required;
+  bool _given;
+  const regex_t *_compiled_reg_ex;
+  OptionType _type;
+  bool _bool_value;
+  long _int_value;
+  int _enum_value;
+  string_vector _enum_values;
+};
+
+/// A set of option definitions, looked up by the option key.
+///
+class OptionSchema
+{
+public:
+  Option&
+  operator[] (const std::string& key);
+  Option *
+  find (const line_view& key);
+  size_t
+  count (const std::string& key) const;
+  size_t
+  reset (void);
+  string_vector
+  missingRequired (void) const;
+private:
+  std::map<std::string, Option> _options;
+  std::unordered_map<line_view, Option *, line_view_hash> _index;
 };
 
-extern std::map<std::string, mqtt_pub> openDHANA_mqtt_publications;
-extern std::map<std::string, mqtt_sub> openDHANA_mqtt_subscriptions;
-extern std::map<std::string, Option> openDHANA_option_store;
+extern OptionSchema openDHANA_option_store;
+
+/// A reference to an option in openDHANA_option_store, looked up once. The
+/// value is read in constant time without copying. A lookup that fails, the
+/// option isn't defined yet, isn't kept and is retried on the next read.
+///
+class option_handle
+{
+public:
+  option_handle (const char *name);
+  const std::string&
+  value (void) const;
+  bool
+  enabled (void) const;
+  long
+  number (void) const;
+  int
+  choice (void) const;
+private:
+  const Option *
+  option (void) const;
+  const char *_name;
+  mutable std::atomic<const Option *> _option;
+};
 extern bool dhana_mqtt_debug;
 extern bool dhana_mqtt_exiting;
 
@@ -140,6 +587,31 @@ extern bool dhana_mqtt_exiting;
 // openDHANA__generic__
 //=============================================================================
 
+extern void
+openDHANA__generic__log_start ();
+
+extern void
+openDHANA__generic__log_stop ();
+
+extern void
+openDHANA__generic__log_flush_sites (bool all);
+
+extern log_facility *
+openDHANA__generic__log_facility (const std::string& name);
+
+extern int
+openDHANA__generic__log_level (const std::string& facility);
+
+extern bool
+openDHANA__generic__log_set_level (const std::string& facility, int level);
+
+extern bool
+openDHANA__generic__log_set_level (const std::string& facility,
+                                   const std::string& level);
+
+extern void
+openDHANA__generic__log_control (const std::string& control);
+
 extern void
 openDHANA__generic__log_error (const std::string& facility,
                                const std::string& error_message,
@@ -164,6 +636,17 @@ openDHANA__generic__log_starting (const std::string& module);
 void
 openDHANA__generic__log_stopping (const std::string& module);
 
+extern const regex_t *
+openDHANA__generic__reg_ex_compiled (const std::string& regex,
+                                     const std::string& data);
+
+extern void
+openDHANA__generic__reg_ex_cache_statistics (unsigned long& hits,
+                                             unsigned long& compiles);
+
+extern void
+openDHANA__generic__reg_ex_cache_clear ();
+
 extern bool
 openDHANA__generic__reg_ex_match (const std::string& regex,
                                   const std::string& data);
@@ -183,6 +666,12 @@ openDHANA__generic__md5_hash (const std::string& string);
 extern std::string
 openDHANA___generic__md5_hash_unique ();
 
+extern void
+openDHANA__generic__signal_start ();
+
+extern void
+openDHANA__generic__signal_ready (int fd, uint32_t events);
+
 extern void
 openDHANA__generic__process_loop ();
 
@@ -201,6 +690,52 @@ openDHANA__generic__init_process ();
 extern void
 openDHANA__generic__kill_process ();
 
+//=============================================================================
+// openDHANA__reactor__
+//=============================================================================
+
+/// What drives the connection and the file monitor. Same order as the values
+/// of mqtt_event_loop.
+///
+enum EventLoop
+{
+  EventLoopThreads, EventLoopEpoll
+};
+
+/// Called by the reactor with the file descriptor and the epoll events.
+///
+typedef void (*reactor_callback) (int fd, uint32_t events);
+
+extern bool
+openDHANA__reactor__enabled ();
+
+extern bool
+openDHANA__reactor__start ();
+
+extern void
+openDHANA__reactor__add (int fd, uint32_t events, reactor_callback callback);
+
+extern void
+openDHANA__reactor__modify (int fd, uint32_t events);
+
+extern void
+openDHANA__reactor__remove (int fd);
+
+extern int
+openDHANA__reactor__timer (reactor_callback callback);
+
+extern void
+openDHANA__reactor__arm (int timer, long ms, long interval_ms);
+
+extern bool
+openDHANA__reactor__armed (int timer);
+
+extern void
+openDHANA__reactor__set_idle (void (*idle) (void));
+
+extern void
+openDHANA__reactor__run ();
+
 //=============================================================================
 // openDHANA__config__
 //=============================================================================
@@ -208,9 +743,38 @@ openDHANA__generic__kill_process ();
 extern struct stat
 openDHANA__config__file_monitor_scan_directory (const std::string& path);
 
+extern void
+openDHANA__config__file_monitor_schedule (const std::string& path,
+                                          void (*callback) (std::string));
+
+extern void
+openDHANA__config__file_monitor_call (const std::string& path,
+                                      void (*callback) (std::string));
+
+extern void*
+openDHANA__config__file_monitor_dispatch_thread (void *param);
+
+extern void
+openDHANA__config__file_monitor_dispatch_ready (int fd, uint32_t events);
+
+extern bool
+openDHANA__config__file_monitor_read_events (std::set<std::string>& changed);
+
+extern void
+openDHANA__config__file_monitor_poll (bool all);
+
+extern void
+openDHANA__config__file_monitor_events ();
+
 extern void*
 openDHANA__config__file_monitor_thread (void *param);
 
+extern void
+openDHANA__config__file_monitor_inotify_ready (int fd, uint32_t events);
+
+extern void
+openDHANA__config__file_monitor_poll_ready (int fd, uint32_t events);
+
 extern void
 openDHANA__config__file_monitor_start ();
 
@@ -221,6 +785,18 @@ openDHANA__config__file_monitor (const std::string& file_or_dir,
 extern bool
 openDHANA__config__process_this_line (const std::string& line);
 
+extern bool
+openDHANA__config__process_this_line (const line_view& line);
+
+extern bool
+openDHANA__config__tokenize_line (const line_view& line,
+                                  line_view& command,
+                                  line_view& parameters);
+
+extern bool
+openDHANA__config__tokenize_parameters (const line_view& all_options,
+                                        line_view_vector& options);
+
 extern string_vector
 openDHANA__config__split_line (const std::string& line);
 
@@ -248,9 +824,13 @@ openDHANA__options__uknown_definition (const string definition);
 extern string_vector
 openDHANA__options__read_file (const std::string& path);
 
+extern bool
+openDHANA__options__check (const line_view_vector& given_options,
+                           OptionSchema& defined_options);
+
 extern bool
 openDHANA__options__check (const string_vector& given_options,
-                           std::map<std::string, Option>& defined_options);
+                           OptionSchema& defined_options);
 
 extern void
 openDHANA__options__set_generic ();
@@ -267,9 +847,41 @@ openDHANA__options__get (const std::string& option_file,
 // openDHANA_mqtt__
 //=============================================================================
 
+extern mqtt_map_ptr
+openDHANA_mqtt__config_files__get_map ();
+
+extern const mqtt_map_ptr&
+openDHANA_mqtt__config_files__current_map ();
+
+extern bool
+openDHANA_mqtt__config_files__map_stale ();
+
+extern void
+openDHANA_mqtt__config_files__refresh_map ();
+
+extern bool
+openDHANA_mqtt__config_files__load_snapshot (const std::string& path,
+                                             const config_file& file,
+                                             mqtt_map& map);
+
+extern void
+openDHANA_mqtt__config_files__save_snapshot (const std::string& path,
+                                             const config_file& file,
+                                             const mqtt_map& map);
+
 extern void
 openDHANA_mqtt__config_files__read_mqttmap (const std::string& path);
 
+extern void
+openDHANA_mqtt__config_files__diff_subscriptions (const std::map<std::string, mqtt_sub>& old_subscriptions,
+                                                  const std::map<std::string, mqtt_sub>& new_subscriptions,
+                                                  std::map<std::string, mqtt_sub>& added,
+                                                  std::map<std::string, mqtt_sub>& removed);
+
+extern int
+openDHANA_mqtt__config_files__diff_publications (const std::map<std::string, mqtt_pub>& old_publications,
+                                                 const std::map<std::string, mqtt_pub>& new_publications);
+
 extern void
 openDHANA_mqtt__config_files__config_changed (const string path);
 
@@ -286,14 +898,60 @@ extern void
 openDHANA_mqtt__communication__unsubscribe (const std::map<std::string, mqtt_sub>& mqtt_subscriptions);
 
 extern void
-openDHANA_mqtt__communication__publish (std::map<std::string, mqtt_pub>& mqtt_publications,
-                                        const std::string& internal_topic,
+openDHANA_mqtt__communication__publish (const std::string& internal_topic,
                                         const std::string& value);
 
+extern void
+openDHANA_mqtt__communication__publish (topic_id topic,
+                                        const std::string& value);
+
+extern uint64_t
+openDHANA_mqtt__publish_queue__now ();
+
+extern void
+openDHANA_mqtt__publish_queue__map_changed ();
+
+extern void
+openDHANA_mqtt__publish_queue__start ();
+
+extern void
+openDHANA_mqtt__publish_queue__stop ();
+
+extern void
+openDHANA_mqtt__publish_queue__stats (publish_queue_stats& stats);
+
+extern void
+openDHANA_mqtt__broker__wake ();
+
+extern void
+openDHANA_mqtt__broker__accepted ();
+
+extern void
+openDHANA_mqtt__broker__refused (int result);
+
+extern bool
+openDHANA_mqtt__publish_filter__pass (const mqtt_pub& pub,
+                                      const std::string& value,
+                                      long& wait_ms);
+
+extern void
+openDHANA_mqtt__publish_filter__sent (const mqtt_pub& pub,
+                                      const std::string& value);
+
+extern topic_id
+openDHANA_mqtt__topics__intern (const std::string& internal_topic);
+
+extern topic_id
+openDHANA_mqtt__topics__find (const std::string& internal_topic);
+
+extern std::string
+openDHANA_mqtt__topics__name (topic_id topic);
+
 extern void
 openDHANA_mqtt__communication__connect_callback (struct mosquitto *mosq,
                                                  void *userdata,
-                                                 int result);
+                                                 int result,
+                                                 int flags);
 
 extern void
 openDHANA_mqtt__communication__subscribe_callback (struct mosquitto *mosq,
@@ -319,11 +977,18 @@ openDHANA_mqtt__communication__disconnect_broker ();
 
 typedef int (*lua_callback)(lua_State *);
 extern std::map <std::string, lua_callback> openDHANA__lua__lua_functions;
-extern string_map openDHANA__lua__value_cache;
+extern std::map<topic_id, std::string> openDHANA__lua__value_cache;
 
 extern void
 openDHANA__lua__call_function_in_all_scripts (const std::string& function,
-                                              const std::string& message);
+                                              const line_view& message,
+                                              const string_vector& arguments = string_vector ());
+
+extern void
+openDHANA__lua__call_function_in_all_scripts (topic_id topic,
+                                              const std::string& function,
+                                              const line_view& message,
+                                              const string_vector& arguments);
 
 extern bool
 openDHANA__lua__start_script (const string& path);
@@ -334,6 +999,14 @@ openDHANA__lua__stop_script (string path);
 extern bool
 openDHANA__lua__stop_all_scripts ();
 
+extern bool
+openDHANA__lua__script_hash (const string& path, uint64_t& hash);
+
+extern void
+openDHANA__lua__log_script_time (const string& what,
+                                 const string& path,
+                                 const struct timespec& start);
+
 extern bool
 openDHANA__lua__lua_dir_read (const string& path);
 
@@ -358,8 +1031,10 @@ openDHANA__lua_function__publish (lua_State *L);
 
 
 extern void
-moduleMessageCallback (const std::string& internal_topic,
-                       const std::string& message);
+moduleMessageCallback (topic_id topic,
+                       const std::string& internal_topic,
+                       const line_view& message,
+                       const string_vector& wildcards);
 
 
 
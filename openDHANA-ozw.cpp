@@ -24,7 +24,7 @@
 #define OZW_USER_PATH       "/etc/openDHANA/ozw/"
 #define OZW_CONFIG_PATH     "/usr/local/etc/openzwave/"
 
-#define OZW_INFO(facility, message)         if (openDHANA_ozw_debug) openDHANA__generic__log_info (facility, message, __func__, __LINE__)
+#define OZW_INFO(facility, message)         INFO (facility, message)
 
 #include "Options.h"
 #include "Manager.h"
@@ -54,10 +54,19 @@ typedef enum {
 
 message_gate openDHANA_message_gate = gate_awake_nodes;
 
-string_map value_cache;
+// The values of ozw_message_gate, in the same order as the option
+enum MessageGate {
+	MessageGateNone, MessageGateAwakeNodes, MessageGateAllNodes
+};
+
+std::map<topic_id, string> value_cache;
+
+// The internal topic of each value, so it is only formatted once
+std::map<uint64_t, topic_id> value_topics;
 
 class raw_message {
 public:
+	topic_id topic;
 	string internal_topic;
 	string message;
 };
@@ -97,31 +106,43 @@ static pthread_mutex_t initMutex = PTHREAD_MUTEX_INITIALIZER;
 ///
 
 void ozw_publish_mqtt(int nodeID, ValueID valueID, const std::string& message) {
-	char internal_topic[256];
+	topic_id topic;
+	std::map<uint64_t, topic_id>::const_iterator it = value_topics.find(
+			valueID.GetId());
+
+	if (it != value_topics.end()) {
+		topic = it->second;
+	} else {
+		char internal_topic[256];
+
+		snprintf(internal_topic, sizeof(internal_topic), "%d:%s:%s:%d:%d:%s",
+				nodeID, genreToString[valueID.GetGenre()].c_str(),
+				commandClassToString[valueID.GetCommandClassId()].c_str(),
+				valueID.GetInstance(), valueID.GetIndex(),
+				valueTypeToString[valueID.GetType()].c_str());
 
-	snprintf(internal_topic, sizeof(internal_topic), "%d:%s:%s:%d:%d:%s",
-			nodeID, genreToString[valueID.GetGenre()].c_str(),
-			commandClassToString[valueID.GetCommandClassId()].c_str(),
-			valueID.GetInstance(), valueID.GetIndex(),
-			valueTypeToString[valueID.GetType()].c_str());
+		topic = openDHANA_mqtt__topics__intern(internal_topic);
+		value_topics[valueID.GetId()] = topic;
+	}
 
 	INFO("zwave/comms",
-			"openzwave message : \"" + string(internal_topic) + "\" = \""
-					+ message + "\".");
+			"openzwave message : \"" + openDHANA_mqtt__topics__name(topic)
+					+ "\" = \"" + message + "\".");
 
-	value_cache[internal_topic] = message;
-	openDHANA_mqtt__communication__publish(openDHANA_mqtt_publications,
-			internal_topic, message);
+	value_cache[topic] = message;
+	openDHANA_mqtt__communication__publish(topic, message);
 }
 
 /// Put a message on the OpenZWave stack.
 ///
 
-void openDHANA_ozw__zwave__put_message(const std::string& internal_topic,
-		const std::string& message) {
+void openDHANA_ozw__zwave__put_message(topic_id topic,
+		const std::string& internal_topic, const std::string& message) {
 	// TODO: Handle system commands
 
-	if (value_cache[internal_topic] == message
+	std::map<topic_id, string>::const_iterator cached = value_cache.find(topic);
+
+	if (cached != value_cache.end() && cached->second == message
 			&& dhana_ozw_ignore_duplicate_messages) {
 		INFO("zwave/comms",
 				"duplicate message \"" + internal_topic + "\" = \"" + message
@@ -228,7 +249,7 @@ void openDHANA_ozw__zwave__put_message(const std::string& internal_topic,
 		}
 
 		if (result)
-			value_cache[internal_topic] = message;
+			value_cache[topic] = message;
 		else
 			WARNING("zwave/comms", "setting value failed.");
 	}
@@ -241,7 +262,8 @@ void openDHANA_ozw__zwave__put_all_messages() {
 	while (startup_queue.empty() == false) {
 		raw_message msg = startup_queue.front();
 
-		openDHANA_ozw__zwave__put_message(msg.internal_topic, msg.message);
+		openDHANA_ozw__zwave__put_message(msg.topic, msg.internal_topic,
+				msg.message);
 
 		startup_queue.pop();
 	}
@@ -420,25 +442,27 @@ void OnNotification(Notification const* _notification, void* _context) {
 // Manager:HealNetworkNode:1::::
 // ^(\d*):(\w*):(\w*):(\d*):(\d*):(\w*)$
 
-void moduleMessageCallback(const std::string& internal_topic,
-		const std::string& message) {
+void moduleMessageCallback(topic_id topic, const std::string& internal_topic,
+		const line_view& message, const string_vector& wildcards) {
 
 //  if ((openDHANA_stack_state == state_driver_ready && openDHANA_message_gate == gate_none)
 //      || (openDHANA_stack_state == state_awake_nodes && openDHANA_message_gate == gate_awake_nodes)
 //      || (openDHANA_stack_state == state_all_nodes && openDHANA_message_gate == gate_all_nodes))
 	if (true) {
-		openDHANA_ozw__zwave__put_message(internal_topic, message);
+		// OpenZWave takes the values as strings
+		openDHANA_ozw__zwave__put_message(topic, internal_topic, message.str());
 	} else {
 		// The OpenZWave stack is still polling nodes. Queue commands instead
 		// of sending them to the stack.
 
 		INFO("zwave/comms",
 				"the message gate is active, \"" + internal_topic + "\" = \""
-						+ message + "\", queued.");
+						+ message.str() + "\", queued.");
 
 		raw_message msg;
+		msg.topic = topic;
 		msg.internal_topic = internal_topic;
-		msg.message = message;
+		msg.message = message.str();
 		startup_queue.push(msg);
 	}
 }
@@ -650,152 +674,161 @@ void dhana_ozw_setup() {
 void openDHANA_ozw__options__set_ozw() {
 
 	openDHANA_option_store["ozw_port"] = Option(OptionOptional, "/dev/ttyUSB0",
-			"^\\s*(ozw_port)\\s*=\\s*\"(.*)\"\\s*$");
+			"\"(.*)\"");
 	openDHANA_option_store["ozw_port_type"] = Option(OptionOptional, "",
-			"^\\s*(ozw_port_type)\\s*=\\s*\"(.*)\"\\s*$");
+			"\"(.*)\"");
 	openDHANA_option_store["ozw_debug"] = Option(OptionOptional, "false",
-			"^\\s*(ozw_debug)\\s*=\\s*(true|false)\\s*$");
+			"(true|false)", OptionBool);
 	openDHANA_option_store["ozw_options_file"] = Option(OptionOptional,
-			OPTIONS_FILE_OZW, "^\\s*(ozw_options_file)\\s*=\\s*\"(.*)\"\\s*$");
+			OPTIONS_FILE_OZW, "\"(.*)\"");
 	openDHANA_option_store["ozw_ignore_duplicate_messages"] = Option(
 			OptionOptional, "true",
-			"^\\s*(ozw_ignore_duplicate_messages)\\s*=\\s*(true|false)\\s*$");
+			"(true|false)", OptionBool);
 	openDHANA_option_store["ozw_message_gate"] =
 			Option(OptionOptional, "awake_nodes",
-					"^\\s*(ozw_message_gate)\\s*=\\s*(none|awake_nodes|all_nodes)\\s*$");
+					"(none|awake_nodes|all_nodes)", OptionEnum);
 
 	// openZWave options
 	openDHANA_option_store["ozw_user_path"] = Option(OptionOptional,
-			OZW_USER_PATH, "^\\s*(ozw_user_path)\\s*=\\s*\"(.*)\"\\s*$");
+			OZW_USER_PATH, "\"(.*)\"");
 	openDHANA_option_store["ozw_config_path"] = Option(OptionOptional,
-			OZW_CONFIG_PATH, "^\\s*(ozw_config_path)\\s*=\\s*\"(.*)\"\\s*$");
+			OZW_CONFIG_PATH, "\"(.*)\"");
 	openDHANA_option_store["ozw_logging"] = Option(OptionOptional, "true",
-			"^\\s*(ozw_logging)\\s*=\\s*(true|false)\\s*$");
+			"(true|false)", OptionBool);
 	openDHANA_option_store["ozw_console_output"] = Option(OptionOptional,
-			"true", "^\\s*(ozw_console_output)\\s*=\\s*(true|false)\\s*$");
+			"true", "(true|false)", OptionBool);
 	openDHANA_option_store["ozw_log_file_name"] = Option(OptionOptional,
-			"OZW_Log.txt", "^\\s*(ozw_log_file_name)\\s*=\\s*\"(.*)\"\\s*$");
+			"OZW_Log.txt", "\"(.*)\"");
 	openDHANA_option_store["ozw_append_log_file"] = Option(OptionOptional,
-			"false", "^\\s*(ozw_append_log_file)\\s*=\\s*(true|false)\\s*$");
+			"false", "(true|false)", OptionBool);
 	openDHANA_option_store["ozw_save_log_level"] = Option(OptionOptional, "7",
-			"^\\s*(ozw_save_log_level)\\s*=\\s*([0-9])\\s*$");
+			"([0-9])", OptionInt);
 	openDHANA_option_store["ozw_queue_log_level"] = Option(OptionOptional, "8",
-			"^\\s*(ozw_queue_log_level)\\s*=\\s*([0-9])\\s*$");
+			"([0-9])", OptionInt);
 	openDHANA_option_store["ozw_dump_trigger_level"] = Option(OptionOptional,
-			"0", "^\\s*(ozw_dump_trigger_level)\\s*=\\s*([0-9])\\s*$");
+			"0", "([0-9])", OptionInt);
 	openDHANA_option_store["ozw_associate"] = Option(OptionOptional, "true",
-			"^\\s*(ozw_associate)\\s*=\\s*(true|false)\\s*$");
+			"(true|false)", OptionBool);
 	openDHANA_option_store["ozw_notify_transactions"] = Option(OptionOptional,
 			"false",
-			"^\\s*(ozw_notify_transactions)\\s*=\\s*(true|false)\\s*$");
+			"(true|false)", OptionBool);
 	openDHANA_option_store["ozw_driver_max_attempts"] = Option(OptionOptional,
-			"0", "^\\s*(ozw_driver_max_attempts)\\s*=\\s*([0-9]+)\\s*$");
+			"0", "([0-9]+)", OptionInt);
 	openDHANA_option_store["ozw_save_configuration"] = Option(OptionOptional,
-			"true", "^\\s*(ozw_save_configuration)\\s*=\\s*(true|false)\\s*$");
+			"true", "(true|false)", OptionBool);
 	openDHANA_option_store["ozw_poll_interval"] = Option(OptionOptional,
 			"30000", // Every 10 minutes
-			"^\\s*(ozw_poll_interval)\\s*=\\s*([0-9]+)\\s*$");
+			"([0-9]+)", OptionInt);
 	openDHANA_option_store["ozw_interval_between_polls"] = Option(
 			OptionOptional, "false",
-			"^\\s*(ozw_interval_between_polls)\\s*=\\s*(true|false)\\s*$");
+			"(true|false)", OptionBool);
 	openDHANA_option_store["ozw_perform_return_routes"] = Option(OptionOptional,
 			"true",
-			"^\\s*(ozw_perform_return_routes)\\s*=\\s*(true|false)\\s*$");
+			"(true|false)", OptionBool);
 	openDHANA_option_store["ozw_include"] = Option(OptionOptional, "",
-			"^\\s*(ozw_include)\\s*=\\s*\"(.*)\"\\s*$");
+			"\"(.*)\"");
 	openDHANA_option_store["ozw_exclude"] = Option(OptionOptional, "",
-			"^\\s*(ozw_exclude)\\s*=\\s*\"(.*)\"\\s*$");
+			"\"(.*)\"");
 	openDHANA_option_store["ozw_suppress_value_refresh"] = Option(
 			OptionOptional, "false",
-			"^\\s*(ozw_suppress_value_refresh)\\s*=\\s*(true|false)\\s*$");
+			"(true|false)", OptionBool);
 	openDHANA_option_store["ozw_retry_timeout"] = Option(OptionOptional,
-			"40000", "^\\s*(ozw_retry_timeout)\\s*=\\s*([0-9]+)\\s*$");
+			"40000", "([0-9]+)", OptionInt);
 	openDHANA_option_store["ozw_network_key"] = Option(OptionOptional, "",
-			"^\\s*(ozw_network_key)\\s*=\\s*\"(.*)\"\\s*$");
+			"\"(.*)\"");
 	openDHANA_option_store["ozw_enable_sis"] = Option(OptionOptional, "true",
-			"^\\s*(ozw_enable_sis)\\s*=\\s*(true|false)\\s*$");
+			"(true|false)", OptionBool);
 	openDHANA_option_store["ozw_assume_awake"] = Option(OptionOptional, "true",
-			"^\\s*(ozw_assume_awake)\\s*=\\s*(true|false)\\s*$");
+			"(true|false)", OptionBool);
 	openDHANA_option_store["ozw_refresh_all_user_codes"] = Option(
 			OptionOptional, "false",
-			"^\\s*(ozw_refresh_all_user_codes)\\s*=\\s*(true|false)\\s*$");
+			"(true|false)", OptionBool);
 	openDHANA_option_store["ozw_validate_value_changes"] = Option(
 			OptionOptional, "true",
-			"^\\s*(ozw_validate_value_changes)\\s*=\\s*(true|false)\\s*$");
+			"(true|false)", OptionBool);
 }
 
 ///
 
 void openDHANA_ozw__options__process() {
 
-	openDHANA_ozw_debug = OPTION (ozw_debug) == "true" ? true : false;
+	openDHANA_ozw_debug = OPTION_BOOL (ozw_debug);
+	// ozw_debug is the level of "ozw/network", unless mqtt_log_levels set it
+	if (openDHANA__generic__log_level("ozw/network") == LOG_LEVEL_DEFAULT)
+		openDHANA__generic__log_set_level("ozw/network",
+				openDHANA_ozw_debug ? LOG_LEVEL_INFO : LOG_LEVEL_WARNING);
 	dhana_ozw_ignore_duplicate_messages =
-	OPTION (ozw_ignore_duplicate_messages) == "true" ? true : false;
+	OPTION_BOOL (ozw_ignore_duplicate_messages);
 
-	if (OPTION (ozw_message_gate) == "none")
+	switch (OPTION_ENUM(ozw_message_gate)) {
+	case MessageGateNone:
 		openDHANA_message_gate = gate_none;
-	if (OPTION (ozw_message_gate) == "awake_nodes")
+		break;
+	case MessageGateAwakeNodes:
 		openDHANA_message_gate = gate_awake_nodes;
-	if (OPTION (ozw_message_gate) == "all_nodes")
+		break;
+	case MessageGateAllNodes:
 		openDHANA_message_gate = gate_all_nodes;
+		break;
+	}
 
 	// OpenZWave stack options
-	Options::Create(OPTION(ozw_config_path), OPTION(ozw_user_path), "");
+	Options::Create(OPTION_STRING(ozw_config_path), OPTION_STRING(ozw_user_path), "");
 
-	if (OPTION (ozw_user_path) != "")
-		Options::Get()->AddOptionString("UserPath", OPTION(ozw_user_path),
+	if (!OPTION_STRING (ozw_user_path).empty ())
+		Options::Get()->AddOptionString("UserPath", OPTION_STRING(ozw_user_path),
 				false);
-	if (OPTION (ozw_config_path) != "")
-		Options::Get()->AddOptionString("ConfigPath", OPTION(ozw_config_path),
+	if (!OPTION_STRING (ozw_config_path).empty ())
+		Options::Get()->AddOptionString("ConfigPath", OPTION_STRING(ozw_config_path),
 				false);
 	Options::Get()->AddOptionBool("Logging",
-	OPTION (ozw_logging) == "true" ? true : false);
+	OPTION_BOOL (ozw_logging));
 	Options::Get()->AddOptionBool("ConsoleOutput",
-	OPTION (ozw_console_output) == "true" ? true : false);
-	if (OPTION (ozw_log_file_name) != "")
+	OPTION_BOOL (ozw_console_output));
+	if (!OPTION_STRING (ozw_log_file_name).empty ())
 		Options::Get()->AddOptionString("LogFileName",
-				OPTION(ozw_log_file_name), false);
+				OPTION_STRING(ozw_log_file_name), false);
 	Options::Get()->AddOptionBool("AppendLogFile",
-	OPTION (ozw_append_log_file) == "true" ? true : false);
+	OPTION_BOOL (ozw_append_log_file));
 	Options::Get()->AddOptionInt("SaveLogLevel",
-			atoi(OPTION (ozw_save_log_level).c_str()));
+			OPTION_INT (ozw_save_log_level));
 	Options::Get()->AddOptionInt("QueueLogLevel",
-			atoi(OPTION (ozw_queue_log_level).c_str()));
+			OPTION_INT (ozw_queue_log_level));
 	Options::Get()->AddOptionInt("DumpTriggerLevel",
-			atoi(OPTION (ozw_dump_trigger_level).c_str()));
+			OPTION_INT (ozw_dump_trigger_level));
 	Options::Get()->AddOptionBool("Associate",
-	OPTION (ozw_associate) == "true" ? true : false);
+	OPTION_BOOL (ozw_associate));
 	Options::Get()->AddOptionBool("NotifyTransactions",
-	OPTION (ozw_notify_transactions) == "true" ? true : false);
+	OPTION_BOOL (ozw_notify_transactions));
 	Options::Get()->AddOptionInt("DriverMaxAttempts",
-			atoi(OPTION (ozw_driver_max_attempts).c_str()));
+			OPTION_INT (ozw_driver_max_attempts));
 	Options::Get()->AddOptionBool("SaveConfiguration",
-	OPTION (ozw_save_configuration) == "true" ? true : false);
+	OPTION_BOOL (ozw_save_configuration));
 	Options::Get()->AddOptionInt("PollInterval",
-			atoi(OPTION (ozw_poll_interval).c_str()));
+			OPTION_INT (ozw_poll_interval));
 	Options::Get()->AddOptionBool("IntervalBetweenPolls",
-	OPTION (ozw_interval_between_polls) == "true" ? true : false);
+	OPTION_BOOL (ozw_interval_between_polls));
 	Options::Get()->AddOptionBool("PerformReturnRoutes",
-	OPTION (ozw_perform_return_routes) == "true" ? true : false);
-	if (OPTION (ozw_log_file_name) != "")
-		Options::Get()->AddOptionString("Include", OPTION(ozw_include), false);
-	if (OPTION (ozw_log_file_name) != "")
-		Options::Get()->AddOptionString("Exclude", OPTION(ozw_exclude), false);
+	OPTION_BOOL (ozw_perform_return_routes));
+	if (!OPTION_STRING (ozw_include).empty ())
+		Options::Get()->AddOptionString("Include", OPTION_STRING(ozw_include), false);
+	if (!OPTION_STRING (ozw_exclude).empty ())
+		Options::Get()->AddOptionString("Exclude", OPTION_STRING(ozw_exclude), false);
 	Options::Get()->AddOptionBool("SuppressValueRefresh",
-	OPTION (ozw_suppress_value_refresh) == "true" ? true : false);
+	OPTION_BOOL (ozw_suppress_value_refresh));
 	Options::Get()->AddOptionInt("RetryTimeout",
-			atoi(OPTION (ozw_retry_timeout).c_str()));
-	if (OPTION (ozw_network_key) != "")
-		Options::Get()->AddOptionString("NetworkKey", OPTION(ozw_network_key),
+			OPTION_INT (ozw_retry_timeout));
+	if (!OPTION_STRING (ozw_network_key).empty ())
+		Options::Get()->AddOptionString("NetworkKey", OPTION_STRING(ozw_network_key),
 				false);
 	Options::Get()->AddOptionBool("EnableSIS",
-	OPTION (ozw_enable_sis) == "true" ? true : false);
+	OPTION_BOOL (ozw_enable_sis));
 	Options::Get()->AddOptionBool("AssumeAwake",
-	OPTION (ozw_assume_awake) == "true" ? true : false);
+	OPTION_BOOL (ozw_assume_awake));
 	Options::Get()->AddOptionBool("RefreshAllUserCodes",
-	OPTION (ozw_refresh_all_user_codes) == "true" ? true : false);
+	OPTION_BOOL (ozw_refresh_all_user_codes));
 	Options::Get()->AddOptionBool("ValidateValueChanges",
-	OPTION (ozw_validate_value_changes) == "true" ? true : false);
+	OPTION_BOOL (ozw_validate_value_changes));
 	Options::Get()->Lock();
 }
 
@@ -837,7 +870,7 @@ int main(int argc, char* argv[]) {
 
 	Manager::Get()->AddWatcher(OnNotification, NULL);
 
-	std::string port = OPTION(ozw_port);
+	std::string port = OPTION_STRING(ozw_port);
 
 	Manager::Get()->AddDriver(port);
 
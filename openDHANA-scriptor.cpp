@@ -26,23 +26,33 @@
 
 /// We get a message from the MQTT broker
 ///
+/// @param topic                the id of the internal topic.
 /// @param internal_topic       the internal topic that the MQTT topic
 ///                             translated into.
-/// @param message              the MQTT message
+/// @param message              the MQTT message, a view of the payload that
+///                             is only valid during the call.
+/// @param wildcards            the levels of the MQTT topic matched by the
+///                             wildcards of the subscription.
 ///
 
 void
-moduleMessageCallback (const std::string& internal_topic,
-                       const std::string& message)
+moduleMessageCallback (topic_id topic,
+                       const std::string& internal_topic,
+                       const line_view& message,
+                       const string_vector& wildcards)
 {
-  // Cache the message
-  openDHANA__lua__value_cache[internal_topic] = message;
+  // Cache the message. A wildcard subscription gets messages from many
+  // topics, the last one would be a wrong start value.
+  if (wildcards.empty ())
+    openDHANA__lua__value_cache[topic].assign (message.data, message.length);
 
   INFO ("mqtt/comms",
-        "internal_topic: \"" + internal_topic + "\" = \"" + message + "\".");
+        "internal_topic: \"" + internal_topic + "\" = \"" + message.str ()
+        + "\".");
 
   // Find out which scripts have a callback for the internal_topic
-  openDHANA__lua__call_function_in_all_scripts (internal_topic, message);
+  openDHANA__lua__call_function_in_all_scripts (topic, internal_topic,
+                                                message, wildcards);
 }
 
 
@@ -54,11 +64,11 @@ openDHANA_scriptor__options__set_scriptor ()
 {
   openDHANA_option_store["scriptor_options_file"] =
           Option (OptionOptional, OPTIONS_FILE_SCRIPTOR,
-                  "^\\s*(scriptor_options_file)\\s*=\\s*\"(.*)\"\\s*$");
+                  "\"(.*)\"");
 
   openDHANA_option_store["scriptor_lua_directory"] =
           Option (OptionOptional, "lua",
-                  "^\\s*(scriptor_lua_directory)\\s*=\\s*\"(.*)\"\\s*$");
+                  "\"(.*)\"");
 }
 
 /// Process scriptors options
@@ -108,10 +118,10 @@ main (int argc, char *argv[])
 
   // Get the current Lua scripts, and start them
   openDHANA__lua__add_external_functions ();
-  openDHANA__lua__lua_dir_read (OPTION (scriptor_lua_directory));
+  openDHANA__lua__lua_dir_read (OPTION_STRING (scriptor_lua_directory));
 
   // And monitor it for changes
-  openDHANA__config__file_monitor (OPTION (scriptor_lua_directory),
+  openDHANA__config__file_monitor (OPTION_STRING (scriptor_lua_directory),
                                    &openDHANA__lua__lua_dir_changed);
 
   // Let the threads do their work and wait for exit signal